@@ -11,65 +11,354 @@
 #ifndef ALLVM_ANALYSIS_ABCDB_H
 #define ALLVM_ANALYSIS_ABCDB_H
 
+#include "allvm-analysis/AllexeMembers.h"
+#include "allvm-analysis/ContentHash.h"
+#include "allvm-analysis/PathPool.h"
+
 #include <allvm/Allexe.h>
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/DenseMap.h>
-#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/Optional.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/iterator.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/FileSystem.h>
 
 #include <vector>
 
 namespace allvm_analysis {
 
-struct ModuleInfo {
-  uint32_t ModuleCRC;
-  std::string Filename;
+// Identity of a module, by contents.
+// Hash is left zero if no other module has the same size,
+// in which case the size alone is enough to tell them apart
+// within a scan (see ModuleRef::getFullKey for across scans).
+struct ModuleKey {
+  uint64_t Size = 0;
+  ContentHash Hash;
+
+  bool operator==(const ModuleKey &O) const {
+    return Size == O.Size && Hash == O.Hash;
+  }
+  bool operator!=(const ModuleKey &O) const { return !(*this == O); }
+};
+
+} // end namespace allvm_analysis
+
+namespace llvm {
+template <> struct DenseMapInfo<allvm_analysis::ModuleKey> {
+  using ModuleKey = allvm_analysis::ModuleKey;
+  static inline ModuleKey getEmptyKey() {
+    ModuleKey K;
+    K.Size = ~0ULL;
+    return K;
+  }
+  static inline ModuleKey getTombstoneKey() {
+    ModuleKey K;
+    K.Size = ~0ULL - 1;
+    return K;
+  }
+  static unsigned getHashValue(const ModuleKey &Val) {
+    return static_cast<unsigned>(Val.Hash.Low ^ Val.Size);
+  }
+  static bool isEqual(const ModuleKey &LHS, const ModuleKey &RHS) {
+    return LHS == RHS;
+  }
+};
+} // end namespace llvm
+
+namespace allvm_analysis {
+
+class ABCDB;
+class AllexeRef;
+template <typename RefT> class ref_range;
+
+// Modules and allexes are numbered densely, in scan order.
+using ModuleID = uint32_t;
+using AllexeID = uint32_t;
+
+// Handle to a module in an ABCDB, cheap to copy.
+class ModuleRef {
+  const ABCDB *DB;
+  ModuleID ID;
+
+public:
+  ModuleRef(const ABCDB *DB, ModuleID ID) : DB(DB), ID(ID) {}
+
+  ModuleID getID() const { return ID; }
+  uint32_t getCRC() const;
+  const ModuleKey &getKey() const;
+  // Key with the hash filled in even if the size is unique in this
+  // scan, for telling modules apart across scans (mirror, symbol
+  // index). Hash is zero unless computed by ABCDB::hashModules first.
+  ModuleKey getFullKey() const;
+  std::string getFilename() const;
+  // File to read the module's bitcode from: its copy in the mirror
+  // if one is used (see ABCDB::useMirror), otherwise getFilename().
+  std::string getBitcodePath() const;
+  // File with the summary of the original module kept alongside its
+  // copy in the mirror, empty if the module isn't read from one.
+  std::string getMirrorSummaryPath() const;
+  // Allexes containing this module
+  ref_range<AllexeRef> allexes() const;
+  size_t getNumAllexes() const;
+
+  bool operator==(const ModuleRef &O) const {
+    return DB == O.DB && ID == O.ID;
+  }
+  bool operator!=(const ModuleRef &O) const { return !(*this == O); }
+};
+
+// Iterator over handles for a sequence of IDs: either all of them in
+// order, or those listed in an array (such as the modules of an allexe).
+template <typename RefT>
+class ref_iterator
+    : public llvm::iterator_facade_base<ref_iterator<RefT>,
+                                        std::random_access_iterator_tag, RefT,
+                                        std::ptrdiff_t, RefT *, RefT> {
+  const ABCDB *DB = nullptr;
+  const uint32_t *IDs = nullptr;
+  uint32_t Pos = 0;
+
+public:
+  ref_iterator() = default;
+  ref_iterator(const ABCDB *DB, const uint32_t *IDs, uint32_t Pos)
+      : DB(DB), IDs(IDs), Pos(Pos) {}
+
+  RefT operator*() const { return RefT(DB, IDs ? IDs[Pos] : Pos); }
+
+  bool operator==(const ref_iterator &O) const { return Pos == O.Pos; }
+  bool operator<(const ref_iterator &O) const { return Pos < O.Pos; }
+  std::ptrdiff_t operator-(const ref_iterator &O) const {
+    return std::ptrdiff_t(Pos) - std::ptrdiff_t(O.Pos);
+  }
+  ref_iterator &operator+=(std::ptrdiff_t N) {
+    Pos += N;
+    return *this;
+  }
+  ref_iterator &operator-=(std::ptrdiff_t N) {
+    Pos -= N;
+    return *this;
+  }
 };
 
+template <typename RefT> class ref_range {
+  ref_iterator<RefT> B, E;
+
+public:
+  ref_range(ref_iterator<RefT> B, ref_iterator<RefT> E) : B(B), E(E) {}
+
+  ref_iterator<RefT> begin() const { return B; }
+  ref_iterator<RefT> end() const { return E; }
+  size_t size() const { return E - B; }
+  bool empty() const { return B == E; }
+  RefT operator[](size_t N) const { return B[N]; }
+};
+
+using module_iterator = ref_iterator<ModuleRef>;
+using module_range = ref_range<ModuleRef>;
+
+// Handle to an allexe in an ABCDB, cheap to copy.
+class AllexeRef {
+  const ABCDB *DB;
+  AllexeID ID;
+
+public:
+  AllexeRef(const ABCDB *DB, AllexeID ID) : DB(DB), ID(ID) {}
+
+  AllexeID getID() const { return ID; }
+  std::string getFilename() const;
+  module_range modules() const;
+  size_t getNumModules() const { return modules().size(); }
+
+  bool operator==(const AllexeRef &O) const {
+    return DB == O.DB && ID == O.ID;
+  }
+  bool operator!=(const AllexeRef &O) const { return !(*this == O); }
+};
+
+using allexe_iterator = ref_iterator<AllexeRef>;
+using allexe_range = ref_range<AllexeRef>;
+
+// Identity of a scanned file, used to find what changed between scans.
+// Filled in from stat() while walking the directory, see ForEachFile.cpp.
+struct FileStamp {
+  uint64_t Device = 0;
+  uint64_t File = 0;
+  uint64_t Size = 0;
+  uint64_t MTime = 0; // nanoseconds since epoch
+
+  bool operator==(const FileStamp &O) const {
+    return Device == O.Device && File == O.File && Size == O.Size &&
+           MTime == O.MTime;
+  }
+  bool operator!=(const FileStamp &O) const { return !(*this == O); }
+};
+
+// What kind of scan produced an ABCDB.
+enum class ScanKind : uint32_t { Allexes, Bitcode };
+
 class ABCDB {
 public:
+  // Scan for allexes or bitcode files in InputDirectory.
+  // If Previous is given, files that are unchanged since that scan
+  // (same file identity, size, and mtime) are taken from it
+  // instead of being opened again.
+  // The directory is walked and files are opened using the given number
+  // of threads (0 for all cores), the result does not depend on it.
+  // Compressed allexe members are inflated through Cache if given.
   static llvm::Expected<std::unique_ptr<ABCDB>>
-  loadFromAllexesIn(llvm::StringRef InputDirectory, allvm::ResourcePaths &RP);
+  loadFromAllexesIn(llvm::StringRef InputDirectory, allvm::ResourcePaths &RP,
+                    const ABCDB *Previous = nullptr, unsigned Threads = 1,
+                    AllexeMemberCache *Cache = nullptr);
   static llvm::Expected<std::unique_ptr<ABCDB>>
-  loadFromBitcodeIn(llvm::StringRef InputDirectory, allvm::ResourcePaths &RP);
+  loadFromBitcodeIn(llvm::StringRef InputDirectory, allvm::ResourcePaths &RP,
+                    const ABCDB *Previous = nullptr, unsigned Threads = 1);
 
-  auto begin() const { return Modules.begin(); }
-  auto end() const { return Modules.end(); }
-  auto size() const { return Modules.size(); }
+  // Load catalog previously written using writeToDisk().
+  static llvm::Expected<std::unique_ptr<ABCDB>>
+  loadFromDisk(llvm::StringRef Path);
+
+  size_t getNumModules() const { return Mods.size(); }
+  size_t getNumAllexes() const { return Allexes.size(); }
+  ModuleRef getModule(ModuleID ID) const { return {this, ID}; }
+  AllexeRef getAllexe(AllexeID ID) const { return {this, ID}; }
+  // Module with the given key, if any.
+  llvm::Optional<ModuleID> findModule(const ModuleKey &Key) const {
+    auto I = ModuleMap.find(Key);
+    if (I == ModuleMap.end())
+      return llvm::None;
+    return I->second;
+  }
 
-  auto allexe_begin() const { return Allexes.begin(); }
-  auto allexe_end() const { return Allexes.end(); }
-  auto allexe_size() const { return Allexes.size(); }
-  auto &getAllexes() const { return Allexes; }
+  module_range getMods() const {
+    return {module_iterator(this, nullptr, 0),
+            module_iterator(this, nullptr, Mods.size())};
+  }
+  allexe_range getAllexes() const {
+    return {allexe_iterator(this, nullptr, 0),
+            allexe_iterator(this, nullptr, Allexes.size())};
+  }
+  auto allexe_begin() const { return getAllexes().begin(); }
+  auto allexe_end() const { return getAllexes().end(); }
+  auto allexe_size() const { return getNumAllexes(); }
 
-  auto &getMods() const { return Infos; }
+  // Allexes containing any of the given modules, in order.
+  std::vector<AllexeID>
+  getAllexesContainingAny(llvm::ArrayRef<ModuleID> IDs) const;
 
-  // ABCDB() { C.setDiscardValueNames(true); }
+  ScanKind getScanKind() const { return Kind; }
+  llvm::StringRef getScanRoot() const { return Root; }
 
+  // Write catalog of modules and allexes, see ABCDBOnDisk.cpp for format.
   llvm::Error writeToDisk(llvm::StringRef Path);
 
+  // Hash the contents of the given modules whose key has no hash, for
+  // getFullKey(). Modules that can't be read keep a zero hash.
+  // Not safe to call concurrently with itself or getFullKey().
+  void hashModules(llvm::ArrayRef<ModuleID> IDs, unsigned Threads = 0) const;
+
+  // Read modules' bitcode from their copies in the mirror in Dir
+  // (see Mirror.h) where it has them. Returns the number of those.
+  llvm::Expected<size_t> useMirror(llvm::StringRef Dir, unsigned Threads = 0);
+
 private:
-  // llvm::Error addModulesFrom(const Allexe &A);
+  friend class ModuleRef;
+  friend class AllexeRef;
 
-  // llvm::LLVMContext C;
+  // Returns existing module if one with the same key was already added.
+  ModuleID addModule(uint32_t CRC, llvm::StringRef Filename,
+                     const ModuleKey &Key);
+  AllexeID addAllexe(llvm::StringRef Filename, const FileStamp &Stamp,
+                     llvm::ArrayRef<ModuleID> Modules);
+  // Build module -> allexe index once all allexes have been added.
+  void buildReverseIndex();
 
-  // TODO: remove this
-  std::vector<llvm::Module *> Modules;
+  // All paths, modules and allexes refer to them by ID.
+  PathPool Paths;
 
-  // TODO: Rework this class entirely O:)
+  struct ModuleData {
+    uint32_t CRC;
+    PathPool::PathID Path;
+    ModuleKey Key;
+  };
+  std::vector<ModuleData> Mods;
+  llvm::DenseMap<ModuleKey, ModuleID> ModuleMap;
+  // Hashes of modules whose key has none, computed on demand
+  mutable std::vector<ContentHash> FullHashes;
 
-  llvm::DenseMap<uint32_t, ModuleInfo> ModuleMap;
-  std::vector<ModuleInfo> Infos;
-  struct AllexeDesc {
-    std::string Filename;
-    llvm::SmallVector<ModuleInfo, 1> Modules;
+  struct AllexeData {
+    PathPool::PathID Path;
+    FileStamp Stamp;
   };
-  std::vector<AllexeDesc> Allexes;
+  std::vector<AllexeData> Allexes;
+
+  // Modules of allexe I are Edges[EdgeBegin[I] .. EdgeBegin[I + 1]).
+  std::vector<uint32_t> EdgeBegin = {0};
+  std::vector<ModuleID> Edges;
+
+  // Reverse of the above: allexes containing module I are
+  // RevEdges[RevEdgeBegin[I] .. RevEdgeBegin[I + 1]), each listed once.
+  std::vector<uint32_t> RevEdgeBegin;
+  std::vector<AllexeID> RevEdges;
+
+  // All bitcode files found (bitcode scans only), including duplicates
+  // of other modules.
+  struct BitcodeFile {
+    PathPool::PathID Path;
+    FileStamp Stamp;
+    ModuleID Module;
+  };
+  std::vector<BitcodeFile> BitcodeFiles;
+
+  // Files found during the scan that weren't allexes/bitcode,
+  // remembered so incremental scans don't need to open them again.
+  struct SkippedFile {
+    PathPool::PathID Path;
+    FileStamp Stamp;
+  };
+  std::vector<SkippedFile> Skipped;
+
+  ScanKind Kind = ScanKind::Allexes;
+  std::string Root;
+
+  // Mirror in use, if any, and which modules it has
+  std::string MirrorDir;
+  std::vector<bool> Mirrored;
 };
 
+inline uint32_t ModuleRef::getCRC() const { return DB->Mods[ID].CRC; }
+inline const ModuleKey &ModuleRef::getKey() const { return DB->Mods[ID].Key; }
+inline ModuleKey ModuleRef::getFullKey() const {
+  ModuleKey K = getKey();
+  if (K.Hash.isZero() && ID < DB->FullHashes.size())
+    K.Hash = DB->FullHashes[ID];
+  return K;
+}
+inline std::string ModuleRef::getFilename() const {
+  return DB->Paths.get(DB->Mods[ID].Path);
+}
+
+inline allexe_range ModuleRef::allexes() const {
+  auto *IDs = DB->RevEdges.data() + DB->RevEdgeBegin[ID];
+  auto N = DB->RevEdgeBegin[ID + 1] - DB->RevEdgeBegin[ID];
+  return {allexe_iterator(DB, IDs, 0), allexe_iterator(DB, IDs, N)};
+}
+inline size_t ModuleRef::getNumAllexes() const {
+  return DB->RevEdgeBegin[ID + 1] - DB->RevEdgeBegin[ID];
+}
+
+inline std::string AllexeRef::getFilename() const {
+  return DB->Paths.get(DB->Allexes[ID].Path);
+}
+inline module_range AllexeRef::modules() const {
+  auto *IDs = DB->Edges.data() + DB->EdgeBegin[ID];
+  auto N = DB->EdgeBegin[ID + 1] - DB->EdgeBegin[ID];
+  return {module_iterator(DB, IDs, 0), module_iterator(DB, IDs, N)};
+}
+
 } // end namespace allvm_analysis
 
 #endif // ALLVM_ANALYSIS_ABCDB_H
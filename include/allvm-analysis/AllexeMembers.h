@@ -0,0 +1,83 @@
+//===-- AllexeMembers.h ---------------------------------------------------===//
+//
+// Bitcode of the modules in an allexe, without inflating it on every use.
+//
+// Allexes are zip archives. Members stored uncompressed are used in place
+// from a mapping of the allexe, with no copy. Compressed members are
+// inflated by allvm::Allexe, and with an AllexeMemberCache, kept on disk
+// under the hash of their compressed bytes so later runs (and other
+// subcommands) map the cached copy instead.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_ALLEXEMEMBERS_H
+#define ALLVM_ANALYSIS_ALLEXEMEMBERS_H
+
+#include <allvm/Allexe.h>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace allvm_analysis {
+
+// Directory of inflated allexe members, one file each.
+// Safe to use from multiple threads (and processes).
+class AllexeMemberCache {
+public:
+  explicit AllexeMemberCache(llvm::StringRef Dir) : Dir(Dir) {}
+
+  size_t getNumHits() const { return Hits; }
+  size_t getNumMisses() const { return Misses; }
+
+private:
+  friend class AllexeMembers;
+
+  std::string Dir;
+  std::atomic<size_t> Hits{0}, Misses{0};
+};
+
+class AllexeMembers {
+public:
+  // A must have been opened from Filename.
+  static llvm::Expected<std::unique_ptr<AllexeMembers>>
+  open(const allvm::Allexe &A, llvm::StringRef Filename,
+       AllexeMemberCache *Cache = nullptr);
+
+  size_t size() const { return Members.size(); }
+
+  // Bitcode of module I (in allvm::Allexe numbering), valid as long as
+  // this object is.
+  llvm::Expected<llvm::MemoryBufferRef> getBitcode(size_t I);
+
+private:
+  struct Member {
+    // Zip compression method, 0 if stored; -1 if not found in the archive
+    int Method = -1;
+    uint64_t DataOffset = 0;
+    uint64_t CompressedSize = 0;
+    uint64_t Size = 0;
+    uint32_t CRC = 0;
+    std::unique_ptr<llvm::MemoryBuffer> Owned;
+  };
+
+  AllexeMembers(const allvm::Allexe &A, AllexeMemberCache *Cache)
+      : A(A), Cache(Cache) {}
+
+  void readDirectory();
+  llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> inflate(size_t I);
+
+  const allvm::Allexe &A;
+  AllexeMemberCache *Cache;
+  std::unique_ptr<llvm::MemoryBuffer> File;
+  std::vector<Member> Members;
+};
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_ALLEXEMEMBERS_H
@@ -0,0 +1,22 @@
+//===-- AtomicFile.h ------------------------------------------------------===//
+//
+// Replacing files so readers never see them partially written.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_ATOMICFILE_H
+#define ALLVM_ANALYSIS_ATOMICFILE_H
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+namespace allvm_analysis {
+
+// Write Data to a temporary file next to Path and rename it to Path,
+// so concurrent readers (and other processes of a run) see either the
+// old file or the whole new one. The temporary is removed on failure.
+llvm::Error writeFileAtomically(llvm::StringRef Path, llvm::StringRef Data);
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_ATOMICFILE_H
@@ -0,0 +1,41 @@
+//===-- BatchReader.h -----------------------------------------------------===//
+//
+// Reading many (small) files whole, such as module bitcode.
+//
+// On Linux with io_uring (5.6 or newer), the opens and reads of a batch of
+// files are each submitted with a single system call instead of one
+// blocking call per file, so the device sees them all at once.
+// Elsewhere, or if io_uring can't be used, files are read one at a time.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_BATCHREADER_H
+#define ALLVM_ANALYSIS_BATCHREADER_H
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace allvm_analysis {
+
+struct FileContents {
+  // Null if the file couldn't be read, see EC.
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  std::error_code EC;
+};
+
+// Whether io_uring is supported by this build and the running kernel.
+bool haveIOUring();
+
+// Read each of the given files, returning contents in the same order.
+// Buffers are null-terminated and named after the file.
+std::vector<FileContents> readFiles(llvm::ArrayRef<std::string> Paths,
+                                    bool UseIOUring = true);
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_BATCHREADER_H
@@ -0,0 +1,50 @@
+//===-- ContentHash.h -----------------------------------------------------===//
+//
+// 128-bit hash of file contents, used to identify modules.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_CONTENTHASH_H
+#define ALLVM_ANALYSIS_CONTENTHASH_H
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cstdint>
+#include <tuple>
+
+namespace allvm_analysis {
+
+struct ContentHash {
+  uint64_t Low = 0;
+  uint64_t High = 0;
+
+  // Zero is used for "not computed".
+  bool isZero() const { return !Low && !High; }
+
+  bool operator==(const ContentHash &O) const {
+    return Low == O.Low && High == O.High;
+  }
+  bool operator!=(const ContentHash &O) const { return !(*this == O); }
+  bool operator<(const ContentHash &O) const {
+    return std::tie(High, Low) < std::tie(O.High, O.Low);
+  }
+};
+
+inline llvm::raw_ostream &operator<<(llvm::raw_ostream &OS,
+                                     const ContentHash &H) {
+  return OS << llvm::format_hex_no_prefix(H.High, 16)
+            << llvm::format_hex_no_prefix(H.Low, 16);
+}
+
+// Hash the given bytes (MurmurHash3, x64 128-bit variant).
+ContentHash hashContent(llvm::StringRef Data);
+
+// Hash contents of the file at Path.
+llvm::Expected<ContentHash> hashFile(llvm::StringRef Path);
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_CONTENTHASH_H
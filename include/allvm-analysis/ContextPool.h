@@ -0,0 +1,35 @@
+//===-- ContextPool.h -----------------------------------------------------===//
+//
+// LLVMContexts reused for successive modules loaded on the same thread.
+//
+// Creating and destroying a context per module is a noticeable part of
+// summarizing small ones, and types and constants common to them are
+// then uniqued over and over. LLVM can't reset a context though, as
+// anything uniqued in it lives as long as it does, so each thread's
+// context is replaced once it has been used for enough bitcode.
+//
+// That includes named struct types: a module whose %struct.foo clashes
+// with one left by an earlier module gets %struct.foo.1 instead, and
+// which earlier modules a thread loaded depends on scheduling. So these
+// are only for modules that are analyzed; anything printing IR or
+// writing bitcode must load modules into a context of its own.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_CONTEXTPOOL_H
+#define ALLVM_ANALYSIS_CONTEXTPOOL_H
+
+#include <llvm/IR/LLVMContext.h>
+
+#include <cstddef>
+
+namespace allvm_analysis {
+
+// Context to load a module of the given (bitcode) size into, on this thread.
+// Modules previously loaded into it on this thread must have been destroyed.
+// Names of local values (instructions, arguments, blocks) are discarded.
+llvm::LLVMContext &getThreadContext(size_t BitcodeSize);
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_CONTEXTPOOL_H
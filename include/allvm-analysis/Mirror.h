@@ -0,0 +1,59 @@
+//===-- Mirror.h ----------------------------------------------------------===//
+//
+// Copies of an ABCDB's modules without debug info, for analyses to read.
+//
+// Most of the bytes of bitcode built with debug info are its metadata,
+// which none of the analyses look at but parsing still has to get
+// through. A mirror directory holds a stripped copy of each module,
+// named after the size and full content hash of the original (see
+// ModuleRef::getFullKey), so the same module found in several places,
+// or scans, is mirrored once and a module changed since is not mistaken
+// for it, next to the summary of the original. An index maps those
+// names back to the original modules' files.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_MIRROR_H
+#define ALLVM_ANALYSIS_MIRROR_H
+
+#include "allvm-analysis/ABCDB.h"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+
+#include <string>
+
+namespace allvm_analysis {
+
+// Remove debug info (including debug intrinsic calls), metadata
+// attachments, and named metadata other than module flags, from M.
+// ALLVM/WLLVM sources are module flags, so they are kept.
+void stripForMirror(llvm::Module &M);
+
+// Name of the file in a mirror for the module with the given key.
+std::string getMirrorFileName(const ModuleKey &Key);
+// Name of the file in a mirror holding the summary (see ModuleSummary.h)
+// of the original module with the given key. Debug intrinsics count as
+// instructions and are hashed, so the copy's summary would differ.
+std::string getMirrorSummaryFileName(const ModuleKey &Key);
+
+// Index of the mirror in Dir: original module file, by mirror file name.
+// Empty if there's no mirror there yet, or it was written by a version
+// that didn't keep summaries.
+llvm::Expected<llvm::StringMap<std::string>>
+readMirrorIndex(llvm::StringRef Dir);
+llvm::Error writeMirrorIndex(llvm::StringRef Dir,
+                             const llvm::StringMap<std::string> &Index);
+
+// Compute the full keys (see ABCDB::hashModules) of the modules of DB
+// that may be in the mirror with the given index: a module whose size is
+// unique in DB can only be there if the mirror has one of that size.
+void hashMirrorCandidates(const ABCDB &DB,
+                          const llvm::StringMap<std::string> &Index,
+                          unsigned Threads = 0);
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_MIRROR_H
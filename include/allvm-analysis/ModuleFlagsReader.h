@@ -0,0 +1,55 @@
+//===-- ModuleFlagsReader.h -----------------------------------------------===//
+//
+// Read our module flags directly from bitcode.
+//
+// Materializing module metadata just to look at a single module flag
+// means parsing all of it, which is a lot of work for modules with
+// large amounts of debug info. These instead walk the bitstream and only
+// decode what is needed from the module-level metadata block,
+// skipping everything else.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_MODULEFLAGSREADER_H
+#define ALLVM_ANALYSIS_MODULEFLAGSREADER_H
+
+#include "allvm-analysis/ModuleFlags.h"
+
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <string>
+#include <vector>
+
+namespace allvm_analysis {
+
+// Get strings of the module flag with the given key (string-list flags,
+// like those written by setModuleFlag) from the first module in Buffer.
+// Returns an empty list if there is no such flag.
+// Returned strings point into Buffer.
+llvm::Expected<std::vector<llvm::StringRef>>
+readModuleFlagStrings(llvm::MemoryBufferRef Buffer, llvm::StringRef Key);
+
+inline llvm::Expected<std::string>
+readALLVMSourceString(llvm::MemoryBufferRef Buffer) {
+  auto Sources = readModuleFlagStrings(Buffer, MF_ALLVM_SOURCE);
+  if (!Sources)
+    return Sources.takeError();
+  return llvm::join(Sources->begin(), Sources->end(), ",");
+}
+
+inline llvm::Expected<llvm::StringRef>
+readWLLVMSource(llvm::MemoryBufferRef Buffer) {
+  auto Sources = readModuleFlagStrings(Buffer, MF_WLLVM_SOURCE);
+  if (!Sources)
+    return Sources.takeError();
+  if (Sources->size() != 1)
+    return llvm::StringRef();
+  return Sources->front();
+}
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_MODULEFLAGSREADER_H
@@ -0,0 +1,104 @@
+//===-- ModuleSummary.h ---------------------------------------------------===//
+//
+// Per-module facts that several subcommands need: functions with their
+// hashes and instruction counts, globals, aliases, and asm.
+//
+// Computing these means parsing the module, so they can be kept in a
+// SummaryCache keyed by the contents of the bitcode file.
+// Reruns (and other subcommands) on an unchanged corpus then don't need
+// to parse any IR.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_MODULESUMMARY_H
+#define ALLVM_ANALYSIS_MODULESUMMARY_H
+
+#include <llvm/ADT/Optional.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace allvm_analysis {
+
+struct ModuleSummary {
+  struct Function {
+    std::string Name;
+    bool IsDeclaration;
+    uint64_t Insts; // Zero for declarations
+    uint64_t Hash;  // FunctionComparator hash, zero for declarations
+    // Inline asm called by the function, as "<asm> ---- <constraints>"
+    std::vector<std::string> InlineAsm;
+  };
+  struct Global {
+    std::string Name;
+    bool IsDeclaration;
+  };
+  struct Alias {
+    std::string Name;
+    std::string Aliasee;
+  };
+
+  // In module order
+  std::vector<Function> Functions;
+  std::vector<Global> Globals;
+  std::vector<Alias> Aliases;
+
+  uint64_t Insts = 0;
+  std::string ModuleAsm;
+  std::string WLLVMSource;
+
+  // M must be materialized.
+  static ModuleSummary compute(llvm::Module &M);
+
+  // Compact binary form, as kept in a SummaryCache.
+  std::string serialize() const;
+  // Returns None if Data isn't a summary written by this version.
+  static llvm::Optional<ModuleSummary> deserialize(llvm::StringRef Data);
+};
+
+// Summary of the module in the given bitcode file, computed without cache.
+// Functions are read one at a time, and dropped once summarized.
+// Functions of large modules are split among FunctionThreads threads
+// (0 to auto-detect), each reading and summarizing its share in a context
+// of its own, so one huge module doesn't take as long as all the others.
+llvm::Expected<ModuleSummary>
+computeModuleSummary(llvm::StringRef Filename, unsigned FunctionThreads = 1);
+// Same, for bitcode already in memory.
+llvm::Expected<ModuleSummary>
+computeModuleSummary(llvm::MemoryBufferRef Buffer,
+                     unsigned FunctionThreads = 1);
+
+// Directory of module summaries, one file each, named by the hash of
+// the bitcode they were computed from. Entries from a different version
+// of the analysis (or of LLVM) are ignored and replaced.
+// Safe to use from multiple threads (and processes).
+class SummaryCache {
+public:
+  // Summaries not in the cache are computed with FunctionThreads
+  // (see computeModuleSummary).
+  explicit SummaryCache(llvm::StringRef Dir, unsigned FunctionThreads = 1)
+      : Dir(Dir), FunctionThreads(FunctionThreads) {}
+
+  // Summary of the module in the given bitcode file, from the cache
+  // if there, otherwise computed and added.
+  llvm::Expected<ModuleSummary> get(llvm::StringRef Filename);
+  // Same, for bitcode already in memory.
+  llvm::Expected<ModuleSummary> get(llvm::MemoryBufferRef Buffer);
+
+  size_t getNumHits() const { return Hits; }
+  size_t getNumMisses() const { return Misses; }
+
+private:
+  std::string Dir;
+  unsigned FunctionThreads;
+  std::atomic<size_t> Hits{0}, Misses{0};
+};
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_MODULESUMMARY_H
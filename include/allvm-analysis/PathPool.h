@@ -0,0 +1,56 @@
+//===-- PathPool.h --------------------------------------------------------===//
+//
+// Interned storage for large numbers of paths.
+//
+// Paths are split into directory and file name, and each is stored once.
+// Most paths we deal with live in a handful of directories under
+// /nix/store/<hash>-<name>/..., which are then only stored once.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_PATHPOOL_H
+#define ALLVM_ANALYSIS_PATHPOOL_H
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+
+#include <string>
+#include <vector>
+
+namespace allvm_analysis {
+
+class PathPool {
+public:
+  using PathID = uint32_t;
+
+  // Add path to the pool, returns existing ID if already present.
+  PathID add(llvm::StringRef Path);
+
+  std::string get(PathID ID) const { return (getDir(ID) + getName(ID)).str(); }
+  // Directory, including trailing separator (if any).
+  llvm::StringRef getDir(PathID ID) const { return Dirs[Paths[ID].Dir]; }
+  llvm::StringRef getName(PathID ID) const { return Names[Paths[ID].Name]; }
+
+  size_t size() const { return Paths.size(); }
+
+private:
+  struct Entry {
+    uint32_t Dir;
+    uint32_t Name;
+  };
+  std::vector<Entry> Paths;
+
+  // Interned components, StringMap keys are stable.
+  llvm::StringMap<uint32_t> DirMap;
+  llvm::StringMap<uint32_t> NameMap;
+  std::vector<llvm::StringRef> Dirs;
+  std::vector<llvm::StringRef> Names;
+
+  // (Dir, Name) -> PathID
+  llvm::DenseMap<uint64_t, PathID> PathMap;
+};
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_PATHPOOL_H
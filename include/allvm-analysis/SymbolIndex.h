@@ -0,0 +1,87 @@
+//===-- SymbolIndex.h -----------------------------------------------------===//
+//
+// Index of the symbols defined or declared by each module in an ABCDB.
+//
+// Answering "which modules use symbol X" otherwise means loading every
+// module in the DB. The index is built once (loading each module one
+// last time), can be written next to the catalog, and is looked up
+// directly in the mmap'd file, so queries only touch the matching entries.
+//
+// Modules are recorded by ModuleKey, so an index remains usable for
+// later (incremental) scans: only modules it doesn't know are indexed.
+//
+//===----------------------------------------------------------------------===//
+
+#ifndef ALLVM_ANALYSIS_SYMBOLINDEX_H
+#define ALLVM_ANALYSIS_SYMBOLINDEX_H
+
+#include "allvm-analysis/ABCDB.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <vector>
+
+namespace allvm_analysis {
+
+class SymbolIndex {
+public:
+  enum EntryFlags : uint32_t {
+    Defined = 1 << 0,  // Definition, not just a declaration
+    Function = 1 << 1, // Function (as opposed to variable or alias)
+  };
+
+  // Symbol as found in one module.
+  struct Entry {
+    ModuleID Module;
+    uint32_t Flags;
+    uint32_t NumUses; // Uses of the symbol within that module
+  };
+
+  // Index symbols of all modules in DB. Entries for modules already
+  // indexed in Previous (which must have been loaded for DB) are reused,
+  // only the others are loaded, using the given number of threads
+  // (0 for all cores).
+  static llvm::Expected<std::unique_ptr<SymbolIndex>>
+  build(const ABCDB &DB, const SymbolIndex *Previous = nullptr,
+        unsigned Threads = 1);
+
+  // Load index written using writeToDisk(), possibly for a previous scan.
+  // Modules are matched by full key (see ModuleRef::getFullKey), hashing
+  // those of DB that need it using the given number of threads.
+  static llvm::Expected<std::unique_ptr<SymbolIndex>>
+  loadFromDisk(llvm::StringRef Path, const ABCDB &DB, unsigned Threads = 1);
+
+  llvm::Error writeToDisk(llvm::StringRef Path) const;
+
+  // Modules of DB in the index, sorted by module ID, for the given symbol.
+  std::vector<Entry> lookup(llvm::StringRef Symbol) const;
+
+  // Modules of DB not in the index.
+  llvm::ArrayRef<ModuleID> getMissingModules() const { return Missing; }
+
+  ~SymbolIndex();
+
+private:
+  class Table;
+
+  SymbolIndex() = default;
+  static llvm::Expected<std::unique_ptr<SymbolIndex>>
+  create(std::unique_ptr<llvm::MemoryBuffer> Buffer, const ABCDB &DB,
+         unsigned Threads);
+  // Entries of a symbol as stored in Buffer, skipping modules not in DB.
+  std::vector<Entry> decode(const unsigned char *Data, uint32_t Count) const;
+
+  std::unique_ptr<llvm::MemoryBuffer> Buffer;
+  std::unique_ptr<Table> Symbols;
+  // Index of modules in Buffer -> ID in DB, if there.
+  std::vector<ModuleID> LocalToDB;
+  std::vector<ModuleID> Missing;
+};
+
+} // end namespace allvm_analysis
+
+#endif // ALLVM_ANALYSIS_SYMBOLINDEX_H
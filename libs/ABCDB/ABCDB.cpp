@@ -11,19 +11,32 @@
 #include "ForEachFile.h"
 
 #include "allvm-analysis/ABCDB.h"
+#include "allvm-analysis/ContentHash.h"
+#include "allvm-analysis/ContextPool.h"
+#include "allvm-analysis/Mirror.h"
 #include "allvm-analysis/ModuleFlags.h"
+#include "allvm-analysis/ModuleFlagsReader.h"
 
 #include <allvm/ResourcePaths.h>
 
-#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
 
 //#include <llvm/Support/SourceMgr.h>
 //#include <llvm/IRReader/IRReader.h>
 
-//#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <mutex>
 // UniqueID doesn't work in DenseSet
 #include <unordered_set>
 
@@ -31,50 +44,345 @@ using namespace allvm_analysis;
 using namespace allvm;
 using namespace llvm;
 
+namespace {
+
+// Module as found while scanning, before it is added to the DB.
+struct ModuleInfo {
+  uint32_t ModuleCRC;
+  std::string Filename;
+  ModuleKey Key;
+};
+
+// ModuleKey -> ModuleInfo map shared by the threads loading allexes,
+// sharded by hash to keep lock contention down.
+class ShardedModuleMap {
+  struct Shard {
+    std::mutex Mtx;
+    DenseMap<ModuleKey, ModuleInfo> Map;
+  };
+  std::array<Shard, 64> Shards;
+
+  Shard &getShard(const ModuleKey &Key) {
+    return Shards[Key.Hash.Low % Shards.size()];
+  }
+
+public:
+  // Returns true if this is the first time Key is seen,
+  // in which case the caller is expected to set() its info.
+  bool claim(const ModuleInfo &MI) {
+    auto &S = getShard(MI.Key);
+    std::lock_guard<std::mutex> Lock(S.Mtx);
+    return S.Map.insert({MI.Key, MI}).second;
+  }
+  void set(const ModuleInfo &MI) {
+    auto &S = getShard(MI.Key);
+    std::lock_guard<std::mutex> Lock(S.Mtx);
+    S.Map[MI.Key] = MI;
+  }
+  ModuleInfo get(const ModuleKey &Key) {
+    auto &S = getShard(Key);
+    std::lock_guard<std::mutex> Lock(S.Mtx);
+    return S.Map.lookup(Key);
+  }
+};
+
+} // end anonymous namespace
+
+ModuleID ABCDB::addModule(uint32_t CRC, StringRef Filename,
+                          const ModuleKey &Key) {
+  auto I = ModuleMap.insert({Key, static_cast<ModuleID>(Mods.size())});
+  if (I.second)
+    Mods.push_back({CRC, Paths.add(Filename), Key});
+  return I.first->second;
+}
+
+AllexeID ABCDB::addAllexe(StringRef Filename, const FileStamp &Stamp,
+                          ArrayRef<ModuleID> Modules) {
+  Allexes.push_back({Paths.add(Filename), Stamp});
+  Edges.insert(Edges.end(), Modules.begin(), Modules.end());
+  EdgeBegin.push_back(static_cast<uint32_t>(Edges.size()));
+  return static_cast<AllexeID>(Allexes.size() - 1);
+}
+
+void ABCDB::buildReverseIndex() {
+  // Counting sort of the edges by module, skipping repeats of a module
+  // within the same allexe (which are adjacent).
+  const auto None = ~AllexeID(0);
+  std::vector<AllexeID> Last(Mods.size(), None);
+  RevEdgeBegin.assign(Mods.size() + 1, 0);
+  for (AllexeID A = 0, E = Allexes.size(); A != E; ++A)
+    for (auto I = EdgeBegin[A]; I != EdgeBegin[A + 1]; ++I)
+      if (Last[Edges[I]] != A) {
+        Last[Edges[I]] = A;
+        ++RevEdgeBegin[Edges[I] + 1];
+      }
+  for (size_t M = 0, E = Mods.size(); M != E; ++M)
+    RevEdgeBegin[M + 1] += RevEdgeBegin[M];
+
+  std::vector<uint32_t> Next(RevEdgeBegin.begin(), RevEdgeBegin.end() - 1);
+  std::fill(Last.begin(), Last.end(), None);
+  RevEdges.resize(RevEdgeBegin.back());
+  for (AllexeID A = 0, E = Allexes.size(); A != E; ++A)
+    for (auto I = EdgeBegin[A]; I != EdgeBegin[A + 1]; ++I)
+      if (Last[Edges[I]] != A) {
+        Last[Edges[I]] = A;
+        RevEdges[Next[Edges[I]]++] = A;
+      }
+}
+
+std::string ModuleRef::getBitcodePath() const {
+  if (ID >= DB->Mirrored.size() || !DB->Mirrored[ID])
+    return getFilename();
+  SmallString<128> Path(DB->MirrorDir);
+  sys::path::append(Path, getMirrorFileName(getFullKey()));
+  return Path.str();
+}
+
+std::string ModuleRef::getMirrorSummaryPath() const {
+  if (ID >= DB->Mirrored.size() || !DB->Mirrored[ID])
+    return "";
+  SmallString<128> Path(DB->MirrorDir);
+  sys::path::append(Path, getMirrorSummaryFileName(getFullKey()));
+  return Path.str();
+}
+
+void ABCDB::hashModules(ArrayRef<ModuleID> IDs, unsigned Threads) const {
+  FullHashes.resize(Mods.size());
+  ThreadPool TP(Threads ? Threads : hardware_concurrency());
+  for (auto ID : IDs) {
+    if (!Mods[ID].Key.Hash.isZero() || !FullHashes[ID].isZero())
+      continue;
+    TP.async([this, ID]() {
+      auto Hash = hashFile(Paths.get(Mods[ID].Path));
+      if (Hash)
+        FullHashes[ID] = *Hash;
+      else
+        consumeError(Hash.takeError());
+    });
+  }
+  TP.wait();
+}
+
+Expected<size_t> ABCDB::useMirror(StringRef Dir, unsigned Threads) {
+  auto Index = readMirrorIndex(Dir);
+  if (!Index)
+    return Index.takeError();
+
+  hashMirrorCandidates(*this, *Index, Threads);
+
+  MirrorDir = Dir;
+  Mirrored.assign(Mods.size(), false);
+  size_t N = 0;
+  for (auto M : getMods())
+    if (Index->count(getMirrorFileName(M.getFullKey()))) {
+      Mirrored[M.getID()] = true;
+      ++N;
+    }
+  return N;
+}
+
+std::vector<AllexeID>
+ABCDB::getAllexesContainingAny(ArrayRef<ModuleID> IDs) const {
+  std::vector<AllexeID> Result;
+  for (auto ID : IDs)
+    Result.insert(Result.end(), RevEdges.begin() + RevEdgeBegin[ID],
+                  RevEdges.begin() + RevEdgeBegin[ID + 1]);
+  std::sort(Result.begin(), Result.end());
+  Result.erase(std::unique(Result.begin(), Result.end()), Result.end());
+  return Result;
+}
+
 llvm::Expected<std::unique_ptr<ABCDB>>
-ABCDB::loadFromAllexesIn(StringRef InputDirectory, ResourcePaths &RP) {
+ABCDB::loadFromAllexesIn(StringRef InputDirectory, ResourcePaths &RP,
+                         const ABCDB *Previous, unsigned Threads,
+                         AllexeMemberCache *Cache) {
 
   // DenseMap<uint32_t, size_t> ModuleMap;
 
   auto DB = llvm::make_unique<ABCDB>();
+  DB->Kind = ScanKind::Allexes;
+  DB->Root = InputDirectory;
 
-  auto addAllexe = [&](auto A, StringRef F) -> llvm::Error {
+  // Results of previous scan, by filename
+  StringMap<AllexeID> PrevAllexes;
+  StringMap<const SkippedFile *> PrevSkipped;
+  if (Previous) {
+    for (auto A : Previous->getAllexes())
+      PrevAllexes[A.getFilename()] = A.getID();
+    for (auto &S : Previous->Skipped)
+      PrevSkipped[Previous->Paths.get(S.Path)] = &S;
+  }
+  auto isKnownModule = [Previous](const ModuleKey &Key) {
+    return Previous && Previous->ModuleMap.count(Key);
+  };
 
-    AllexeDesc AD;
-    AD.Filename = F;
-    for (size_t i = 0, e = A->getNumModules(); i != e; ++i) {
-      auto crc = A->getModuleCRC(i);
-
-      // not safe, crc32 collisions and whatnot, but works for now..
-      if (!DB->ModuleMap.count(crc)) {
-        LLVMContext LocalContext;
-        auto M = A->getModule(i, LocalContext);
-        if (!M)
-          return M.takeError();
-        if (auto Err = (*M)->materializeMetadata())
-          return Err;
-        ModuleInfo MI{crc, getALLVMSourceString(M->get())};
-
-        // if (StringRef(MI.Filename).contains("samba")) continue;
-        // if (StringRef(MI.Filename).contains("llvm-all")) continue;
-        // if (StringRef(MI.Filename).contains("llvm-lld")) continue;
-
-        DB->Infos.push_back(MI);
-        DB->ModuleMap.insert({crc, MI});
-
-        // TODO: Add to DB->Modules, but in a way we can find it again
+  // Walk the directory first, then open files in parallel,
+  // and finally add results in walk order so the DB is the same
+  // regardless of the number of threads used.
+  enum class Action { Open, Reuse, Skip };
+  struct FileEntry {
+    std::string Filename;
+    FileStamp Stamp;
+    Action Act = Action::Open;
+    AllexeID Prev = 0;
+
+    // Filled in when opened
+    bool IsAllexe = false;
+    SmallVector<ModuleInfo, 1> Mods;
+  };
+  std::vector<FileEntry> Files;
+  size_t Reused = 0, Changed = 0, Opened = 0;
+
+  auto addFile = [&](StringRef F, const FileStamp &Stamp) -> llvm::Error {
+    FileEntry FE;
+    FE.Filename = F;
+    FE.Stamp = Stamp;
+
+    if (Previous) {
+      auto SI = PrevSkipped.find(F);
+      auto AI = PrevAllexes.find(F);
+      if (SI != PrevSkipped.end() && SI->second->Stamp == FE.Stamp) {
+        FE.Act = Action::Skip;
+      } else if (AI != PrevAllexes.end() &&
+                 Previous->Allexes[AI->second].Stamp == FE.Stamp) {
+        FE.Act = Action::Reuse;
+        FE.Prev = AI->second;
+        ++Reused;
+      } else if (AI != PrevAllexes.end()) {
+        ++Changed;
       }
-      AD.Modules.push_back(DB->ModuleMap[crc]);
     }
 
-    DB->Allexes.push_back(AD);
-
+    Files.push_back(std::move(FE));
     return Error::success();
   };
 
-  if (auto Err = foreach_allexe(InputDirectory, addAllexe, RP))
+  if (auto Err = foreach_file_status_in_directory(InputDirectory, addFile,
+                                                  true, true, Threads))
     return std::move(Err);
 
+  ShardedModuleMap Loaded;
+  std::mutex ErrMtx;
+  Error LoadErr = Error::success();
+  std::atomic<bool> Failed{false};
+
+  auto openFile = [&](FileEntry &FE) {
+    if (Failed)
+      return;
+
+    auto MaybeAllexe = Allexe::openForReading(FE.Filename, RP);
+    if (!MaybeAllexe) {
+      consumeError(MaybeAllexe.takeError());
+      return;
+    }
+    auto &A = *MaybeAllexe;
+    FE.IsAllexe = true;
+
+    auto fail = [&](Error Err) {
+      std::lock_guard<std::mutex> Lock(ErrMtx);
+      LoadErr = joinErrors(std::move(LoadErr), std::move(Err));
+      Failed = true;
+    };
+
+    auto Members = AllexeMembers::open(*A, FE.Filename, Cache);
+    if (!Members)
+      return fail(Members.takeError());
+
+    for (size_t i = 0, e = A->getNumModules(); i != e; ++i) {
+      // CRC32 isn't enough to tell modules apart, hash the contents.
+      auto Buf = (*Members)->getBitcode(i);
+      if (!Buf)
+        return fail(Buf.takeError());
+
+      ModuleInfo MI;
+      MI.ModuleCRC = A->getModuleCRC(i);
+      MI.Key.Size = Buf->getBufferSize();
+      MI.Key.Hash = hashContent(Buf->getBuffer());
+      FE.Mods.push_back(MI);
+
+      if (isKnownModule(MI.Key) || !Loaded.claim(MI))
+        continue;
+
+      // Try reading the source flag straight from the bitcode first,
+      // loading the module is only needed if that doesn't work out.
+      auto Source = readALLVMSourceString(*Buf);
+      if (Source && !Source->empty()) {
+        MI.Filename = std::move(*Source);
+        Loaded.set(MI);
+        continue;
+      }
+      if (!Source)
+        consumeError(Source.takeError());
+
+      auto &C = getThreadContext(Buf->getBufferSize());
+      auto M = getLazyBitcodeModule(*Buf, C);
+      Error Err = M ? (*M)->materializeMetadata() : M.takeError();
+      if (Err)
+        return fail(std::move(Err));
+
+      // if (StringRef(MI.Filename).contains("samba")) continue;
+      // if (StringRef(MI.Filename).contains("llvm-all")) continue;
+      // if (StringRef(MI.Filename).contains("llvm-lld")) continue;
+
+      MI.Filename = getALLVMSourceString(M->get());
+      Loaded.set(MI);
+    }
+  };
+
+  {
+    ThreadPool TP(Threads ? Threads : heavyweight_hardware_concurrency());
+    for (auto &FE : Files)
+      if (FE.Act == Action::Open)
+        TP.async([&openFile, &FE]() { openFile(FE); });
+    TP.wait();
+  }
+  if (LoadErr)
+    return std::move(LoadErr);
+
+  auto addPrevModule = [&](ModuleRef M) {
+    return DB->addModule(M.getCRC(), M.getFilename(), M.getKey());
+  };
+
+  SmallVector<ModuleID, 8> IDs;
+  for (auto &FE : Files) {
+    IDs.clear();
+    switch (FE.Act) {
+    case Action::Skip:
+      DB->Skipped.push_back({DB->Paths.add(FE.Filename), FE.Stamp});
+      continue;
+    case Action::Reuse:
+      for (auto M : Previous->getAllexe(FE.Prev).modules())
+        IDs.push_back(addPrevModule(M));
+      DB->addAllexe(FE.Filename, FE.Stamp, IDs);
+      continue;
+    case Action::Open:
+      break;
+    }
+
+    ++Opened;
+    if (!FE.IsAllexe) {
+      DB->Skipped.push_back({DB->Paths.add(FE.Filename), FE.Stamp});
+      continue;
+    }
+
+    for (auto &M : FE.Mods) {
+      if (isKnownModule(M.Key)) {
+        auto PrevID = Previous->ModuleMap.lookup(M.Key);
+        IDs.push_back(addPrevModule(Previous->getModule(PrevID)));
+      } else {
+        auto MI = Loaded.get(M.Key);
+        IDs.push_back(DB->addModule(MI.ModuleCRC, MI.Filename, MI.Key));
+      }
+    }
+    DB->addAllexe(FE.Filename, FE.Stamp, IDs);
+  }
+
+  if (Previous)
+    errs() << "Incremental scan: " << Reused << " allexes unchanged, "
+           << Changed << " changed, "
+           << Previous->Allexes.size() - Reused - Changed << " removed, "
+           << Opened << " files opened\n";
+
   // Allexe --> { list of bc }
   // Allexe --> allexe_handle --> getModules() -> list of modules
   //                          \-> getMerged() -> single module, alltogether'd as
@@ -82,6 +390,7 @@ ABCDB::loadFromAllexesIn(StringRef InputDirectory, ResourcePaths &RP) {
   // * BC <--> Analysis
   // * Subgraph <--> Analysis ?
 
+  DB->buildReverseIndex();
   return std::move(DB);
 }
 
@@ -108,35 +417,158 @@ template <> struct DenseMapInfo<llvm::sys::fs::UniqueID> {
 } // end namespace llvm
 
 llvm::Expected<std::unique_ptr<ABCDB>>
-ABCDB::loadFromBitcodeIn(StringRef InputDirectory, ResourcePaths &) {
+ABCDB::loadFromBitcodeIn(StringRef InputDirectory, ResourcePaths &,
+                         const ABCDB *Previous, unsigned Threads) {
   using namespace llvm::sys::fs;
   auto DB = llvm::make_unique<ABCDB>();
+  DB->Kind = ScanKind::Bitcode;
+  DB->Root = InputDirectory;
 
-  // std::unordered_set<UniqueID> BCIDs;
-  DenseSet<UniqueID> BCIDs;
+  // Results of previous scan, by filename
+  StringMap<const BitcodeFile *> PrevBitcode;
+  StringMap<const FileStamp *> PrevSkipped;
+  if (Previous) {
+    for (auto &BF : Previous->BitcodeFiles)
+      PrevBitcode[Previous->Paths.get(BF.Path)] = &BF;
+    for (auto &S : Previous->Skipped)
+      PrevSkipped[Previous->Paths.get(S.Path)] = &S.Stamp;
+  }
+  size_t Reused = 0, Opened = 0;
 
-  auto addIfBC = [&](StringRef Path) -> Error {
-    file_magic magic;
-    if (auto EC = identify_magic(Path, magic)) {
-      errs() << "Error reading magic: " << Path << "\n";
-      return Error::success();
+  // Hard links are the same file, index of first one found.
+  DenseMap<UniqueID, size_t> BCIDs;
+  struct Candidate {
+    std::string Filename;
+    FileStamp Stamp;
+    ModuleKey Key;
+    size_t SameAs;
+  };
+  std::vector<Candidate> Candidates;
+
+  // Walk first, then identify new or changed files (which means opening
+  // them) in parallel, and finally add them in walk order.
+  enum class Action { Identify, Reuse, Skip };
+  struct WalkedFile {
+    std::string Path;
+    FileStamp Stamp;
+    Action Act = Action::Identify;
+    const BitcodeFile *Prev = nullptr;
+    std::error_code MagicEC;
+    file_magic Magic = file_magic::unknown;
+  };
+  std::vector<WalkedFile> Files;
+  auto addFile = [&](StringRef Path, const FileStamp &Stamp) -> Error {
+    WalkedFile WF;
+    WF.Path = Path;
+    WF.Stamp = Stamp;
+    auto SI = PrevSkipped.find(Path);
+    auto BI = PrevBitcode.find(Path);
+    if (SI != PrevSkipped.end() && *SI->second == Stamp) {
+      WF.Act = Action::Skip;
+    } else if (BI != PrevBitcode.end() && BI->second->Stamp == Stamp) {
+      WF.Act = Action::Reuse;
+      WF.Prev = BI->second;
+    }
+    Files.push_back(std::move(WF));
+    return Error::success();
+  };
+  if (auto Err = foreach_file_status_in_directory(InputDirectory, addFile,
+                                                  true, true, Threads))
+    return std::move(Err);
+
+  {
+    ThreadPool TP(Threads ? Threads : hardware_concurrency());
+    for (auto &WF : Files)
+      if (WF.Act == Action::Identify)
+        TP.async([&WF]() { WF.MagicEC = identify_magic(WF.Path, WF.Magic); });
+    TP.wait();
+  }
+
+  for (auto &WF : Files) {
+    if (WF.Act == Action::Skip) {
+      DB->Skipped.push_back({DB->Paths.add(WF.Path), WF.Stamp});
+      continue;
     }
-    if (magic == file_magic::bitcode) {
-      UniqueID ID;
-      if (auto EC = getUniqueID(Path, ID)) {
-        errs() << "Error getting unique id: " << Path << "\n";
-        return Error::success();
+
+    Candidate C;
+    C.Filename = WF.Path;
+    C.Stamp = WF.Stamp;
+    C.Key.Size = WF.Stamp.Size;
+
+    if (WF.Act == Action::Reuse) {
+      // Hash too, if it was needed last time
+      C.Key = Previous->Mods[WF.Prev->Module].Key;
+      ++Reused;
+    } else {
+      ++Opened;
+      if (WF.MagicEC) {
+        errs() << "Error reading magic: " << WF.Path << "\n";
+        continue;
       }
-      if (BCIDs.insert(ID).second) {
-        DB->Infos.push_back({0, Path});
+      if (WF.Magic != file_magic::bitcode) {
+        DB->Skipped.push_back({DB->Paths.add(WF.Path), WF.Stamp});
+        continue;
       }
     }
 
-    return Error::success();
-  };
+    // Identity came from the directory walk, no need to ask again.
+    UniqueID ID(WF.Stamp.Device, WF.Stamp.File);
+    C.SameAs = BCIDs.insert({ID, Candidates.size()}).first->second;
+    Candidates.push_back(std::move(C));
+  }
 
-  if (auto Err = foreach_file_in_directory(InputDirectory, addIfBC))
-    return std::move(Err);
+  // Only files with the same size can have the same contents,
+  // so only those need to be hashed.
+  DenseMap<uint64_t, unsigned> SizeCount;
+  for (size_t i = 0, e = Candidates.size(); i != e; ++i)
+    if (Candidates[i].SameAs == i)
+      ++SizeCount[Candidates[i].Key.Size];
+
+  // Hashes stay zero for files that couldn't be read.
+  size_t Hashed = 0, Duplicates = 0;
+  std::vector<bool> NeedsHash(Candidates.size());
+  {
+    ThreadPool TP(Threads ? Threads : hardware_concurrency());
+    for (size_t i = 0, e = Candidates.size(); i != e; ++i) {
+      auto &C = Candidates[i];
+      if (C.SameAs != i || SizeCount[C.Key.Size] < 2)
+        continue;
+      NeedsHash[i] = true;
+      if (!C.Key.Hash.isZero())
+        continue;
+      ++Hashed;
+      TP.async([&C]() {
+        auto Hash = hashFile(C.Filename);
+        if (Hash)
+          C.Key.Hash = *Hash;
+        else
+          consumeError(Hash.takeError());
+      });
+    }
+    TP.wait();
+  }
+
+  for (size_t i = 0, e = Candidates.size(); i != e; ++i) {
+    auto &C = Candidates[i];
+    if (C.SameAs != i)
+      C.Key = Candidates[C.SameAs].Key;
+    if (NeedsHash[C.SameAs] && C.Key.Hash.isZero()) {
+      errs() << "Error hashing: " << C.Filename << "\n";
+      continue;
+    }
+
+    if (DB->ModuleMap.count(C.Key))
+      ++Duplicates;
+    auto ID = DB->addModule(0, C.Filename, C.Key);
+    DB->BitcodeFiles.push_back({DB->Paths.add(C.Filename), C.Stamp, ID});
+  }
+
+  errs() << "Found " << DB->BitcodeFiles.size() << " bitcode files, "
+         << Duplicates << " duplicates (" << Hashed << " files hashed)\n";
+  if (Previous)
+    errs() << "Incremental scan: " << Reused << " bitcode files unchanged, "
+           << Opened << " files opened\n";
 
+  DB->buildReverseIndex();
   return std::move(DB);
 }
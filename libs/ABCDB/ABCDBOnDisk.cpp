@@ -1,19 +1,451 @@
+//===-- ABCDBOnDisk.cpp ---------------------------------------------------===//
+//
+// Persistent catalog of an ABCDB, so a scan can be reused across runs.
+//
+// Layout (all integers are little-endian uint32_t, except stamps):
+//
+//   Header:  magic, version, scan kind, scan root,
+//            number of modules, allexes, allexe->module edges,
+//            skipped files, and bitcode files, offsets of the sections below.
+//   Modules: OnDiskIterableChainedHashTable,
+//            ModuleKey -> {index, CRC, filename}
+//   Allexes: {filename, first edge, number of edges, stamp} for each allexe
+//   Edges:   module index, for each allexe->module edge
+//   Skipped: {filename, stamp} for each file that was not allexe/bitcode
+//   Bitcode: {filename, module index, stamp} for each bitcode file
+//   Strings: filename bytes, referenced as {offset, size}
+//
+// ModuleKey's are stored as size followed by hash, 3 x uint64_t.
+// Stamps are FileStamp's, 4 x uint64_t, used for incremental rescans.
+// Offsets being uint32_t limits catalogs to 4GB, writeToDisk fails
+// rather than write a larger one.
+//
+// Catalogs are mmap'd when loaded; nothing needs to be parsed beyond
+// copying out the records.
+//
+//===----------------------------------------------------------------------===//
+
 #include "allvm-analysis/ABCDB.h"
 
+#include "allvm-analysis/AtomicFile.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/EndianStream.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/OnDiskHashTable.h>
+#include <llvm/Support/raw_ostream.h>
 
 using namespace allvm_analysis;
 using namespace allvm;
 using namespace llvm;
 
+namespace {
+
+const char CatalogMagic[] = {'A', 'B', 'C', 'D', 'B', 'C', 'A', 'T'};
+const uint32_t CatalogVersion = 4;
+
+struct StrRef {
+  uint32_t Offset;
+  uint32_t Size;
+};
+
+struct CatalogHeader {
+  uint32_t Version;
+  uint32_t Kind;
+  StrRef Root;
+  uint32_t NumModules;
+  uint32_t NumAllexes;
+  uint32_t NumEdges;
+  uint32_t NumSkipped;
+  uint32_t NumBitcodeFiles;
+  uint32_t ModulePayloadOffset;
+  uint32_t ModuleBucketOffset;
+  uint32_t AllexeOffset;
+  uint32_t EdgeOffset;
+  uint32_t SkippedOffset;
+  uint32_t BitcodeFileOffset;
+  uint32_t StringOffset;
+  uint32_t StringSize;
+};
+
+const size_t HeaderSize = sizeof(CatalogMagic) + 18 * sizeof(uint32_t);
+const size_t StampSize = 4 * sizeof(uint64_t);
+const size_t AllexeRecordSize = 4 * sizeof(uint32_t) + StampSize;
+const size_t SkippedRecordSize = 2 * sizeof(uint32_t) + StampSize;
+const size_t BitcodeFileRecordSize = 3 * sizeof(uint32_t) + StampSize;
+
+struct ModuleRecord {
+  uint32_t Index;
+  uint32_t CRC;
+  StrRef Filename;
+};
+
+void writeStamp(support::endian::Writer<support::little> &LE,
+                const FileStamp &S) {
+  LE.write<uint64_t>(S.Device);
+  LE.write<uint64_t>(S.File);
+  LE.write<uint64_t>(S.Size);
+  LE.write<uint64_t>(S.MTime);
+}
+
+FileStamp readStamp(const unsigned char *&P) {
+  using namespace llvm::support;
+  FileStamp S;
+  S.Device = endian::readNext<uint64_t, little, unaligned>(P);
+  S.File = endian::readNext<uint64_t, little, unaligned>(P);
+  S.Size = endian::readNext<uint64_t, little, unaligned>(P);
+  S.MTime = endian::readNext<uint64_t, little, unaligned>(P);
+  return S;
+}
+
+// Trait for the ModuleKey -> ModuleRecord table,
+// shared by the generator and the reader.
+class ModuleTableInfo {
+public:
+  using key_type = ModuleKey;
+  using key_type_ref = const ModuleKey &;
+  using data_type = ModuleRecord;
+  using data_type_ref = const ModuleRecord &;
+  using hash_value_type = uint32_t;
+  using offset_type = uint32_t;
+
+  using internal_key_type = ModuleKey;
+  using external_key_type = ModuleKey;
+
+  static const offset_type KeyLen = 3 * sizeof(uint64_t);
+  static const offset_type DataLen = 4 * sizeof(uint32_t);
+
+  static hash_value_type ComputeHash(key_type_ref Key) {
+    return DenseMapInfo<ModuleKey>::getHashValue(Key);
+  }
+  static bool EqualKey(const internal_key_type &A,
+                       const internal_key_type &B) {
+    return A == B;
+  }
+  static internal_key_type GetInternalKey(const external_key_type &Key) {
+    return Key;
+  }
+  static external_key_type GetExternalKey(const internal_key_type &Key) {
+    return Key;
+  }
+
+  // Records are fixed size, so lengths are not stored.
+  static std::pair<offset_type, offset_type>
+  EmitKeyDataLength(raw_ostream &, key_type_ref, data_type_ref) {
+    return {KeyLen, DataLen};
+  }
+  static void EmitKey(raw_ostream &Out, key_type_ref Key, offset_type) {
+    support::endian::Writer<support::little> LE(Out);
+    LE.write<uint64_t>(Key.Size);
+    LE.write<uint64_t>(Key.Hash.Low);
+    LE.write<uint64_t>(Key.Hash.High);
+  }
+  static void EmitData(raw_ostream &Out, key_type_ref, data_type_ref Data,
+                       offset_type) {
+    support::endian::Writer<support::little> LE(Out);
+    LE.write<uint32_t>(Data.Index);
+    LE.write<uint32_t>(Data.CRC);
+    LE.write<uint32_t>(Data.Filename.Offset);
+    LE.write<uint32_t>(Data.Filename.Size);
+  }
+
+  static std::pair<offset_type, offset_type>
+  ReadKeyDataLength(const unsigned char *&) {
+    return {KeyLen, DataLen};
+  }
+  static internal_key_type ReadKey(const unsigned char *Data, offset_type) {
+    using namespace llvm::support;
+    ModuleKey Key;
+    Key.Size = endian::readNext<uint64_t, little, unaligned>(Data);
+    Key.Hash.Low = endian::readNext<uint64_t, little, unaligned>(Data);
+    Key.Hash.High = endian::readNext<uint64_t, little, unaligned>(Data);
+    return Key;
+  }
+  static data_type ReadData(internal_key_type, const unsigned char *Data,
+                            offset_type) {
+    using namespace llvm::support;
+    ModuleRecord R;
+    R.Index = endian::readNext<uint32_t, little, unaligned>(Data);
+    R.CRC = endian::readNext<uint32_t, little, unaligned>(Data);
+    R.Filename.Offset = endian::readNext<uint32_t, little, unaligned>(Data);
+    R.Filename.Size = endian::readNext<uint32_t, little, unaligned>(Data);
+    return R;
+  }
+};
+
+// Strings are stored once, even if used by multiple entries.
+class StringTable {
+  StringMap<StrRef> Map;
+  std::string Data;
+
+public:
+  StrRef add(StringRef S) {
+    auto I = Map.find(S);
+    if (I != Map.end())
+      return I->second;
+    StrRef R{static_cast<uint32_t>(Data.size()),
+             static_cast<uint32_t>(S.size())};
+    Data.append(S.begin(), S.end());
+    Map[S] = R;
+    return R;
+  }
+  StringRef data() const { return Data; }
+};
+
+void writeHeader(raw_ostream &OS, const CatalogHeader &H) {
+  support::endian::Writer<support::little> LE(OS);
+  OS.write(CatalogMagic, sizeof(CatalogMagic));
+  for (auto V : {H.Version, H.Kind, H.Root.Offset, H.Root.Size, H.NumModules,
+                 H.NumAllexes, H.NumEdges, H.NumSkipped, H.NumBitcodeFiles,
+                 H.ModulePayloadOffset, H.ModuleBucketOffset, H.AllexeOffset,
+                 H.EdgeOffset, H.SkippedOffset, H.BitcodeFileOffset,
+                 H.StringOffset, H.StringSize})
+    LE.write<uint32_t>(V);
+  // Reserved
+  LE.write<uint32_t>(0);
+}
+
+Error invalidCatalog(StringRef Path, const Twine &Reason) {
+  return make_error<StringError>("Invalid ABCDB catalog '" + Path +
+                                     "': " + Reason,
+                                 errc::invalid_argument);
+}
+
+} // end anonymous namespace
+
 llvm::Error ABCDB::writeToDisk(StringRef Path) {
+  StringTable Strings;
+  CatalogHeader H{};
+  H.Version = CatalogVersion;
+  H.Kind = static_cast<uint32_t>(Kind);
+  H.Root = Strings.add(Root);
+
+  // Module indices are their ID's.
+  OnDiskChainedHashTableGenerator<ModuleTableInfo> ModuleTable;
+  for (ModuleID ID = 0, E = Mods.size(); ID != E; ++ID) {
+    auto &MD = Mods[ID];
+    ModuleTable.insert(MD.Key, ModuleRecord{ID, MD.CRC,
+                                            Strings.add(Paths.get(MD.Path))});
+  }
+  H.NumModules = static_cast<uint32_t>(Mods.size());
+  H.NumAllexes = static_cast<uint32_t>(Allexes.size());
+  H.NumSkipped = static_cast<uint32_t>(Skipped.size());
+  H.NumBitcodeFiles = static_cast<uint32_t>(BitcodeFiles.size());
+
+  SmallVector<char, 0> Buffer;
+  raw_svector_ostream OS(Buffer);
+  support::endian::Writer<support::little> LE(OS);
+
+  // Placeholder, rewritten once offsets are known.
+  writeHeader(OS, H);
+
+  H.ModulePayloadOffset = static_cast<uint32_t>(OS.tell());
+  H.ModuleBucketOffset = ModuleTable.Emit(OS);
+
+  H.AllexeOffset = static_cast<uint32_t>(OS.tell());
+  for (AllexeID ID = 0, E = Allexes.size(); ID != E; ++ID) {
+    auto Name = Strings.add(Paths.get(Allexes[ID].Path));
+    LE.write<uint32_t>(Name.Offset);
+    LE.write<uint32_t>(Name.Size);
+    LE.write<uint32_t>(EdgeBegin[ID]);
+    LE.write<uint32_t>(EdgeBegin[ID + 1] - EdgeBegin[ID]);
+    writeStamp(LE, Allexes[ID].Stamp);
+  }
+  H.NumEdges = static_cast<uint32_t>(Edges.size());
+
+  H.EdgeOffset = static_cast<uint32_t>(OS.tell());
+  for (auto ID : Edges)
+    LE.write<uint32_t>(ID);
+
+  H.SkippedOffset = static_cast<uint32_t>(OS.tell());
+  for (auto &S : Skipped) {
+    auto Name = Strings.add(Paths.get(S.Path));
+    LE.write<uint32_t>(Name.Offset);
+    LE.write<uint32_t>(Name.Size);
+    writeStamp(LE, S.Stamp);
+  }
+
+  H.BitcodeFileOffset = static_cast<uint32_t>(OS.tell());
+  for (auto &BF : BitcodeFiles) {
+    auto Name = Strings.add(Paths.get(BF.Path));
+    LE.write<uint32_t>(Name.Offset);
+    LE.write<uint32_t>(Name.Size);
+    LE.write<uint32_t>(BF.Module);
+    writeStamp(LE, BF.Stamp);
+  }
+
+  H.StringOffset = static_cast<uint32_t>(OS.tell());
+  H.StringSize = static_cast<uint32_t>(Strings.data().size());
+  OS << Strings.data();
+
+  // Every offset above (including those within the module table, and
+  // of strings) is at most the size of the whole.
+  if (Buffer.size() > UINT32_MAX)
+    return make_error<StringError>("Unable to write catalog " + Path +
+                                       ": over 4GB",
+                                   errc::file_too_large);
+
+  SmallString<HeaderSize> HeaderBuf;
+  raw_svector_ostream HOS(HeaderBuf);
+  writeHeader(HOS, H);
+  assert(HeaderBuf.size() == HeaderSize);
+  OS.pwrite(HeaderBuf.data(), HeaderBuf.size(), 0);
+
+  return writeFileAtomically(Path, StringRef(Buffer.data(), Buffer.size()));
+}
+
+llvm::Expected<std::unique_ptr<ABCDB>> ABCDB::loadFromDisk(StringRef Path) {
+  using namespace llvm::support;
+
+  // Catalogs are large, let MemoryBuffer mmap them.
+  auto MB = MemoryBuffer::getFile(Path, /* FileSize */ -1,
+                                  /* RequiresNullTerminator */ false);
+  if (!MB)
+    return make_error<StringError>("Unable to open catalog " + Path,
+                                   MB.getError());
+  StringRef Data = (*MB)->getBuffer();
+  auto *Base = reinterpret_cast<const unsigned char *>(Data.data());
+
+  if (Data.size() < HeaderSize ||
+      !Data.startswith(StringRef(CatalogMagic, sizeof(CatalogMagic))))
+    return invalidCatalog(Path, "bad magic");
+
+  const unsigned char *P = Base + sizeof(CatalogMagic);
+  auto next = [&P]() {
+    return endian::readNext<uint32_t, little, unaligned>(P);
+  };
+  CatalogHeader H;
+  H.Version = next();
+  if (H.Version != CatalogVersion)
+    return invalidCatalog(Path, "unsupported version " + Twine(H.Version));
+  H.Kind = next();
+  H.Root.Offset = next();
+  H.Root.Size = next();
+  H.NumModules = next();
+  H.NumAllexes = next();
+  H.NumEdges = next();
+  H.NumSkipped = next();
+  H.NumBitcodeFiles = next();
+  H.ModulePayloadOffset = next();
+  H.ModuleBucketOffset = next();
+  H.AllexeOffset = next();
+  H.EdgeOffset = next();
+  H.SkippedOffset = next();
+  H.BitcodeFileOffset = next();
+  H.StringOffset = next();
+  H.StringSize = next();
+
+  if (H.Kind > static_cast<uint32_t>(ScanKind::Bitcode))
+    return invalidCatalog(Path, "unknown scan kind");
+  auto inBounds = [&](uint64_t Offset, uint64_t Size) {
+    return Offset <= Data.size() && Size <= Data.size() - Offset;
+  };
+  if (!inBounds(H.ModulePayloadOffset, 0) ||
+      !inBounds(H.ModuleBucketOffset, 2 * sizeof(uint32_t)) ||
+      !inBounds(H.AllexeOffset, uint64_t(H.NumAllexes) * AllexeRecordSize) ||
+      !inBounds(H.EdgeOffset, uint64_t(H.NumEdges) * sizeof(uint32_t)) ||
+      !inBounds(H.SkippedOffset, uint64_t(H.NumSkipped) * SkippedRecordSize) ||
+      !inBounds(H.BitcodeFileOffset,
+                uint64_t(H.NumBitcodeFiles) * BitcodeFileRecordSize) ||
+      !inBounds(H.StringOffset, H.StringSize))
+    return invalidCatalog(Path, "truncated");
+
+  StringRef Strings = Data.substr(H.StringOffset, H.StringSize);
+  bool BadString = false;
+  auto getString = [&](StrRef R) -> StringRef {
+    if (uint64_t(R.Offset) + R.Size > Strings.size()) {
+      BadString = true;
+      return {};
+    }
+    return Strings.substr(R.Offset, R.Size);
+  };
+
+  auto DB = llvm::make_unique<ABCDB>();
+  DB->Kind = static_cast<ScanKind>(H.Kind);
+  DB->Root = getString(H.Root);
+
+  using ModuleTable = OnDiskIterableChainedHashTable<ModuleTableInfo>;
+  std::unique_ptr<ModuleTable> Table(
+      ModuleTable::Create(Base + H.ModuleBucketOffset,
+                          Base + H.ModulePayloadOffset, Base));
+  if (Table->getNumEntries() != H.NumModules)
+    return invalidCatalog(Path, "module count mismatch");
+
+  DB->Mods.resize(H.NumModules);
+  std::vector<bool> Seen(H.NumModules);
+  for (auto I = Table->key_begin(), E = Table->key_end(); I != E; ++I) {
+    auto Key = *I;
+    auto Rec = Table->find(Key);
+    assert(Rec != Table->end());
+    auto R = *Rec;
+    if (R.Index >= H.NumModules || Seen[R.Index])
+      return invalidCatalog(Path, "bad module index");
+    Seen[R.Index] = true;
+
+    auto &MD = DB->Mods[R.Index];
+    MD.CRC = R.CRC;
+    MD.Path = DB->Paths.add(getString(R.Filename));
+    MD.Key = Key;
+    DB->ModuleMap.insert({Key, R.Index});
+  }
+
+  const unsigned char *EP = Base + H.EdgeOffset;
+  DB->Edges.reserve(H.NumEdges);
+  for (uint32_t i = 0; i != H.NumEdges; ++i) {
+    auto ID = endian::readNext<uint32_t, little, unaligned>(EP);
+    if (ID >= H.NumModules)
+      return invalidCatalog(Path, "bad module index");
+    DB->Edges.push_back(ID);
+  }
+
+  // Edges of each allexe follow those of the previous one.
+  const unsigned char *AP = Base + H.AllexeOffset;
+  DB->Allexes.reserve(H.NumAllexes);
+  DB->EdgeBegin.reserve(H.NumAllexes + 1);
+  for (uint32_t i = 0; i != H.NumAllexes; ++i) {
+    StrRef Name;
+    Name.Offset = endian::readNext<uint32_t, little, unaligned>(AP);
+    Name.Size = endian::readNext<uint32_t, little, unaligned>(AP);
+    auto First = endian::readNext<uint32_t, little, unaligned>(AP);
+    auto Count = endian::readNext<uint32_t, little, unaligned>(AP);
+    if (First != DB->EdgeBegin.back() || uint64_t(First) + Count > H.NumEdges)
+      return invalidCatalog(Path, "bad edge range");
+
+    auto Stamp = readStamp(AP);
+    DB->Allexes.push_back({DB->Paths.add(getString(Name)), Stamp});
+    DB->EdgeBegin.push_back(First + Count);
+  }
+  if (DB->EdgeBegin.back() != H.NumEdges)
+    return invalidCatalog(Path, "bad edge range");
+
+  const unsigned char *SP = Base + H.SkippedOffset;
+  DB->Skipped.reserve(H.NumSkipped);
+  for (uint32_t i = 0; i != H.NumSkipped; ++i) {
+    StrRef Name;
+    Name.Offset = endian::readNext<uint32_t, little, unaligned>(SP);
+    Name.Size = endian::readNext<uint32_t, little, unaligned>(SP);
+    auto Stamp = readStamp(SP);
+    DB->Skipped.push_back({DB->Paths.add(getString(Name)), Stamp});
+  }
 
-  errs() << "Path: " << Path << "\n";
+  const unsigned char *BP = Base + H.BitcodeFileOffset;
+  DB->BitcodeFiles.reserve(H.NumBitcodeFiles);
+  for (uint32_t i = 0; i != H.NumBitcodeFiles; ++i) {
+    StrRef Name;
+    Name.Offset = endian::readNext<uint32_t, little, unaligned>(BP);
+    Name.Size = endian::readNext<uint32_t, little, unaligned>(BP);
+    auto ID = endian::readNext<uint32_t, little, unaligned>(BP);
+    if (ID >= H.NumModules)
+      return invalidCatalog(Path, "bad module index");
+    auto Stamp = readStamp(BP);
+    DB->BitcodeFiles.push_back({DB->Paths.add(getString(Name)), Stamp, ID});
+  }
 
-  // Key
-  // Value
-  // Rule: Key -> Value
-  // Task: running instance of a rule
+  if (BadString)
+    return invalidCatalog(Path, "bad string reference");
 
-  return Error::success();
+  DB->buildReverseIndex();
+  return std::move(DB);
 }
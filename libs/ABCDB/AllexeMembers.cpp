@@ -0,0 +1,202 @@
+//===-- AllexeMembers.cpp -------------------------------------------------===//
+//
+// Only as much of the zip format as is needed to find members' data:
+// the central directory, located from the end of central directory
+// record, and each member's local header. Members are matched to modules
+// by the name allvm::Allexe reports for them, and must have its CRC32.
+//
+// Anything unexpected (ZIP64, encryption, a member not found) leaves the
+// member to allvm::Allexe, so this is never worse than using it directly.
+//
+// Cache entries are "<Dir>/<hash of compressed data>-<size>.bc", and
+// are only used if they have the member's size and CRC32.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/AllexeMembers.h"
+
+#include "allvm-analysis/AtomicFile.h"
+#include "allvm-analysis/ContentHash.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Compression.h>
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+const uint32_t EOCDSignature = 0x06054b50;
+const uint32_t CentralSignature = 0x02014b50;
+const uint32_t LocalSignature = 0x04034b50;
+const size_t EOCDSize = 22;
+const size_t CentralSize = 46;
+const size_t LocalSize = 30;
+const uint32_t Zip64Marker = 0xffffffff;
+
+uint16_t read16(const char *P) { return support::endian::read16le(P); }
+uint32_t read32(const char *P) { return support::endian::read32le(P); }
+
+// Failing to store the entry only costs the next run some time.
+void storeEntry(StringRef Dir, StringRef EntryPath, StringRef Data) {
+  if (sys::fs::create_directories(Dir))
+    return;
+  consumeError(writeFileAtomically(EntryPath, Data));
+}
+
+} // end anonymous namespace
+
+Expected<std::unique_ptr<AllexeMembers>>
+AllexeMembers::open(const allvm::Allexe &A, StringRef Filename,
+                    AllexeMemberCache *Cache) {
+  std::unique_ptr<AllexeMembers> AM(new AllexeMembers(A, Cache));
+  // Mapped (if large enough), so stored members are read only if used.
+  auto MB = MemoryBuffer::getFile(Filename, /* FileSize */ -1,
+                                  /* RequiresNullTerminator */ false);
+  if (!MB)
+    return make_error<StringError>("Unable to open allexe " + Filename,
+                                   MB.getError());
+  AM->File = std::move(*MB);
+  AM->Members.resize(A.getNumModules());
+  AM->readDirectory();
+  return std::move(AM);
+}
+
+void AllexeMembers::readDirectory() {
+  StringRef Data = File->getBuffer();
+  const char *Base = Data.data();
+  if (Data.size() < EOCDSize)
+    return;
+
+  // The record is last, but may be followed by a comment of up to 64K.
+  size_t Min = Data.size() > EOCDSize + 0xffff ? Data.size() - EOCDSize - 0xffff
+                                               : 0;
+  size_t EOCD;
+  for (EOCD = Data.size() - EOCDSize;; --EOCD) {
+    if (read32(Base + EOCD) == EOCDSignature)
+      break;
+    if (EOCD == Min)
+      return;
+  }
+
+  uint16_t NumEntries = read16(Base + EOCD + 10);
+  uint32_t DirSize = read32(Base + EOCD + 12);
+  uint32_t DirOffset = read32(Base + EOCD + 16);
+  if (DirSize > EOCD || DirOffset == Zip64Marker)
+    return;
+  // Offsets are from the start of the archive, which may not be the
+  // start of the file (if something was prepended to it).
+  uint64_t DirStart = EOCD - DirSize;
+  if (DirStart < DirOffset)
+    return;
+  uint64_t Shift = DirStart - DirOffset;
+
+  StringMap<size_t> ByName;
+  for (size_t I = 0, E = Members.size(); I != E; ++I)
+    ByName[A.getModuleName(I)] = I;
+
+  uint64_t P = DirStart;
+  for (unsigned Entry = 0; Entry != NumEntries; ++Entry) {
+    if (P + CentralSize > EOCD || read32(Base + P) != CentralSignature)
+      return;
+    uint16_t Flags = read16(Base + P + 8);
+    uint16_t Method = read16(Base + P + 10);
+    uint32_t CRC = read32(Base + P + 16);
+    uint32_t CompressedSize = read32(Base + P + 20);
+    uint32_t Size = read32(Base + P + 24);
+    uint64_t Local = read32(Base + P + 42);
+    uint16_t NameSize = read16(Base + P + 28);
+    if (P + CentralSize + NameSize > EOCD)
+      return;
+    StringRef Name(Base + P + CentralSize, NameSize);
+    P += CentralSize + NameSize + read16(Base + P + 30) +
+         read16(Base + P + 32);
+
+    auto It = ByName.find(Name);
+    if (It == ByName.end())
+      continue;
+    auto &M = Members[It->second];
+    if (M.Method >= 0 || A.getModuleCRC(It->second) != CRC)
+      continue;
+    // Encrypted, or sizes in a ZIP64 extra field
+    if ((Flags & 1) || CompressedSize == Zip64Marker || Size == Zip64Marker ||
+        Local == Zip64Marker)
+      continue;
+
+    Local += Shift;
+    if (Local + LocalSize > Data.size() ||
+        read32(Base + Local) != LocalSignature)
+      continue;
+    uint64_t DataOffset = Local + LocalSize + read16(Base + Local + 26) +
+                          read16(Base + Local + 28);
+    if (DataOffset + CompressedSize > Data.size())
+      continue;
+
+    M.Method = Method;
+    M.DataOffset = DataOffset;
+    M.CompressedSize = CompressedSize;
+    M.Size = Size;
+    M.CRC = CRC;
+  }
+}
+
+Expected<std::unique_ptr<MemoryBuffer>> AllexeMembers::inflate(size_t I) {
+  auto &M = Members[I];
+
+  // Entries are checked against the member's CRC32 before use, which
+  // needs zlib.
+  SmallString<128> EntryPath;
+  if (Cache && M.Method >= 0 && zlib::isAvailable()) {
+    EntryPath = Cache->Dir;
+    SmallString<48> Name;
+    raw_svector_ostream NOS(Name);
+    NOS << hashContent(File->getBuffer().substr(M.DataOffset,
+                                                M.CompressedSize))
+        << "-" << M.Size << ".bc";
+    sys::path::append(EntryPath, Name);
+
+    auto Entry = MemoryBuffer::getFile(EntryPath, /* FileSize */ -1,
+                                       /* RequiresNullTerminator */ false);
+    if (Entry) {
+      if ((*Entry)->getBufferSize() == M.Size &&
+          zlib::crc32((*Entry)->getBuffer()) == M.CRC) {
+        ++Cache->Hits;
+        return std::move(*Entry);
+      }
+      // Damaged; replaced below.
+      sys::fs::remove(EntryPath);
+    }
+    ++Cache->Misses;
+  }
+
+  auto Buf = A.getModuleBuffer(I);
+  if (!Buf)
+    return make_error<StringError>("Unable to read module " + Twine(I) +
+                                       " of " + File->getBufferIdentifier(),
+                                   errc::io_error);
+  if (!EntryPath.empty())
+    storeEntry(Cache->Dir, EntryPath, Buf->getBuffer());
+  return std::move(Buf);
+}
+
+Expected<MemoryBufferRef> AllexeMembers::getBitcode(size_t I) {
+  assert(I < Members.size() && "Module index out of range");
+  auto &M = Members[I];
+  if (M.Method == 0 && M.CompressedSize == M.Size)
+    return MemoryBufferRef(File->getBuffer().substr(M.DataOffset, M.Size),
+                           File->getBufferIdentifier());
+
+  if (!M.Owned) {
+    auto Buf = inflate(I);
+    if (!Buf)
+      return Buf.takeError();
+    M.Owned = std::move(*Buf);
+  }
+  return M.Owned->getMemBufferRef();
+}
@@ -0,0 +1,39 @@
+//===-- AtomicFile.cpp ----------------------------------------------------===//
+//
+// Temporaries are "<Path>.tmp-XXXXXX", in the same directory so the
+// rename stays within one filesystem.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/AtomicFile.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+Error allvm_analysis::writeFileAtomically(StringRef Path, StringRef Data) {
+  int FD;
+  SmallString<128> TmpPath;
+  if (auto EC = sys::fs::createUniqueFile(Path + ".tmp-%%%%%%", FD, TmpPath))
+    return make_error<StringError>("Unable to write " + Path, EC);
+  {
+    raw_fd_ostream Out(FD, /* shouldClose */ true);
+    Out << Data;
+    Out.close();
+    if (Out.has_error()) {
+      Out.clear_error();
+      sys::fs::remove(TmpPath);
+      return make_error<StringError>("Unable to write " + Path,
+                                     errc::io_error);
+    }
+  }
+  if (auto EC = sys::fs::rename(TmpPath, Path)) {
+    sys::fs::remove(TmpPath);
+    return make_error<StringError>("Unable to write " + Path, EC);
+  }
+  return Error::success();
+}
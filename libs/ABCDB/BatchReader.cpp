@@ -0,0 +1,363 @@
+//===-- BatchReader.cpp ---------------------------------------------------===//
+//
+// io_uring is used through its system calls directly, so there's no
+// dependency on liburing. Each batch is:
+//
+//   1. an OPENAT for every file, submitted and reaped together,
+//   2. fstat of each opened file to size its buffer (the inode was just
+//      read by the open, so this doesn't wait on the device),
+//   3. a READ for every file, submitted and reaped together,
+//   4. close.
+//
+// Kernels before 5.6 have io_uring but not OPENAT or READ, so the ring
+// is probed for them (IORING_REGISTER_PROBE, itself new in 5.6) once per
+// process, and io_uring isn't used if that fails. Files whose requests
+// still fail with EINVAL or EOPNOTSUPP, that are too large for a single
+// request, or that come up short are read (or finished) the ordinary way.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/BatchReader.h"
+
+#include <llvm/Support/Errc.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+// OPENAT, READ and probing were added along with these flags.
+#if defined(IORING_FEAT_RW_CUR_POS) && defined(IO_URING_OP_SUPPORTED)
+#define ALLVM_USE_IO_URING 1
+#endif
+#endif
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+std::error_code errnoCode(int E) {
+  return std::error_code(E, std::generic_category());
+}
+
+FileContents readFile(const std::string &Path) {
+  FileContents FC;
+  // Volatile, so the file is read now rather than mapped.
+  auto MB = MemoryBuffer::getFile(Path, /* FileSize */ -1,
+                                  /* RequiresNullTerminator */ true,
+                                  /* IsVolatile */ true);
+  if (MB)
+    FC.Buffer = std::move(*MB);
+  else
+    FC.EC = MB.getError();
+  return FC;
+}
+
+#ifdef ALLVM_USE_IO_URING
+
+// Files per batch, and so the submission queue size.
+const unsigned BatchSize = 64;
+
+class Ring {
+  int FD = -1;
+  unsigned Entries = 0;
+
+  void *SQRing = MAP_FAILED, *CQRing = MAP_FAILED;
+  size_t SQRingSize = 0, CQRingSize = 0;
+  io_uring_sqe *SQEs = static_cast<io_uring_sqe *>(MAP_FAILED);
+
+  unsigned *SQTail, *SQMask, *SQArray;
+  unsigned *CQHead, *CQTail, *CQMask;
+  io_uring_cqe *CQEs;
+
+  unsigned Queued = 0;
+
+  template <typename T> static T *at(void *Base, uint32_t Off) {
+    return reinterpret_cast<T *>(static_cast<char *>(Base) + Off);
+  }
+
+public:
+  Ring() = default;
+  Ring(const Ring &) = delete;
+  Ring &operator=(const Ring &) = delete;
+
+  ~Ring() {
+    if (SQEs != MAP_FAILED)
+      ::munmap(SQEs, Entries * sizeof(io_uring_sqe));
+    if (CQRing != MAP_FAILED && CQRing != SQRing)
+      ::munmap(CQRing, CQRingSize);
+    if (SQRing != MAP_FAILED)
+      ::munmap(SQRing, SQRingSize);
+    if (FD >= 0)
+      ::close(FD);
+  }
+
+  bool init(unsigned Size) {
+    io_uring_params P;
+    std::memset(&P, 0, sizeof(P));
+    FD = static_cast<int>(::syscall(__NR_io_uring_setup, Size, &P));
+    if (FD < 0)
+      return false;
+    Entries = P.sq_entries;
+
+    SQRingSize = P.sq_off.array + P.sq_entries * sizeof(unsigned);
+    CQRingSize = P.cq_off.cqes + P.cq_entries * sizeof(io_uring_cqe);
+    bool Single = P.features & IORING_FEAT_SINGLE_MMAP;
+    if (Single)
+      SQRingSize = CQRingSize = std::max(SQRingSize, CQRingSize);
+
+    SQRing = ::mmap(nullptr, SQRingSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, FD, IORING_OFF_SQ_RING);
+    if (SQRing == MAP_FAILED)
+      return false;
+    CQRing = Single ? SQRing
+                    : ::mmap(nullptr, CQRingSize, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, FD, IORING_OFF_CQ_RING);
+    if (CQRing == MAP_FAILED)
+      return false;
+    SQEs = static_cast<io_uring_sqe *>(
+        ::mmap(nullptr, Entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_POPULATE, FD, IORING_OFF_SQES));
+    if (SQEs == MAP_FAILED)
+      return false;
+
+    SQTail = at<unsigned>(SQRing, P.sq_off.tail);
+    SQMask = at<unsigned>(SQRing, P.sq_off.ring_mask);
+    SQArray = at<unsigned>(SQRing, P.sq_off.array);
+    CQHead = at<unsigned>(CQRing, P.cq_off.head);
+    CQTail = at<unsigned>(CQRing, P.cq_off.tail);
+    CQMask = at<unsigned>(CQRing, P.cq_off.ring_mask);
+    CQEs = at<io_uring_cqe>(CQRing, P.cq_off.cqes);
+    return true;
+  }
+
+  unsigned size() const { return Entries; }
+
+  // Whether the kernel supports all of the given operations.
+  bool supports(ArrayRef<unsigned> Ops) const {
+    const unsigned MaxOps = 256;
+    std::vector<char> Buf(sizeof(io_uring_probe) +
+                          MaxOps * sizeof(io_uring_probe_op));
+    auto *Probe = reinterpret_cast<io_uring_probe *>(Buf.data());
+    if (::syscall(__NR_io_uring_register, FD, IORING_REGISTER_PROBE, Probe,
+                  MaxOps) < 0)
+      return false;
+    return std::all_of(Ops.begin(), Ops.end(), [Probe](unsigned Op) {
+      return Op < Probe->ops_len &&
+             (Probe->ops[Op].flags & IO_URING_OP_SUPPORTED);
+    });
+  }
+
+  // Next entry to fill in, at most size() between submits.
+  io_uring_sqe &push() {
+    assert(Queued < Entries);
+    unsigned Tail = *SQTail + Queued;
+    unsigned Idx = Tail & *SQMask;
+    SQArray[Idx] = Idx;
+    auto &SQE = SQEs[Idx];
+    std::memset(&SQE, 0, sizeof(SQE));
+    ++Queued;
+    return SQE;
+  }
+
+  // Submit what was pushed, and call F(user_data, res) for each completion.
+  template <typename FnT> std::error_code submitAndReap(FnT F) {
+    unsigned N = Queued;
+    Queued = 0;
+    __atomic_store_n(SQTail, *SQTail + N, __ATOMIC_RELEASE);
+
+    unsigned Submitted = 0, Done = 0;
+    while (Done < N) {
+      int R = static_cast<int>(
+          ::syscall(__NR_io_uring_enter, FD, N - Submitted, N - Done,
+                    IORING_ENTER_GETEVENTS, nullptr, 0));
+      if (R < 0) {
+        if (errno == EINTR)
+          continue;
+        return errnoCode(errno);
+      }
+      Submitted += R;
+
+      unsigned Head = *CQHead;
+      unsigned Tail = __atomic_load_n(CQTail, __ATOMIC_ACQUIRE);
+      for (; Head != Tail; ++Head, ++Done) {
+        auto &CQE = CQEs[Head & *CQMask];
+        F(CQE.user_data, CQE.res);
+      }
+      __atomic_store_n(CQHead, Head, __ATOMIC_RELEASE);
+    }
+    return {};
+  }
+};
+
+bool isUnsupported(int Res) { return Res == -EINVAL || Res == -EOPNOTSUPP; }
+
+// Read Paths[Begin, End) into Out, using R.
+// Returns error only if the ring itself failed.
+std::error_code readBatch(Ring &R, ArrayRef<std::string> Paths, size_t Begin,
+                          size_t End, std::vector<FileContents> &Out) {
+  size_t N = End - Begin;
+  std::vector<int> FDs(N, -1);
+  std::vector<bool> Fallback(N, false);
+
+  for (size_t I = 0; I != N; ++I) {
+    auto &SQE = R.push();
+    SQE.opcode = IORING_OP_OPENAT;
+    SQE.fd = AT_FDCWD;
+    SQE.addr = reinterpret_cast<uintptr_t>(Paths[Begin + I].c_str());
+    SQE.open_flags = O_RDONLY | O_CLOEXEC;
+    SQE.user_data = I;
+  }
+  auto EC = R.submitAndReap([&](uint64_t I, int Res) {
+    if (Res >= 0)
+      FDs[I] = Res;
+    else if (isUnsupported(Res))
+      Fallback[I] = true;
+    else
+      Out[Begin + I].EC = errnoCode(-Res);
+  });
+  // Opened files must be closed whatever happens next.
+  auto closeAll = [&] {
+    for (auto FD : FDs)
+      if (FD >= 0)
+        ::close(FD);
+  };
+  if (EC) {
+    closeAll();
+    return EC;
+  }
+
+  std::vector<uint64_t> Sizes(N, 0);
+  unsigned Reads = 0;
+  for (size_t I = 0; I != N; ++I) {
+    if (FDs[I] < 0)
+      continue;
+    struct stat St;
+    if (::fstat(FDs[I], &St) != 0) {
+      Out[Begin + I].EC = errnoCode(errno);
+      continue;
+    }
+    if (!S_ISREG(St.st_mode) || uint64_t(St.st_size) > UINT32_MAX) {
+      Fallback[I] = true;
+      continue;
+    }
+    Sizes[I] = St.st_size;
+    auto &Buffer = Out[Begin + I].Buffer;
+    Buffer = MemoryBuffer::getNewUninitMemBuffer(Sizes[I], Paths[Begin + I]);
+    if (!Buffer) {
+      Out[Begin + I].EC = make_error_code(errc::not_enough_memory);
+      continue;
+    }
+    if (!Sizes[I])
+      continue;
+
+    auto &SQE = R.push();
+    SQE.opcode = IORING_OP_READ;
+    SQE.fd = FDs[I];
+    SQE.addr = reinterpret_cast<uintptr_t>(Buffer->getBufferStart());
+    SQE.len = static_cast<uint32_t>(Sizes[I]);
+    SQE.off = 0;
+    SQE.user_data = I;
+    ++Reads;
+  }
+
+  std::vector<uint64_t> Got(N, 0);
+  if (Reads) {
+    EC = R.submitAndReap([&](uint64_t I, int Res) {
+      if (Res >= 0) {
+        Got[I] = Res;
+      } else if (isUnsupported(Res)) {
+        Out[Begin + I].Buffer.reset();
+        Fallback[I] = true;
+      } else {
+        Out[Begin + I].Buffer.reset();
+        Out[Begin + I].EC = errnoCode(-Res);
+      }
+    });
+    if (EC) {
+      closeAll();
+      return EC;
+    }
+  }
+
+  // Finish short reads, which regular files shouldn't give but may.
+  for (size_t I = 0; I != N; ++I) {
+    auto &Buffer = Out[Begin + I].Buffer;
+    if (!Buffer || Fallback[I])
+      continue;
+    char *Start = const_cast<char *>(Buffer->getBufferStart());
+    while (Got[I] < Sizes[I]) {
+      auto Res = ::pread(FDs[I], Start + Got[I], Sizes[I] - Got[I], Got[I]);
+      if (Res < 0 && errno == EINTR)
+        continue;
+      if (Res <= 0) {
+        Buffer.reset();
+        Out[Begin + I].EC =
+            Res < 0 ? errnoCode(errno) : make_error_code(errc::io_error);
+        break;
+      }
+      Got[I] += Res;
+    }
+  }
+  closeAll();
+
+  for (size_t I = 0; I != N; ++I)
+    if (Fallback[I])
+      Out[Begin + I] = readFile(Paths[Begin + I]);
+  return {};
+}
+
+std::unique_ptr<Ring> createRing() {
+  auto R = llvm::make_unique<Ring>();
+  if (!R->init(BatchSize))
+    return nullptr;
+  return R;
+}
+
+#endif // ALLVM_USE_IO_URING
+
+} // end anonymous namespace
+
+bool allvm_analysis::haveIOUring() {
+#ifdef ALLVM_USE_IO_URING
+  static bool Have = [] {
+    auto R = createRing();
+    return R && R->supports({IORING_OP_OPENAT, IORING_OP_READ});
+  }();
+  return Have;
+#else
+  return false;
+#endif
+}
+
+std::vector<FileContents>
+allvm_analysis::readFiles(ArrayRef<std::string> Paths, bool UseIOUring) {
+  std::vector<FileContents> Out(Paths.size());
+  size_t Done = 0;
+
+#ifdef ALLVM_USE_IO_URING
+  if (UseIOUring && Paths.size() > 1 && haveIOUring())
+    if (auto R = createRing()) {
+      while (Done != Paths.size()) {
+        size_t End = std::min(Paths.size(), Done + R->size());
+        if (readBatch(*R, Paths, Done, End, Out))
+          break;
+        Done = End;
+      }
+    }
+#endif
+
+  // Without io_uring, or after it failed.
+  for (; Done != Paths.size(); ++Done)
+    Out[Done] = readFile(Paths[Done]);
+  return Out;
+}
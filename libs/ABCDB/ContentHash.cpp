@@ -0,0 +1,94 @@
+//===-- ContentHash.cpp ---------------------------------------------------===//
+//
+// MurmurHash3 (x64, 128-bit), based on the public domain implementation
+// by Austin Appleby. Blocks are processed as two independent 64-bit lanes.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/ContentHash.h"
+
+#include <llvm/Support/Endian.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+// Non-zero so that no input (including empty) is likely to hash to zero,
+// which is reserved for "not computed".
+const uint64_t Seed = 0x414c4c564dULL; // "ALLVM"
+
+const uint64_t C1 = 0x87c37b91114253d5ULL;
+const uint64_t C2 = 0x4cf5ad432745937fULL;
+
+inline uint64_t rotl(uint64_t X, int R) { return (X << R) | (X >> (64 - R)); }
+
+inline uint64_t fmix(uint64_t K) {
+  K ^= K >> 33;
+  K *= 0xff51afd7ed558ccdULL;
+  K ^= K >> 33;
+  K *= 0xc4ceb9fe1a85ec53ULL;
+  K ^= K >> 33;
+  return K;
+}
+
+inline uint64_t mixK1(uint64_t K1) { return rotl(K1 * C1, 31) * C2; }
+inline uint64_t mixK2(uint64_t K2) { return rotl(K2 * C2, 33) * C1; }
+
+} // end anonymous namespace
+
+ContentHash allvm_analysis::hashContent(StringRef Data) {
+  using namespace llvm::support;
+  auto *P = reinterpret_cast<const uint8_t *>(Data.data());
+  size_t Len = Data.size();
+  size_t NBlocks = Len / 16;
+
+  uint64_t H1 = Seed, H2 = Seed;
+  for (size_t i = 0; i != NBlocks; ++i, P += 16) {
+    uint64_t K1 = endian::read64le(P);
+    uint64_t K2 = endian::read64le(P + 8);
+
+    H1 ^= mixK1(K1);
+    H1 = rotl(H1, 27) + H2;
+    H1 = H1 * 5 + 0x52dce729;
+
+    H2 ^= mixK2(K2);
+    H2 = rotl(H2, 31) + H1;
+    H2 = H2 * 5 + 0x38495ab5;
+  }
+
+  // Tail, up to 15 bytes
+  uint64_t K1 = 0, K2 = 0;
+  size_t Rem = Len & 15;
+  for (size_t i = Rem; i > 8; --i)
+    K2 |= uint64_t(P[i - 1]) << ((i - 9) * 8);
+  for (size_t i = std::min<size_t>(Rem, 8); i > 0; --i)
+    K1 |= uint64_t(P[i - 1]) << ((i - 1) * 8);
+  if (Rem > 8)
+    H2 ^= mixK2(K2);
+  if (Rem)
+    H1 ^= mixK1(K1);
+
+  H1 ^= Len;
+  H2 ^= Len;
+  H1 += H2;
+  H2 += H1;
+  H1 = fmix(H1);
+  H2 = fmix(H2);
+  H1 += H2;
+  H2 += H1;
+
+  ContentHash H;
+  H.Low = H1;
+  H.High = H2;
+  return H;
+}
+
+Expected<ContentHash> allvm_analysis::hashFile(StringRef Path) {
+  auto MB = MemoryBuffer::getFile(Path, /* FileSize */ -1,
+                                  /* RequiresNullTerminator */ false);
+  if (!MB)
+    return make_error<StringError>("Unable to read " + Path, MB.getError());
+  return hashContent((*MB)->getBuffer());
+}
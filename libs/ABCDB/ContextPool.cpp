@@ -0,0 +1,38 @@
+//===-- ContextPool.cpp ---------------------------------------------------===//
+//
+// Per-thread reused LLVMContexts, see ContextPool.h.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/ContextPool.h"
+
+#include <memory>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+// Bitcode loaded into a context before it is replaced. What's left behind
+// by each module is much smaller than its bitcode, so this bounds the
+// growth of a context well below what the modules themselves use.
+const size_t MaxBytesPerContext = 256 << 20;
+
+struct ThreadContext {
+  std::unique_ptr<LLVMContext> C;
+  size_t Used = 0;
+};
+
+thread_local ThreadContext Current;
+
+} // end anonymous namespace
+
+LLVMContext &allvm_analysis::getThreadContext(size_t BitcodeSize) {
+  if (!Current.C || Current.Used >= MaxBytesPerContext) {
+    Current.C = llvm::make_unique<LLVMContext>();
+    Current.C->setDiscardValueNames(true);
+    Current.Used = 0;
+  }
+  Current.Used += BitcodeSize;
+  return *Current.C;
+}
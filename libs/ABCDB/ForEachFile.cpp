@@ -0,0 +1,256 @@
+//===-- ForEachFile.cpp ---------------------------------------------------===//
+//
+// Parallel directory tree walk.
+//
+// Directories are read using the POSIX API directly, so the entry type
+// and inode from readdir() can be used: subdirectories aren't stat'd
+// before being queued, only files (and symlinks, to follow them) are,
+// which is needed for their stamp. A directory's identity is checked
+// with fstat() once it is opened, since readdir() gives the inode of a
+// mount point on the parent's device rather than that of what's
+// mounted there.
+//
+// Workers take directories from a shared stack and push the
+// subdirectories they find; a directory is the unit of work, so taking
+// the lock once per directory is cheap compared to reading it.
+//
+//===----------------------------------------------------------------------===//
+
+#include "ForEachFile.h"
+
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+// Directory to read, along with the directories leading to it so
+// symlinks back up the tree aren't followed forever.
+struct DirNode {
+  std::string Path;
+  uint64_t Device;
+  uint64_t Inode;
+  std::shared_ptr<const DirNode> Parent;
+
+  bool hasAncestor(uint64_t Dev, uint64_t Ino) const {
+    for (auto *N = this; N; N = N->Parent.get())
+      if (N->Device == Dev && N->Inode == Ino)
+        return true;
+    return false;
+  }
+};
+
+struct FoundFile {
+  std::string Path;
+  FileStamp Stamp;
+};
+
+FileStamp toStamp(const struct stat &St) {
+  FileStamp S;
+  S.Device = St.st_dev;
+  S.File = St.st_ino;
+  S.Size = St.st_size;
+  S.MTime = uint64_t(St.st_mtim.tv_sec) * 1000000000 + St.st_mtim.tv_nsec;
+  return S;
+}
+
+class Walker {
+  bool SkipEmpty, RegularOnly;
+
+  std::mutex Mtx;
+  std::condition_variable CV;
+  std::vector<std::shared_ptr<const DirNode>> Work;
+  // Directories queued or being read
+  size_t Pending = 0;
+
+  std::mutex OutMtx;
+  std::vector<FoundFile> Found;
+
+  void push(std::shared_ptr<const DirNode> D) {
+    {
+      std::lock_guard<std::mutex> Lock(Mtx);
+      Work.push_back(std::move(D));
+      ++Pending;
+    }
+    CV.notify_one();
+  }
+
+  void warn(const Twine &Msg) {
+    std::lock_guard<std::mutex> Lock(OutMtx);
+    errs() << "Warning, " << Msg << ", attempting to skip.\n";
+  }
+
+  void readDir(std::shared_ptr<const DirNode> D,
+               std::vector<FoundFile> &Files) {
+    int FD = ::open(D->Path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat DirSt;
+    if (FD >= 0 && ::fstat(FD, &DirSt) != 0) {
+      ::close(FD);
+      FD = -1;
+    }
+    DIR *Dir = FD < 0 ? nullptr : ::fdopendir(FD);
+    if (!Dir) {
+      auto EC = std::error_code(errno, std::generic_category());
+      if (FD >= 0)
+        ::close(FD);
+      warn("error scanning directory '" + D->Path + "': " + EC.message());
+      return;
+    }
+
+    // A mount point: queued with the parent's device and the inode
+    // underneath, now that it's known what it really is, check again.
+    if (uint64_t(DirSt.st_dev) != D->Device ||
+        uint64_t(DirSt.st_ino) != D->Inode) {
+      if (D->Parent && D->Parent->hasAncestor(DirSt.st_dev, DirSt.st_ino)) {
+        ::closedir(Dir);
+        return;
+      }
+      D = std::make_shared<DirNode>(DirNode{D->Path, uint64_t(DirSt.st_dev),
+                                            uint64_t(DirSt.st_ino),
+                                            D->Parent});
+    }
+
+    while (true) {
+      // Only errno tells the end of the directory from failing to read it.
+      errno = 0;
+      auto *Ent = ::readdir(Dir);
+      if (!Ent) {
+        if (errno)
+          warn("error reading directory '" + D->Path + "': " +
+               std::error_code(errno, std::generic_category()).message());
+        break;
+      }
+
+      StringRef Name = Ent->d_name;
+      if (Name == "." || Name == "..")
+        continue;
+      std::string Path = D->Path;
+      if (!Path.empty() && Path.back() != '/')
+        Path += '/';
+      Path += Name;
+
+      // Subdirectories are on the same device as their parent, unless
+      // they are mount points, which are found out when they are read.
+      if (Ent->d_type == DT_DIR) {
+        if (!D->hasAncestor(D->Device, Ent->d_ino))
+          push(std::make_shared<DirNode>(
+              DirNode{std::move(Path), D->Device, Ent->d_ino, D}));
+        continue;
+      }
+
+      // Everything else needs stat (following symlinks) for the stamp.
+      struct stat St;
+      if (::fstatat(::dirfd(Dir), Ent->d_name, &St, 0) != 0) {
+        if (errno == ENOENT)
+          warn("file not found when accessing path '" + Path +
+               "' (broken symlink?)");
+        else
+          warn("error accessing path '" + Path + "'");
+        continue;
+      }
+
+      if (S_ISDIR(St.st_mode)) {
+        if (!D->hasAncestor(St.st_dev, St.st_ino))
+          push(std::make_shared<DirNode>(
+              DirNode{std::move(Path), St.st_dev, St.st_ino, D}));
+        continue;
+      }
+      if (SkipEmpty && St.st_size == 0)
+        continue;
+      if (RegularOnly && !S_ISREG(St.st_mode))
+        continue;
+      Files.push_back({std::move(Path), toStamp(St)});
+    }
+    ::closedir(Dir);
+  }
+
+  void worker() {
+    std::vector<FoundFile> Files;
+    while (true) {
+      std::shared_ptr<const DirNode> D;
+      {
+        std::unique_lock<std::mutex> Lock(Mtx);
+        CV.wait(Lock, [this] { return !Work.empty() || Pending == 0; });
+        if (Work.empty())
+          break;
+        D = std::move(Work.back());
+        Work.pop_back();
+      }
+
+      readDir(D, Files);
+
+      bool Done;
+      {
+        std::lock_guard<std::mutex> Lock(Mtx);
+        Done = --Pending == 0;
+      }
+      if (Done)
+        CV.notify_all();
+    }
+
+    std::lock_guard<std::mutex> Lock(OutMtx);
+    Found.insert(Found.end(), std::make_move_iterator(Files.begin()),
+                 std::make_move_iterator(Files.end()));
+  }
+
+public:
+  Walker(bool SkipEmpty, bool RegularOnly)
+      : SkipEmpty(SkipEmpty), RegularOnly(RegularOnly) {}
+
+  Expected<std::vector<FoundFile>> run(StringRef Root, unsigned Threads) {
+    struct stat St;
+    if (::stat(Root.str().c_str(), &St) != 0)
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    if (!S_ISDIR(St.st_mode))
+      return errorCodeToError(make_error_code(errc::not_a_directory));
+    push(std::make_shared<DirNode>(DirNode{Root.str(), uint64_t(St.st_dev),
+                                           uint64_t(St.st_ino), nullptr}));
+
+    if (!Threads)
+      Threads = std::thread::hardware_concurrency();
+    std::vector<std::thread> Workers;
+    for (unsigned i = 1; i < Threads; ++i)
+      Workers.emplace_back([this] { worker(); });
+    worker();
+    for (auto &T : Workers)
+      T.join();
+
+    // Order found depends on the threads, sort so it doesn't.
+    std::sort(Found.begin(), Found.end(),
+              [](const FoundFile &A, const FoundFile &B) {
+                return A.Path < B.Path;
+              });
+    return std::move(Found);
+  }
+};
+
+} // end anonymous namespace
+
+llvm::Error allvm_analysis::foreach_file_status_in_directory(
+    const Twine &Path, PathStatusCallbackT F, bool SkipEmpty,
+    bool RegularOnly, unsigned Threads) {
+  SmallString<128> PathNative;
+  sys::path::native(Path, PathNative);
+
+  auto Files = Walker(SkipEmpty, RegularOnly).run(PathNative, Threads);
+  if (!Files)
+    return Files.takeError();
+  for (auto &File : *Files)
+    if (auto Err = F(File.Path, File.Stamp))
+      return Err;
+  return Error::success();
+}
@@ -11,69 +11,42 @@
 #ifndef ALLVM_FOREACH_FILE_H
 #define ALLVM_FOREACH_FILE_H
 
+#include "allvm-analysis/ABCDB.h"
+
 #include <allvm/Allexe.h>
 #include <allvm/ResourcePaths.h>
 
 #include <llvm/ADT/SmallString.h>
 #include <llvm/ADT/Twine.h>
 #include <llvm/Support/Error.h>
-#include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Path.h>
 
 namespace allvm_analysis {
 
 typedef std::function<llvm::Error(llvm::StringRef)> PathCallbackT;
+typedef std::function<llvm::Error(llvm::StringRef, const FileStamp &)>
+    PathStatusCallbackT;
+
+// Like foreach_file_in_directory, but also pass along the stamp
+// obtained while walking the directory.
+// The tree is walked using the given number of threads (0 for all cores),
+// then F is called for each file found, in order of path.
+// Broken symlinks and unreadable directories are skipped with a warning.
+llvm::Error foreach_file_status_in_directory(const llvm::Twine &Path,
+                                             PathStatusCallbackT F,
+                                             bool SkipEmpty = true,
+                                             bool RegularOnly = true,
+                                             unsigned Threads = 1);
 
 static inline llvm::Error foreach_file_in_directory(const llvm::Twine &Path,
                                                     PathCallbackT F,
                                                     bool SkipEmpty = true,
-                                                    bool RegularOnly = true) {
-  llvm::SmallString<128> PathNative;
-  llvm::sys::path::native(Path, PathNative);
-
-  std::error_code EC;
-  llvm::sys::fs::file_status status;
-  llvm::sys::fs::recursive_directory_iterator File(PathNative, EC), FileEnd;
-  if (File != FileEnd) {
-    for (; File != FileEnd && !EC; File.increment(EC)) {
-      EC = File->status(status);
-
-      // XXX: Checking 'status' regardless of 'EC' is badness,
-      // but due to API strangeness I think this is "correct":
-      if (status.type() == llvm::sys::fs::file_type::file_not_found) {
-        llvm::errs() << "Warning, file not found when accessing path '"
-                     << File->path()
-                     << "' (broken symlink?), attempting to skip.\n";
-        File.no_push();
-        EC.clear();
-        continue;
-      }
-
-      // Blargh. Check that recursing into this directory won't break
-      // everything.
-      if (llvm::sys::fs::is_directory(status)) {
-        std::error_code dirEC;
-        llvm::sys::fs::directory_iterator throwaway(File->path(), dirEC);
-        if (dirEC) {
-          llvm::errs() << "Warning, error scanning directory '" << File->path()
-                       << "': " << dirEC.message() << ", attempting to skip.\n";
-          File.no_push();
-          continue;
-        }
-      }
-
-      if (SkipEmpty && (status.getSize() == 0))
-        continue;
-      if (RegularOnly &&
-          (status.type() != llvm::sys::fs::file_type::regular_file))
-        continue;
-      llvm::Error Err = F(File->path());
-      if (Err)
-        return Err;
-    }
-    assert((File == FileEnd) == (!EC));
-  }
-  return llvm::errorCodeToError(EC);
+                                                    bool RegularOnly = true,
+                                                    unsigned Threads = 1) {
+  return foreach_file_status_in_directory(
+      Path,
+      [&F](llvm::StringRef File, const FileStamp &) { return F(File); },
+      SkipEmpty, RegularOnly, Threads);
 }
 
 static inline PathCallbackT
@@ -95,7 +68,7 @@ AllexeCallback(std::function<llvm::Error(std::unique_ptr<const allvm::Allexe>,
 static auto foreach_allexe = std::bind(
     foreach_file_in_directory, std::placeholders::_1,
     std::bind(AllexeCallback, std::placeholders::_2, std::placeholders::_3),
-    true, true);
+    true, true, 0);
 
 // TODO: Add similar for WLLVMFile, but in separate header
 
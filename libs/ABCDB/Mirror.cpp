@@ -0,0 +1,138 @@
+//===-- Mirror.cpp --------------------------------------------------------===//
+//
+// The index is a text file, "<Dir>/index", starting with a version line
+// "mirror <version>", then a line "<mirror file name> <original file>"
+// for each module, sorted.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/Mirror.h"
+
+#include "allvm-analysis/AtomicFile.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+const char IndexName[] = "index";
+// Version 1 had no version line, nor summaries.
+const unsigned IndexVersion = 2;
+
+std::string getIndexPath(StringRef Dir) {
+  SmallString<128> Path(Dir);
+  sys::path::append(Path, IndexName);
+  return Path.str();
+}
+
+std::string getMirrorStem(const ModuleKey &Key) {
+  std::string Name;
+  raw_string_ostream OS(Name);
+  OS << Key.Hash << "-" << Key.Size;
+  return OS.str();
+}
+
+} // end anonymous namespace
+
+void allvm_analysis::stripForMirror(Module &M) {
+  StripDebugInfo(M);
+
+  // TBAA, branch weights, asm source locations and such.
+  for (auto &F : M) {
+    F.clearMetadata();
+    for (auto &BB : F)
+      for (auto &I : BB)
+        I.dropUnknownNonDebugMetadata();
+  }
+  for (auto &GV : M.globals())
+    GV.clearMetadata();
+
+  SmallVector<NamedMDNode *, 4> Unneeded;
+  for (auto &NMD : M.named_metadata())
+    if (NMD.getName() != "llvm.module.flags")
+      Unneeded.push_back(&NMD);
+  for (auto *NMD : Unneeded)
+    M.eraseNamedMetadata(NMD);
+}
+
+std::string allvm_analysis::getMirrorFileName(const ModuleKey &Key) {
+  return getMirrorStem(Key) + ".bc";
+}
+
+std::string allvm_analysis::getMirrorSummaryFileName(const ModuleKey &Key) {
+  return getMirrorStem(Key) + ".summary";
+}
+
+void allvm_analysis::hashMirrorCandidates(const ABCDB &DB,
+                                          const StringMap<std::string> &Index,
+                                          unsigned Threads) {
+  DenseSet<uint64_t> Sizes;
+  for (auto &E : Index) {
+    uint64_t Size;
+    StringRef Stem = sys::path::stem(E.getKey());
+    if (!Stem.rsplit('-').second.getAsInteger(10, Size))
+      Sizes.insert(Size);
+  }
+  std::vector<ModuleID> ToHash;
+  for (auto M : DB.getMods())
+    if (M.getKey().Hash.isZero() && Sizes.count(M.getKey().Size))
+      ToHash.push_back(M.getID());
+  DB.hashModules(ToHash, Threads);
+}
+
+Expected<StringMap<std::string>>
+allvm_analysis::readMirrorIndex(StringRef Dir) {
+  StringMap<std::string> Index;
+  auto Path = getIndexPath(Dir);
+  if (!sys::fs::exists(Path))
+    return std::move(Index);
+
+  auto MB = MemoryBuffer::getFile(Path);
+  if (!MB)
+    return make_error<StringError>("Unable to read mirror index " + Path,
+                                   MB.getError());
+  SmallVector<StringRef, 0> Lines;
+  (*MB)->getBuffer().split(Lines, '\n', -1, /* KeepEmpty */ false);
+  // Copies from other versions are rewritten as if new.
+  unsigned Version;
+  if (Lines.empty() || !Lines[0].consume_front("mirror ") ||
+      Lines[0].getAsInteger(10, Version) || Version != IndexVersion)
+    return std::move(Index);
+  for (auto Line : makeArrayRef(Lines).drop_front()) {
+    auto P = Line.split(' ');
+    if (P.first.empty() || P.second.empty())
+      return make_error<StringError>("Malformed mirror index " + Path,
+                                     errc::invalid_argument);
+    Index[P.first] = P.second;
+  }
+  return std::move(Index);
+}
+
+Error allvm_analysis::writeMirrorIndex(StringRef Dir,
+                                       const StringMap<std::string> &Index) {
+  std::vector<std::pair<StringRef, StringRef>> Entries;
+  for (auto &KV : Index)
+    Entries.push_back({KV.getKey(), KV.getValue()});
+  std::sort(Entries.begin(), Entries.end());
+
+  std::string Data;
+  raw_string_ostream OS(Data);
+  OS << "mirror " << IndexVersion << "\n";
+  for (auto &E : Entries)
+    OS << E.first << " " << E.second << "\n";
+  return writeFileAtomically(getIndexPath(Dir), OS.str());
+}
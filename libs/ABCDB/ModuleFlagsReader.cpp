@@ -0,0 +1,295 @@
+//===-- ModuleFlagsReader.cpp ---------------------------------------------===//
+//
+// Read module flags using a BitstreamCursor, see ModuleFlagsReader.h.
+//
+// Only the module-level METADATA_BLOCK is looked at. Within it, records
+// are skipped (only noting where metadata nodes are) until the
+// "llvm.module.flags" named metadata is found, then just the nodes
+// reachable from the flag we want are read.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/ModuleFlagsReader.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitstreamReader.h>
+#include <llvm/Bitcode/LLVMBitCodes.h>
+#include <llvm/Support/Errc.h>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+Error malformed(const Twine &Msg) {
+  return make_error<StringError>("Malformed bitcode: " + Msg,
+                                 errc::invalid_argument);
+}
+
+// Does this metadata record define the next metadata ID?
+bool definesMetadata(unsigned Code) {
+  switch (Code) {
+  case bitc::METADATA_NAME:
+  case bitc::METADATA_NAMED_NODE:
+  case bitc::METADATA_KIND:
+  case bitc::METADATA_STRINGS: // defines several, handled separately
+  case bitc::METADATA_ATTACHMENT:
+  case bitc::METADATA_GLOBAL_DECL_ATTACHMENT:
+  case bitc::METADATA_INDEX_OFFSET:
+  case bitc::METADATA_INDEX:
+    return false;
+  default:
+    return true;
+  }
+}
+
+class ModuleFlagScanner {
+  BitstreamCursor &Stream;
+  StringRef Key;
+
+  // What we know about each metadata ID.
+  struct MDEntry {
+    StringRef String;   // MDString contents
+    uint64_t BitNo = 0; // Position of record, for nodes
+    unsigned AbbrevID = 0;
+    bool IsString = false;
+    bool IsNode = false;
+  };
+  std::vector<MDEntry> MDs;
+  SmallVector<uint64_t, 64> Vals;
+
+  Error addStrings(StringRef Blob);
+  Expected<std::vector<uint64_t>> readNode(uint64_t ID);
+  Expected<std::vector<StringRef>> findFlag(ArrayRef<uint64_t> FlagNodes);
+
+  // Operands are encoded as ID + 1, 0 for null.
+  bool isString(uint64_t Op) const {
+    return Op && Op - 1 < MDs.size() && MDs[Op - 1].IsString;
+  }
+
+public:
+  ModuleFlagScanner(BitstreamCursor &Stream, StringRef Key)
+      : Stream(Stream), Key(Key) {}
+
+  // Scan METADATA_BLOCK, which must have just been entered.
+  Expected<std::vector<StringRef>> scan();
+};
+
+Error ModuleFlagScanner::addStrings(StringRef Blob) {
+  // All MDStrings are stored in a single record, as a blob containing
+  // vbr6-encoded lengths followed by the concatenated strings.
+  if (Vals.size() != 2)
+    return malformed("metadata strings record");
+  auto NumStrings = Vals[0];
+  auto StringsOffset = Vals[1];
+  if (StringsOffset > Blob.size())
+    return malformed("metadata strings offset");
+
+  StringRef Lengths = Blob.slice(0, StringsOffset);
+  SimpleBitstreamCursor R(ArrayRef<uint8_t>(
+      reinterpret_cast<const uint8_t *>(Lengths.data()), Lengths.size()));
+  StringRef Strings = Blob.drop_front(StringsOffset);
+  for (uint64_t i = 0; i != NumStrings; ++i) {
+    if (R.AtEndOfStream())
+      return malformed("metadata string lengths");
+    uint32_t Size = R.ReadVBR(6);
+    if (Strings.size() < Size)
+      return malformed("metadata string");
+
+    MDEntry E;
+    E.IsString = true;
+    E.String = Strings.slice(0, Size);
+    MDs.push_back(E);
+    Strings = Strings.drop_front(Size);
+  }
+  return Error::success();
+}
+
+Expected<std::vector<uint64_t>> ModuleFlagScanner::readNode(uint64_t ID) {
+  if (ID >= MDs.size() || !MDs[ID].IsNode)
+    return malformed("expected metadata node");
+
+  // Still inside the metadata block, so all abbreviations are in scope.
+  Stream.JumpToBit(MDs[ID].BitNo);
+  Vals.clear();
+  Stream.readRecord(MDs[ID].AbbrevID, Vals);
+  return std::vector<uint64_t>(Vals.begin(), Vals.end());
+}
+
+Expected<std::vector<StringRef>>
+ModuleFlagScanner::findFlag(ArrayRef<uint64_t> FlagNodes) {
+  for (auto FlagID : FlagNodes) {
+    // !{behavior, !"key", value}
+    auto Flag = readNode(FlagID);
+    if (!Flag)
+      return Flag.takeError();
+    if (Flag->size() != 3 || !isString((*Flag)[1]) ||
+        MDs[(*Flag)[1] - 1].String != Key)
+      continue;
+
+    // Our flags have a node of strings as value
+    auto ValOp = (*Flag)[2];
+    if (!ValOp)
+      return malformed("module flag value");
+    auto Value = readNode(ValOp - 1);
+    if (!Value)
+      return Value.takeError();
+
+    std::vector<StringRef> Strings;
+    for (auto Op : *Value) {
+      if (!isString(Op))
+        return malformed("module flag value");
+      Strings.push_back(MDs[Op - 1].String);
+    }
+    return Strings;
+  }
+
+  return std::vector<StringRef>();
+}
+
+Expected<std::vector<StringRef>> ModuleFlagScanner::scan() {
+  while (true) {
+    BitstreamEntry Entry = Stream.advanceSkippingSubblocks();
+    switch (Entry.Kind) {
+    case BitstreamEntry::SubBlock: // Handled by advanceSkippingSubblocks
+    case BitstreamEntry::Error:
+      return malformed("metadata block");
+    case BitstreamEntry::EndBlock:
+      // No module flags
+      return std::vector<StringRef>();
+    case BitstreamEntry::Record:
+      break;
+    }
+
+    // Skip over records unless we need them, coming back if we do.
+    uint64_t BitNo = Stream.GetCurrentBitNo();
+    unsigned Code = Stream.skipRecord(Entry.ID);
+    switch (Code) {
+    case bitc::METADATA_STRINGS: {
+      Stream.JumpToBit(BitNo);
+      Vals.clear();
+      StringRef Blob;
+      Stream.readRecord(Entry.ID, Vals, &Blob);
+      if (auto Err = addStrings(Blob))
+        return std::move(Err);
+      break;
+    }
+    case bitc::METADATA_NODE:
+    case bitc::METADATA_DISTINCT_NODE: {
+      MDEntry E;
+      E.IsNode = true;
+      E.BitNo = BitNo;
+      E.AbbrevID = Entry.ID;
+      MDs.push_back(E);
+      break;
+    }
+    case bitc::METADATA_NAME: {
+      Stream.JumpToBit(BitNo);
+      Vals.clear();
+      Stream.readRecord(Entry.ID, Vals);
+      std::string Name(Vals.begin(), Vals.end());
+
+      // Name is always followed by the named node itself.
+      Entry = Stream.advanceSkippingSubblocks();
+      if (Entry.Kind != BitstreamEntry::Record)
+        return malformed("expected named metadata node");
+      if (Name != "llvm.module.flags") {
+        Stream.skipRecord(Entry.ID);
+        break;
+      }
+
+      Vals.clear();
+      if (Stream.readRecord(Entry.ID, Vals) != bitc::METADATA_NAMED_NODE)
+        return malformed("expected named metadata node");
+      // Everything referenced has been seen, nothing else is needed.
+      std::vector<uint64_t> FlagNodes(Vals.begin(), Vals.end());
+      return findFlag(FlagNodes);
+    }
+    default:
+      if (definesMetadata(Code))
+        MDs.emplace_back();
+      break;
+    }
+  }
+}
+
+} // end anonymous namespace
+
+Expected<std::vector<StringRef>>
+allvm_analysis::readModuleFlagStrings(MemoryBufferRef Buffer, StringRef Key) {
+  auto *BufPtr =
+      reinterpret_cast<const unsigned char *>(Buffer.getBufferStart());
+  auto *BufEnd = BufPtr + Buffer.getBufferSize();
+
+  if (isBitcodeWrapper(BufPtr, BufEnd) &&
+      SkipBitcodeWrapperHeader(BufPtr, BufEnd, true))
+    return malformed("invalid bitcode wrapper header");
+  if (BufEnd - BufPtr < 4 || !isRawBitcode(BufPtr, BufEnd))
+    return malformed("not a bitcode file");
+
+  BitstreamCursor Stream(ArrayRef<uint8_t>(BufPtr, BufEnd));
+  // Magic, already checked
+  Stream.Read(32);
+
+  BitstreamBlockInfo BlockInfo;
+  Stream.setBlockInfo(&BlockInfo);
+
+  auto readBlockInfo = [&]() -> Error {
+    auto NewBlockInfo = Stream.ReadBlockInfoBlock();
+    if (!NewBlockInfo)
+      return malformed("block info");
+    BlockInfo = std::move(*NewBlockInfo);
+    return Error::success();
+  };
+
+  // Find the (first) module block
+  while (true) {
+    if (Stream.AtEndOfStream())
+      return malformed("no module block");
+    BitstreamEntry Entry = Stream.advance();
+    if (Entry.Kind != BitstreamEntry::SubBlock)
+      return malformed("unexpected top-level entry");
+    if (Entry.ID == bitc::MODULE_BLOCK_ID)
+      break;
+    if (Entry.ID == bitc::BLOCKINFO_BLOCK_ID) {
+      if (auto Err = readBlockInfo())
+        return std::move(Err);
+    } else if (Stream.SkipBlock())
+      return malformed("top-level block");
+  }
+  if (Stream.EnterSubBlock(bitc::MODULE_BLOCK_ID))
+    return malformed("module block");
+
+  // Skip everything but the module-level metadata.
+  while (true) {
+    BitstreamEntry Entry = Stream.advance();
+    switch (Entry.Kind) {
+    case BitstreamEntry::Error:
+      return malformed("module block");
+    case BitstreamEntry::EndBlock:
+      return std::vector<StringRef>();
+    case BitstreamEntry::Record:
+      Stream.skipRecord(Entry.ID);
+      continue;
+    case BitstreamEntry::SubBlock:
+      break;
+    }
+
+    switch (Entry.ID) {
+    case bitc::BLOCKINFO_BLOCK_ID:
+      if (auto Err = readBlockInfo())
+        return std::move(Err);
+      break;
+    case bitc::METADATA_BLOCK_ID:
+      if (Stream.EnterSubBlock(bitc::METADATA_BLOCK_ID))
+        return malformed("metadata block");
+      return ModuleFlagScanner(Stream, Key).scan();
+    default:
+      if (Stream.SkipBlock())
+        return malformed("module sub-block");
+      break;
+    }
+  }
+}
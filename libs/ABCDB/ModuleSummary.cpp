@@ -0,0 +1,519 @@
+//===-- ModuleSummary.cpp -------------------------------------------------===//
+//
+// Computing module summaries, and the on-disk cache of them.
+//
+// Cache entries are "<Dir>/<content hash>-<size>", containing
+// (integers little-endian):
+//
+//   magic, version (uint32_t), LLVM version (string),
+//   WLLVM source, module asm (strings), instruction count (uint64_t),
+//   functions: count, then {name, declaration?, insts, hash,
+//                           count, inline asm strings} for each,
+//   globals:   count, then {name, declaration?} for each,
+//   aliases:   count, then {name, aliasee} for each.
+//
+// Strings are a uint32_t size followed by the bytes, counts are uint32_t,
+// and declaration? is a uint32_t.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/ModuleSummary.h"
+
+#include "allvm-analysis/AtomicFile.h"
+#include "allvm-analysis/ContentHash.h"
+#include "allvm-analysis/ContextPool.h"
+#include "allvm-analysis/ModuleFlags.h"
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/IR/CallSite.h>
+#include <llvm/IR/DebugInfo.h>
+#include <llvm/IR/InlineAsm.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/EndianStream.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/FunctionComparator.h>
+
+#include <atomic>
+#include <mutex>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+const char SummaryMagic[] = {'A', 'B', 'C', 'D', 'B', 'S', 'U', 'M'};
+// Bump whenever what is computed for a module changes.
+const uint32_t SummaryVersion = 1;
+
+// Modules with less bitcode than this are summarized on a single thread;
+// reading the rest of the module again on each thread isn't worth it.
+const uint64_t ParallelMinSize = 8 << 20;
+
+class SummaryWriter {
+  raw_ostream &OS;
+  support::endian::Writer<support::little> LE;
+
+public:
+  explicit SummaryWriter(raw_ostream &OS) : OS(OS), LE(OS) {}
+
+  void write(uint32_t V) { LE.write<uint32_t>(V); }
+  void write(uint64_t V) { LE.write<uint64_t>(V); }
+  void write(StringRef S) {
+    write(static_cast<uint32_t>(S.size()));
+    OS << S;
+  }
+};
+
+// Reads from a buffer, remembering whether it ran out.
+class SummaryReader {
+  const unsigned char *P, *End;
+  bool Bad = false;
+
+  bool have(uint64_t N) {
+    if (Bad || N > uint64_t(End - P))
+      Bad = true;
+    return !Bad;
+  }
+
+public:
+  explicit SummaryReader(StringRef Data)
+      : P(reinterpret_cast<const unsigned char *>(Data.begin())),
+        End(reinterpret_cast<const unsigned char *>(Data.end())) {}
+
+  bool isBad() const { return Bad || P != End; }
+  void fail() { Bad = true; }
+
+  template <typename T> T read() {
+    using namespace llvm::support;
+    if (!have(sizeof(T)))
+      return 0;
+    return endian::readNext<T, little, unaligned>(P);
+  }
+  std::string readString() {
+    auto Size = read<uint32_t>();
+    if (!have(Size))
+      return {};
+    std::string S(reinterpret_cast<const char *>(P), Size);
+    P += Size;
+    return S;
+  }
+  StringRef readBytes(size_t N) {
+    if (!have(N))
+      return {};
+    StringRef S(reinterpret_cast<const char *>(P), N);
+    P += N;
+    return S;
+  }
+};
+
+std::string serialize(const ModuleSummary &S) {
+  std::string Data;
+  raw_string_ostream OS(Data);
+  SummaryWriter W(OS);
+
+  OS.write(SummaryMagic, sizeof(SummaryMagic));
+  W.write(SummaryVersion);
+  W.write(StringRef(LLVM_VERSION_STRING));
+
+  W.write(StringRef(S.WLLVMSource));
+  W.write(StringRef(S.ModuleAsm));
+  W.write(S.Insts);
+
+  W.write(static_cast<uint32_t>(S.Functions.size()));
+  for (auto &F : S.Functions) {
+    W.write(StringRef(F.Name));
+    W.write(static_cast<uint32_t>(F.IsDeclaration));
+    W.write(F.Insts);
+    W.write(F.Hash);
+    W.write(static_cast<uint32_t>(F.InlineAsm.size()));
+    for (auto &A : F.InlineAsm)
+      W.write(StringRef(A));
+  }
+
+  W.write(static_cast<uint32_t>(S.Globals.size()));
+  for (auto &G : S.Globals) {
+    W.write(StringRef(G.Name));
+    W.write(static_cast<uint32_t>(G.IsDeclaration));
+  }
+
+  W.write(static_cast<uint32_t>(S.Aliases.size()));
+  for (auto &A : S.Aliases) {
+    W.write(StringRef(A.Name));
+    W.write(StringRef(A.Aliasee));
+  }
+
+  return OS.str();
+}
+
+// Returns None if Data isn't a (current) summary.
+Optional<ModuleSummary> deserialize(StringRef Data) {
+  SummaryReader R(Data);
+  if (R.readBytes(sizeof(SummaryMagic)) !=
+          StringRef(SummaryMagic, sizeof(SummaryMagic)) ||
+      R.read<uint32_t>() != SummaryVersion ||
+      R.readString() != LLVM_VERSION_STRING)
+    return None;
+
+  ModuleSummary S;
+  S.WLLVMSource = R.readString();
+  S.ModuleAsm = R.readString();
+  S.Insts = R.read<uint64_t>();
+
+  // Counts are checked against what's left before allocating,
+  // so corrupt entries can't ask for huge vectors.
+  auto readCount = [&](uint64_t MinSize) -> uint32_t {
+    auto N = R.read<uint32_t>();
+    if (N * MinSize > Data.size()) {
+      R.fail();
+      return 0;
+    }
+    return N;
+  };
+
+  S.Functions.resize(readCount(4 + 4 + 8 + 8 + 4));
+  for (auto &F : S.Functions) {
+    F.Name = R.readString();
+    F.IsDeclaration = R.read<uint32_t>();
+    F.Insts = R.read<uint64_t>();
+    F.Hash = R.read<uint64_t>();
+    F.InlineAsm.resize(readCount(4));
+    for (auto &A : F.InlineAsm)
+      A = R.readString();
+  }
+
+  S.Globals.resize(readCount(4 + 4));
+  for (auto &G : S.Globals) {
+    G.Name = R.readString();
+    G.IsDeclaration = R.read<uint32_t>();
+  }
+
+  S.Aliases.resize(readCount(4 + 4));
+  for (auto &A : S.Aliases) {
+    A.Name = R.readString();
+    A.Aliasee = R.readString();
+  }
+
+  if (R.isBad())
+    return None;
+  return std::move(S);
+}
+
+ModuleSummary::Function summarizeFunction(llvm::Function &F) {
+  ModuleSummary::Function FS;
+  FS.Name = F.getName().str();
+  FS.IsDeclaration = F.isDeclaration();
+  FS.Insts = 0;
+  FS.Hash = 0;
+  if (!FS.IsDeclaration)
+    FS.Hash = FunctionComparator::functionHash(F);
+  for (auto &B : F) {
+    FS.Insts += B.size();
+    for (auto &I : B) {
+      CallSite CS(&I);
+      if (!CS)
+        continue;
+      if (auto *IA = dyn_cast<InlineAsm>(CS.getCalledValue()))
+        FS.InlineAsm.push_back(IA->getAsmString() + " ---- " +
+                               IA->getConstraintString());
+    }
+  }
+  return FS;
+}
+
+// Everything but the functions.
+void summarizeRest(Module &M, ModuleSummary &S) {
+  for (auto &G : M.globals())
+    S.Globals.push_back({G.getName().str(), G.isDeclaration()});
+
+  for (auto &A : M.aliases())
+    S.Aliases.push_back({A.getName().str(), A.getAliasee()->getName().str()});
+
+  S.ModuleAsm = M.getModuleInlineAsm();
+  S.WLLVMSource = getWLLVMSource(&M).str();
+}
+
+// Reading other functions may need to refer to blocks of this one.
+bool hasAddressTakenBlock(const llvm::Function &F) {
+  for (auto &B : F)
+    if (B.hasAddressTaken())
+      return true;
+  return false;
+}
+
+// Materializing the module strips debug info from a different version,
+// including calls to llvm.dbg.* intrinsics, which are counted and hashed.
+// That happens only once all functions are read, too late for them.
+bool mayStripDebugInfo(Module &M) {
+  if (getDebugMetadataVersionFromModule(M) == DEBUG_METADATA_VERSION)
+    return false;
+  for (auto &F : M)
+    if (F.getName().startswith("llvm.dbg."))
+      return true;
+  return false;
+}
+
+// Summarize a bitcode module one function at a time: each is read,
+// summarized and then its body is deleted, so only one function's IR is
+// resident at a time instead of the whole module's.
+// The result is the same as materializing everything first.
+Expected<ModuleSummary> computeLazily(MemoryBufferRef Buffer, LLVMContext &C) {
+  auto ExpM = getLazyBitcodeModule(Buffer, C);
+  if (!ExpM)
+    return make_error<StringError>("Unable to open module file " +
+                                       Buffer.getBufferIdentifier() + ": " +
+                                       toString(ExpM.takeError()),
+                                   errc::invalid_argument);
+  auto &M = **ExpM;
+
+  if (mayStripDebugInfo(M)) {
+    if (auto Err = M.materializeAll())
+      return std::move(Err);
+    return ModuleSummary::compute(M);
+  }
+
+  DenseMap<const llvm::Function *, ModuleSummary::Function> Done;
+  for (auto &F : M) {
+    if (!F.isMaterializable())
+      continue;
+    if (auto Err = F.materialize())
+      return std::move(Err);
+    Done[&F] = summarizeFunction(F);
+    // There's no dematerialize() since LLVM 3.9, so no way to have the
+    // reader take the body back; materialize() cleared the function's
+    // materializable bit, so nothing reads it in again once deleted.
+    if (!hasAddressTakenBlock(F))
+      F.deleteBody();
+  }
+
+  // Finish materializing, which upgrades (and drops old) declarations
+  // the same way as when materializing everything at once.
+  if (auto Err = M.materializeAll())
+    return std::move(Err);
+
+  ModuleSummary S;
+  for (auto &F : M) {
+    auto It = Done.find(&F);
+    if (It != Done.end())
+      S.Functions.push_back(std::move(It->second));
+    else
+      S.Functions.push_back(summarizeFunction(F));
+    S.Insts += S.Functions.back().Insts;
+  }
+  summarizeRest(M, S);
+  return std::move(S);
+}
+
+// Summarize the functions with index I % NumShares == Share in the module
+// (as read, before materializing upgrades anything), into Summaries[I].
+// The module is read lazily into this thread's context, so each share
+// can be read and summarized on a thread of its own.
+Error summarizeShare(MemoryBufferRef Buffer, size_t Share, size_t NumShares,
+                     std::vector<ModuleSummary::Function> &Summaries,
+                     bool &AddedFunctions) {
+  auto &C = getThreadContext(Buffer.getBufferSize());
+  auto ExpM = getLazyBitcodeModule(Buffer, C);
+  if (!ExpM)
+    return ExpM.takeError();
+  auto &M = **ExpM;
+
+  std::vector<llvm::Function *> Fns;
+  for (auto &F : M)
+    Fns.push_back(&F);
+  for (size_t I = Share, E = Fns.size(); I < E; I += NumShares) {
+    auto &F = *Fns[I];
+    // May already be materialized, if another one took a block's address.
+    if (F.isMaterializable())
+      if (auto Err = F.materialize())
+        return Err;
+    if (F.isDeclaration())
+      continue;
+    Summaries[I] = summarizeFunction(F);
+    if (!hasAddressTakenBlock(F))
+      F.deleteBody();
+  }
+
+  // Upgrading calls in old bitcode can declare functions, which would be
+  // listed if everything was materialized.
+  AddedFunctions = M.size() != Fns.size();
+  return Error::success();
+}
+
+// Same as computeLazily, but with the functions split among Threads
+// threads, which each read the module (except the other threads' function
+// bodies) again. That makes them take less time in total for a large
+// module than one thread reading them all.
+Expected<ModuleSummary> computeInParallel(MemoryBufferRef Buffer,
+                                          LLVMContext &C, unsigned Threads) {
+  auto ExpM = getLazyBitcodeModule(Buffer, C);
+  if (!ExpM) {
+    // Reported from there, as it would be for smaller modules
+    consumeError(ExpM.takeError());
+    return computeLazily(Buffer, C);
+  }
+  std::unique_ptr<Module> M = std::move(*ExpM);
+  if (mayStripDebugInfo(*M)) {
+    M.reset();
+    return computeLazily(Buffer, C);
+  }
+
+  // Function definitions by index, which is the same in every context.
+  DenseMap<const llvm::Function *, size_t> Index;
+  std::vector<bool> Defined;
+  for (auto &F : *M) {
+    Index[&F] = Defined.size();
+    Defined.push_back(F.isMaterializable());
+  }
+
+  std::vector<ModuleSummary::Function> Summaries(Defined.size());
+  std::mutex ErrMtx;
+  Error ShareErr = Error::success();
+  std::atomic<bool> AddedFunctions{false};
+  bool Materialized;
+  {
+    ThreadPool TP(Threads);
+    for (unsigned Share = 0; Share != Threads; ++Share)
+      TP.async([&, Share]() {
+        bool Added = false;
+        if (auto Err =
+                summarizeShare(Buffer, Share, Threads, Summaries, Added)) {
+          std::lock_guard<std::mutex> Lock(ErrMtx);
+          ShareErr = joinErrors(std::move(ShareErr), std::move(Err));
+        }
+        if (Added)
+          AddedFunctions = true;
+      });
+
+    // Meanwhile, finish materializing here (for the declarations and
+    // upgrades), without reading any function bodies.
+    for (auto &F : *M)
+      if (F.isMaterializable())
+        F.deleteBody();
+    // Fails if globals take the address of blocks, which are then never read.
+    Error Err = M->materializeAll();
+    Materialized = !Err;
+    consumeError(std::move(Err));
+
+    TP.wait();
+  }
+  if (ShareErr)
+    return std::move(ShareErr);
+  if (!Materialized || AddedFunctions) {
+    M.reset();
+    return computeLazily(Buffer, C);
+  }
+
+  // Only declarations are erased when materializing, so any function at
+  // the address of a definition is that definition.
+  ModuleSummary S;
+  for (auto &F : *M) {
+    auto It = Index.find(&F);
+    if (It != Index.end() && Defined[It->second])
+      S.Functions.push_back(std::move(Summaries[It->second]));
+    else
+      S.Functions.push_back(summarizeFunction(F));
+    S.Insts += S.Functions.back().Insts;
+  }
+  summarizeRest(*M, S);
+  return std::move(S);
+}
+
+} // end anonymous namespace
+
+std::string ModuleSummary::serialize() const { return ::serialize(*this); }
+
+Optional<ModuleSummary> ModuleSummary::deserialize(StringRef Data) {
+  return ::deserialize(Data);
+}
+
+ModuleSummary ModuleSummary::compute(Module &M) {
+  ModuleSummary S;
+  for (auto &F : M) {
+    S.Functions.push_back(summarizeFunction(F));
+    S.Insts += S.Functions.back().Insts;
+  }
+  summarizeRest(M, S);
+  return S;
+}
+
+Expected<ModuleSummary>
+allvm_analysis::computeModuleSummary(StringRef Filename,
+                                     unsigned FunctionThreads) {
+  auto MB = MemoryBuffer::getFile(Filename);
+  if (!MB)
+    return make_error<StringError>("Unable to open module file " + Filename,
+                                   MB.getError());
+  return computeModuleSummary((*MB)->getMemBufferRef(), FunctionThreads);
+}
+
+Expected<ModuleSummary>
+allvm_analysis::computeModuleSummary(MemoryBufferRef Buffer,
+                                     unsigned FunctionThreads) {
+  auto *Start =
+      reinterpret_cast<const unsigned char *>(Buffer.getBufferStart());
+  auto *End = reinterpret_cast<const unsigned char *>(Buffer.getBufferEnd());
+  auto &C = getThreadContext(Buffer.getBufferSize());
+  if (isBitcode(Start, End)) {
+    if (FunctionThreads == 0)
+      FunctionThreads = heavyweight_hardware_concurrency();
+    if (FunctionThreads > 1 && Buffer.getBufferSize() >= ParallelMinSize)
+      return computeInParallel(Buffer, C, FunctionThreads);
+    return computeLazily(Buffer, C);
+  }
+
+  SMDiagnostic SM;
+  auto M = llvm::parseIR(Buffer, SM, C);
+  if (!M)
+    return make_error<StringError>("Unable to open module file " +
+                                       Buffer.getBufferIdentifier(),
+                                   errc::invalid_argument);
+  return ModuleSummary::compute(*M);
+}
+
+Expected<ModuleSummary> SummaryCache::get(StringRef Filename) {
+  auto MB = MemoryBuffer::getFile(Filename);
+  if (!MB)
+    return make_error<StringError>("Unable to open module file " + Filename,
+                                   MB.getError());
+  return get((*MB)->getMemBufferRef());
+}
+
+Expected<ModuleSummary> SummaryCache::get(MemoryBufferRef MBRef) {
+  auto Buffer = MBRef.getBuffer();
+
+  SmallString<128> EntryPath(Dir);
+  {
+    SmallString<48> Name;
+    raw_svector_ostream NOS(Name);
+    NOS << hashContent(Buffer) << "-" << Buffer.size();
+    sys::path::append(EntryPath, Name);
+  }
+
+  if (auto EntryMB = MemoryBuffer::getFile(EntryPath, /* FileSize */ -1,
+                                           /* RequiresNullTerminator */ false))
+    if (auto S = deserialize((*EntryMB)->getBuffer())) {
+      ++Hits;
+      return std::move(*S);
+    }
+
+  ++Misses;
+  auto S = computeModuleSummary(MBRef, FunctionThreads);
+  if (!S)
+    return S.takeError();
+
+  // Failing to store the entry only costs the next run some time.
+  if (sys::fs::create_directories(Dir))
+    return S;
+  consumeError(writeFileAtomically(EntryPath, serialize(*S)));
+
+  return S;
+}
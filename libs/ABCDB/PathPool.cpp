@@ -0,0 +1,37 @@
+//===-- PathPool.cpp ------------------------------------------------------===//
+//
+// Interned storage for large numbers of paths, see PathPool.h.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/PathPool.h"
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+uint32_t intern(StringRef S, StringMap<uint32_t> &Map,
+                std::vector<StringRef> &Strings) {
+  auto I = Map.insert({S, static_cast<uint32_t>(Strings.size())});
+  if (I.second)
+    Strings.push_back(I.first->getKey());
+  return I.first->second;
+}
+
+} // end anonymous namespace
+
+PathPool::PathID PathPool::add(StringRef Path) {
+  auto Sep = Path.rfind('/');
+  size_t DirLen = Sep == StringRef::npos ? 0 : Sep + 1;
+
+  Entry E;
+  E.Dir = intern(Path.substr(0, DirLen), DirMap, Dirs);
+  E.Name = intern(Path.substr(DirLen), NameMap, Names);
+
+  uint64_t Key = (uint64_t(E.Dir) << 32) | E.Name;
+  auto I = PathMap.insert({Key, static_cast<PathID>(Paths.size())});
+  if (I.second)
+    Paths.push_back(E);
+  return I.first->second;
+}
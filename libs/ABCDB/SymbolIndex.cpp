@@ -0,0 +1,445 @@
+//===-- SymbolIndex.cpp ---------------------------------------------------===//
+//
+// Symbol -> module index, stored in the same style as the catalog.
+//
+// Layout (all integers are little-endian uint32_t, except keys, which
+// limits indexes to 4GB):
+//
+//   Header:  magic, version, number of modules,
+//            offsets of the sections below.
+//   Modules: ModuleKey of each module in the index, by local index
+//   Symbols: OnDiskIterableChainedHashTable,
+//            symbol name -> [{local module index, flags, uses}]
+//
+// Entries of a symbol are sorted by local module index. Local indices
+// are the module IDs of the DB the index was built for; DBs from later
+// scans may number modules differently, so they are mapped by key
+// (including the full content hash) when the index is loaded.
+//
+//===----------------------------------------------------------------------===//
+
+#include "allvm-analysis/SymbolIndex.h"
+
+#include "allvm-analysis/AtomicFile.h"
+#include "allvm-analysis/ContextPool.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/EndianStream.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/OnDiskHashTable.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/ThreadPool.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+const char IndexMagic[] = {'A', 'B', 'C', 'D', 'B', 'S', 'Y', 'M'};
+// Version 1 could have keys without a hash, see below.
+const uint32_t IndexVersion = 2;
+
+const size_t HeaderSize = sizeof(IndexMagic) + 6 * sizeof(uint32_t);
+const size_t KeySize = 3 * sizeof(uint64_t);
+const size_t EntrySize = 3 * sizeof(uint32_t);
+
+const ModuleID NoModule = ~ModuleID(0);
+
+struct IndexHeader {
+  uint32_t Version;
+  uint32_t NumModules;
+  uint32_t ModuleOffset;
+  uint32_t SymbolPayloadOffset;
+  uint32_t SymbolBucketOffset;
+};
+
+// Entries of a symbol, as stored in the index.
+struct EntryList {
+  const unsigned char *Data;
+  uint32_t Count;
+};
+
+// Key handling shared by the generator and the reader traits below,
+// which differ in how the entries are represented.
+struct SymbolTableInfoBase {
+  using key_type = StringRef;
+  using key_type_ref = StringRef;
+  using hash_value_type = uint32_t;
+  using offset_type = uint32_t;
+
+  using internal_key_type = StringRef;
+  using external_key_type = StringRef;
+
+  // Needs to be the same across runs, so no llvm::hash_value.
+  static hash_value_type ComputeHash(StringRef Key) {
+    return static_cast<hash_value_type>(hashContent(Key).Low);
+  }
+  static bool EqualKey(StringRef A, StringRef B) { return A == B; }
+  static StringRef GetInternalKey(StringRef Key) { return Key; }
+  static StringRef GetExternalKey(StringRef Key) { return Key; }
+
+  static std::pair<offset_type, offset_type>
+  ReadKeyDataLength(const unsigned char *&P) {
+    using namespace llvm::support;
+    auto KeyLen = endian::readNext<uint32_t, little, unaligned>(P);
+    auto DataLen = endian::readNext<uint32_t, little, unaligned>(P);
+    return {KeyLen, DataLen};
+  }
+  static StringRef ReadKey(const unsigned char *Data, offset_type Len) {
+    return StringRef(reinterpret_cast<const char *>(Data), Len);
+  }
+};
+
+class SymbolTableWriterInfo : public SymbolTableInfoBase {
+public:
+  using data_type = std::vector<SymbolIndex::Entry>;
+  using data_type_ref = const data_type &;
+
+  static std::pair<offset_type, offset_type>
+  EmitKeyDataLength(raw_ostream &Out, StringRef Key, data_type_ref Data) {
+    support::endian::Writer<support::little> LE(Out);
+    auto KeyLen = static_cast<offset_type>(Key.size());
+    auto DataLen = static_cast<offset_type>(Data.size() * EntrySize);
+    LE.write<uint32_t>(KeyLen);
+    LE.write<uint32_t>(DataLen);
+    return {KeyLen, DataLen};
+  }
+  static void EmitKey(raw_ostream &Out, StringRef Key, offset_type) {
+    Out << Key;
+  }
+  static void EmitData(raw_ostream &Out, StringRef, data_type_ref Data,
+                       offset_type) {
+    support::endian::Writer<support::little> LE(Out);
+    for (auto &E : Data) {
+      LE.write<uint32_t>(E.Module);
+      LE.write<uint32_t>(E.Flags);
+      LE.write<uint32_t>(E.NumUses);
+    }
+  }
+};
+
+class SymbolTableReaderInfo : public SymbolTableInfoBase {
+public:
+  using data_type = EntryList;
+  using data_type_ref = EntryList;
+
+  static data_type ReadData(StringRef, const unsigned char *Data,
+                            offset_type Len) {
+    return {Data, static_cast<uint32_t>(Len / EntrySize)};
+  }
+};
+
+void writeHeader(raw_ostream &OS, const IndexHeader &H) {
+  support::endian::Writer<support::little> LE(OS);
+  OS.write(IndexMagic, sizeof(IndexMagic));
+  for (auto V : {H.Version, H.NumModules, H.ModuleOffset,
+                 H.SymbolPayloadOffset, H.SymbolBucketOffset})
+    LE.write<uint32_t>(V);
+  // Reserved
+  LE.write<uint32_t>(0);
+}
+
+Error invalidIndex(StringRef Path, const Twine &Reason) {
+  return make_error<StringError>("Invalid symbol index '" + Path +
+                                     "': " + Reason,
+                                 errc::invalid_argument);
+}
+
+// Symbol as found while indexing a module.
+struct SymbolInfo {
+  std::string Name;
+  uint32_t Flags;
+  uint32_t NumUses;
+};
+
+Error indexModule(StringRef Filename, std::vector<SymbolInfo> &Symbols) {
+  auto MB = MemoryBuffer::getFile(Filename);
+  if (!MB)
+    return make_error<StringError>("Unable to open module file " + Filename,
+                                   MB.getError());
+  SMDiagnostic SM;
+  auto M = llvm::parseIR((*MB)->getMemBufferRef(), SM,
+                         getThreadContext((*MB)->getBufferSize()));
+  if (!M)
+    return make_error<StringError>("Unable to open module file " + Filename,
+                                   errc::invalid_argument);
+  if (auto Err = M->materializeAll())
+    return Err;
+
+  auto add = [&](const GlobalValue &GV) {
+    if (!GV.hasName())
+      return;
+    uint32_t Flags = 0;
+    if (!GV.isDeclaration())
+      Flags |= SymbolIndex::Defined;
+    if (isa<Function>(GV))
+      Flags |= SymbolIndex::Function;
+    Symbols.push_back(
+        {GV.getName().str(), Flags, static_cast<uint32_t>(GV.getNumUses())});
+  };
+  for (auto &F : *M)
+    add(F);
+  for (auto &GV : M->globals())
+    add(GV);
+  for (auto &GA : M->aliases())
+    add(GA);
+
+  return Error::success();
+}
+
+} // end anonymous namespace
+
+class SymbolIndex::Table
+    : public OnDiskIterableChainedHashTable<SymbolTableReaderInfo> {
+public:
+  using OnDiskIterableChainedHashTable::OnDiskIterableChainedHashTable;
+};
+
+SymbolIndex::~SymbolIndex() = default;
+
+llvm::Expected<std::unique_ptr<SymbolIndex>>
+SymbolIndex::build(const ABCDB &DB, const SymbolIndex *Previous,
+                   unsigned Threads) {
+  StringMap<std::vector<Entry>> BySymbol;
+
+  // Keep what is known about modules still in DB.
+  std::vector<ModuleID> ToIndex;
+  if (Previous) {
+    auto &T = *Previous->Symbols;
+    for (auto I = T.key_begin(), E = T.key_end(); I != E; ++I) {
+      auto Name = *I;
+      auto List = *T.find(Name);
+      auto Entries = Previous->decode(List.Data, List.Count);
+      if (!Entries.empty())
+        BySymbol[Name] = std::move(Entries);
+    }
+    ToIndex = Previous->Missing;
+  } else {
+    ToIndex.resize(DB.getNumModules());
+    for (ModuleID ID = 0, E = DB.getNumModules(); ID != E; ++ID)
+      ToIndex[ID] = ID;
+  }
+
+  std::vector<std::vector<SymbolInfo>> Found(ToIndex.size());
+  std::mutex ErrMtx;
+  Error LoadErr = Error::success();
+  std::atomic<bool> Failed{false};
+  {
+    ThreadPool TP(Threads ? Threads : heavyweight_hardware_concurrency());
+    for (size_t i = 0, e = ToIndex.size(); i != e; ++i)
+      TP.async([&, i]() {
+        if (Failed)
+          return;
+        auto Filename = DB.getModule(ToIndex[i]).getBitcodePath();
+        if (auto Err = indexModule(Filename, Found[i])) {
+          std::lock_guard<std::mutex> Lock(ErrMtx);
+          LoadErr = joinErrors(std::move(LoadErr), std::move(Err));
+          Failed = true;
+        }
+      });
+    TP.wait();
+  }
+  if (LoadErr)
+    return std::move(LoadErr);
+
+  for (size_t i = 0, e = ToIndex.size(); i != e; ++i) {
+    for (auto &S : Found[i])
+      BySymbol[S.Name].push_back({ToIndex[i], S.Flags, S.NumUses});
+    Found[i] = {};
+  }
+
+  // Local indices of the new index are DB's module ID's.
+  OnDiskChainedHashTableGenerator<SymbolTableWriterInfo> Generator;
+  for (auto &S : BySymbol) {
+    auto &Entries = S.second;
+    std::sort(
+        Entries.begin(), Entries.end(),
+        [](const Entry &A, const Entry &B) { return A.Module < B.Module; });
+    Generator.insert(S.first(), Entries);
+  }
+
+  // Keys are full, the index may be loaded for a later scan. Modules
+  // mapped from Previous were hashed as needed to be matched.
+  DB.hashModules(ToIndex, Threads);
+
+  IndexHeader H{};
+  H.Version = IndexVersion;
+  H.NumModules = static_cast<uint32_t>(DB.getNumModules());
+
+  SmallVector<char, 0> Buffer;
+  raw_svector_ostream OS(Buffer);
+  support::endian::Writer<support::little> LE(OS);
+
+  // Placeholder, rewritten once offsets are known.
+  writeHeader(OS, H);
+
+  H.ModuleOffset = static_cast<uint32_t>(OS.tell());
+  for (auto M : DB.getMods()) {
+    auto Key = M.getFullKey();
+    LE.write<uint64_t>(Key.Size);
+    LE.write<uint64_t>(Key.Hash.Low);
+    LE.write<uint64_t>(Key.Hash.High);
+  }
+
+  H.SymbolPayloadOffset = static_cast<uint32_t>(OS.tell());
+  H.SymbolBucketOffset = Generator.Emit(OS);
+  // All offsets are within the whole, which uint32_t has to reach.
+  if (Buffer.size() > UINT32_MAX)
+    return make_error<StringError>("Symbol index over 4GB",
+                                   errc::file_too_large);
+
+  SmallString<HeaderSize> HeaderBuf;
+  raw_svector_ostream HOS(HeaderBuf);
+  writeHeader(HOS, H);
+  assert(HeaderBuf.size() == HeaderSize);
+  OS.pwrite(HeaderBuf.data(), HeaderBuf.size(), 0);
+
+  return create(MemoryBuffer::getMemBufferCopy(OS.str(), "<symbol index>"),
+                DB, Threads);
+}
+
+llvm::Expected<std::unique_ptr<SymbolIndex>>
+SymbolIndex::loadFromDisk(StringRef Path, const ABCDB &DB,
+                          unsigned Threads) {
+  // Indices are large, let MemoryBuffer mmap them.
+  auto MB = MemoryBuffer::getFile(Path, /* FileSize */ -1,
+                                  /* RequiresNullTerminator */ false);
+  if (!MB)
+    return make_error<StringError>("Unable to open symbol index " + Path,
+                                   MB.getError());
+  return create(std::move(*MB), DB, Threads);
+}
+
+llvm::Expected<std::unique_ptr<SymbolIndex>>
+SymbolIndex::create(std::unique_ptr<MemoryBuffer> Buffer, const ABCDB &DB,
+                    unsigned Threads) {
+  using namespace llvm::support;
+
+  auto Path = Buffer->getBufferIdentifier();
+  StringRef Data = Buffer->getBuffer();
+  auto *Base = reinterpret_cast<const unsigned char *>(Data.data());
+
+  if (Data.size() < HeaderSize ||
+      !Data.startswith(StringRef(IndexMagic, sizeof(IndexMagic))))
+    return invalidIndex(Path, "bad magic");
+
+  const unsigned char *P = Base + sizeof(IndexMagic);
+  auto next = [&P]() {
+    return endian::readNext<uint32_t, little, unaligned>(P);
+  };
+  IndexHeader H;
+  H.Version = next();
+  if (H.Version != IndexVersion)
+    return invalidIndex(Path, "unsupported version " + Twine(H.Version));
+  H.NumModules = next();
+  H.ModuleOffset = next();
+  H.SymbolPayloadOffset = next();
+  H.SymbolBucketOffset = next();
+
+  auto inBounds = [&](uint64_t Offset, uint64_t Size) {
+    return Offset <= Data.size() && Size <= Data.size() - Offset;
+  };
+  if (!inBounds(H.ModuleOffset, uint64_t(H.NumModules) * KeySize) ||
+      !inBounds(H.SymbolPayloadOffset, 0) ||
+      !inBounds(H.SymbolBucketOffset, 2 * sizeof(uint32_t)) ||
+      H.SymbolBucketOffset % sizeof(uint32_t))
+    return invalidIndex(Path, "truncated");
+
+  std::unique_ptr<SymbolIndex> Index(new SymbolIndex());
+
+  // Map modules in the index to those of DB, by full key. A module of
+  // DB whose size is unique there has no hash in its key, so it's only
+  // a candidate until hashed.
+  std::vector<ModuleKey> Keys(H.NumModules);
+  std::vector<ModuleID> Candidates;
+  const unsigned char *MP = Base + H.ModuleOffset;
+  Index->LocalToDB.resize(H.NumModules, NoModule);
+  for (uint32_t i = 0; i != H.NumModules; ++i) {
+    auto &Key = Keys[i];
+    Key.Size = endian::readNext<uint64_t, little, unaligned>(MP);
+    Key.Hash.Low = endian::readNext<uint64_t, little, unaligned>(MP);
+    Key.Hash.High = endian::readNext<uint64_t, little, unaligned>(MP);
+    // Without a hash, a module rebuilt to the same size would match
+    // and keep its stale symbols; reindex it instead.
+    if (Key.Hash.isZero())
+      continue;
+    if (auto ID = DB.findModule(Key))
+      Index->LocalToDB[i] = *ID;
+    else if (auto ID = DB.findModule({Key.Size, ContentHash()}))
+      Candidates.push_back(*ID);
+  }
+  if (!Candidates.empty()) {
+    DB.hashModules(Candidates, Threads);
+    for (uint32_t i = 0; i != H.NumModules; ++i) {
+      if (Index->LocalToDB[i] != NoModule || Keys[i].Hash.isZero())
+        continue;
+      auto ID = DB.findModule({Keys[i].Size, ContentHash()});
+      if (ID && DB.getModule(*ID).getFullKey() == Keys[i])
+        Index->LocalToDB[i] = *ID;
+    }
+  }
+
+  std::vector<bool> Indexed(DB.getNumModules());
+  for (auto ID : Index->LocalToDB)
+    if (ID != NoModule)
+      Indexed[ID] = true;
+  for (ModuleID ID = 0, E = DB.getNumModules(); ID != E; ++ID)
+    if (!Indexed[ID])
+      Index->Missing.push_back(ID);
+
+  const unsigned char *Buckets = Base + H.SymbolBucketOffset;
+  auto NumBucketsAndEntries = Table::readNumBucketsAndEntries(Buckets);
+  if (!inBounds(H.SymbolBucketOffset,
+                2 * sizeof(uint32_t) +
+                    uint64_t(NumBucketsAndEntries.first) * sizeof(uint32_t)))
+    return invalidIndex(Path, "truncated");
+  Index->Symbols = llvm::make_unique<Table>(
+      NumBucketsAndEntries.first, NumBucketsAndEntries.second, Buckets,
+      Base + H.SymbolPayloadOffset, Base);
+  Index->Buffer = std::move(Buffer);
+  return std::move(Index);
+}
+
+std::vector<SymbolIndex::Entry>
+SymbolIndex::decode(const unsigned char *P, uint32_t Count) const {
+  using namespace llvm::support;
+  std::vector<Entry> Result;
+  for (uint32_t i = 0; i != Count; ++i) {
+    Entry E;
+    auto Local = endian::readNext<uint32_t, little, unaligned>(P);
+    E.Flags = endian::readNext<uint32_t, little, unaligned>(P);
+    E.NumUses = endian::readNext<uint32_t, little, unaligned>(P);
+    // Skip modules that are no longer around
+    if (Local >= LocalToDB.size() || LocalToDB[Local] == NoModule)
+      continue;
+    E.Module = LocalToDB[Local];
+    Result.push_back(E);
+  }
+  return Result;
+}
+
+std::vector<SymbolIndex::Entry> SymbolIndex::lookup(StringRef Symbol) const {
+  auto I = Symbols->find(Symbol);
+  if (I == Symbols->end())
+    return {};
+  auto List = *I;
+  auto Result = decode(List.Data, List.Count);
+  // Module ID's of a later scan needn't be in the same order.
+  std::sort(Result.begin(), Result.end(),
+            [](const Entry &A, const Entry &B) { return A.Module < B.Module; });
+  return Result;
+}
+
+llvm::Error SymbolIndex::writeToDisk(StringRef Path) const {
+  return writeFileAtomically(Path, Buffer->getBuffer());
+}
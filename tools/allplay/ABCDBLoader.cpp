@@ -0,0 +1,211 @@
+#include "ABCDBLoader.h"
+
+#include "ModuleMapReduce.h"
+#include "ThreadSupport.h"
+#include "WorkerProcesses.h"
+
+#include <llvm/ADT/Optional.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+
+using namespace allvm_analysis;
+using namespace allvm;
+using namespace llvm;
+
+namespace {
+
+cl::opt<std::string> CatalogFile(
+    "abcdb-catalog", cl::Optional, cl::init(""),
+    cl::desc("ABCDB catalog to use instead of scanning, written if missing"),
+    cl::sub(*cl::AllSubCommands));
+cl::opt<bool>
+    Rescan("rescan", cl::Optional, cl::init(false),
+           cl::desc("Ignore existing ABCDB catalog, scan and overwrite it"),
+           cl::sub(*cl::AllSubCommands));
+cl::opt<bool> Incremental(
+    "incremental", cl::Optional, cl::init(false),
+    cl::desc("Update existing ABCDB catalog, only opening new/changed files"),
+    cl::sub(*cl::AllSubCommands));
+cl::opt<unsigned>
+    ScanThreads("scan-threads", cl::Optional, cl::init(0),
+                cl::desc("Number of threads for walking directories and "
+                         "opening files when scanning, and for hashing "
+                         "modules and indexing symbols, 0 to auto-detect"),
+                cl::sub(*cl::AllSubCommands));
+cl::opt<std::string> MirrorDir(
+    "mirror", cl::Optional, cl::init(""),
+    cl::desc("Read modules from their copies without debug info in this "
+             "directory, where present (see 'allplay mirror')"),
+    cl::sub(*cl::AllSubCommands));
+cl::opt<std::string> AllexeCacheDir(
+    "allexe-cache", cl::Optional, cl::init(""),
+    cl::desc("Directory for caching module bitcode inflated from allexes"),
+    cl::sub(*cl::AllSubCommands));
+cl::opt<std::string> SummaryCacheDir(
+    "summary-cache", cl::Optional, cl::init(""),
+    cl::desc("Directory for caching per-module analysis results"),
+    cl::sub(*cl::AllSubCommands));
+cl::opt<unsigned> FunctionThreads(
+    "function-threads", cl::Optional, cl::init(0),
+    cl::desc("Number of threads for reading the functions of each large "
+             "module when summarizing it, each with a copy of the module "
+             "without function bodies, 0 (default) to share the cores "
+             "left by -j/-processes"),
+    cl::sub(*cl::AllSubCommands));
+
+Expected<std::unique_ptr<ABCDB>>
+loadOrScan(StringRef InputDirectory, ResourcePaths &RP, bool UseBCScanner) {
+  auto Kind = UseBCScanner ? ScanKind::Bitcode : ScanKind::Allexes;
+
+  std::unique_ptr<ABCDB> Previous;
+  if (!CatalogFile.empty() && !Rescan && sys::fs::exists(CatalogFile)) {
+    auto ExpDB = ABCDB::loadFromDisk(CatalogFile);
+    if (!ExpDB) {
+      logAllUnhandledErrors(ExpDB.takeError(), errs(), "Warning: ");
+    } else if ((*ExpDB)->getScanKind() != Kind ||
+               (*ExpDB)->getScanRoot() != InputDirectory) {
+      errs() << "Warning: catalog '" << CatalogFile
+             << "' is for a different scan, ignoring.\n";
+    } else if (Incremental) {
+      errs() << "Updating catalog '" << CatalogFile << "'...\n";
+      Previous = std::move(*ExpDB);
+    } else {
+      errs() << "Loaded catalog '" << CatalogFile << "'\n";
+      return ExpDB;
+    }
+  }
+
+  if (!UseBCScanner && ScanThreads != 1)
+    if (auto Err = setDefaultThreadStackSize())
+      return std::move(Err);
+
+  auto ExpDB = UseBCScanner
+                   ? ABCDB::loadFromBitcodeIn(InputDirectory, RP,
+                                              Previous.get(), ScanThreads)
+                   : ABCDB::loadFromAllexesIn(InputDirectory, RP,
+                                              Previous.get(), ScanThreads,
+                                              getAllexeMemberCache());
+  if (!ExpDB || CatalogFile.empty())
+    return ExpDB;
+
+  if (auto Err = (*ExpDB)->writeToDisk(CatalogFile))
+    return std::move(Err);
+  errs() << "Wrote catalog '" << CatalogFile << "'\n";
+
+  return ExpDB;
+}
+
+} // end anonymous namespace
+
+Expected<std::unique_ptr<ABCDB>>
+allvm_analysis::loadABCDB(StringRef InputDirectory, ResourcePaths &RP,
+                          bool UseBCScanner) {
+  auto ExpDB = loadOrScan(InputDirectory, RP, UseBCScanner);
+  if (!ExpDB || MirrorDir.empty())
+    return ExpDB;
+
+  auto N = (*ExpDB)->useMirror(MirrorDir, ScanThreads);
+  if (!N)
+    return N.takeError();
+  errs() << "Using mirror '" << MirrorDir << "' for " << *N << " of "
+         << (*ExpDB)->getNumModules() << " modules\n";
+  return ExpDB;
+}
+
+Expected<std::unique_ptr<SymbolIndex>>
+allvm_analysis::loadSymbolIndex(const ABCDB &DB) {
+  std::string IndexFile;
+  if (!CatalogFile.empty())
+    IndexFile = CatalogFile + ".symbols";
+
+  std::unique_ptr<SymbolIndex> Previous;
+  if (!IndexFile.empty() && !Rescan && sys::fs::exists(IndexFile)) {
+    auto ExpIndex = SymbolIndex::loadFromDisk(IndexFile, DB, ScanThreads);
+    if (!ExpIndex) {
+      logAllUnhandledErrors(ExpIndex.takeError(), errs(), "Warning: ");
+    } else if ((*ExpIndex)->getMissingModules().empty()) {
+      errs() << "Loaded symbol index '" << IndexFile << "'\n";
+      return ExpIndex;
+    } else {
+      errs() << "Updating symbol index '" << IndexFile << "'...\n";
+      Previous = std::move(*ExpIndex);
+    }
+  }
+
+  errs() << "Indexing symbols of "
+         << (Previous ? Previous->getMissingModules().size()
+                      : DB.getNumModules())
+         << " modules...\n";
+  if (ScanThreads != 1)
+    if (auto Err = setDefaultThreadStackSize())
+      return std::move(Err);
+  auto ExpIndex = SymbolIndex::build(DB, Previous.get(), ScanThreads);
+  if (!ExpIndex || IndexFile.empty())
+    return ExpIndex;
+
+  if (auto Err = (*ExpIndex)->writeToDisk(IndexFile))
+    return std::move(Err);
+  errs() << "Wrote symbol index '" << IndexFile << "'\n";
+
+  return ExpIndex;
+}
+
+AllexeMemberCache *allvm_analysis::getAllexeMemberCache() {
+  if (AllexeCacheDir.empty())
+    return nullptr;
+  static AllexeMemberCache Cache(AllexeCacheDir);
+  return &Cache;
+}
+
+// Modules are already summarized -j (or -processes) at a time,
+// splitting each among all cores too would oversubscribe them. With
+// the default -j, that leaves one thread per module; large modules are
+// split only when fewer are summarized at once than there are cores.
+static unsigned getFunctionThreads() {
+  if (FunctionThreads != 0)
+    return FunctionThreads;
+  unsigned Summarizing = std::max(getNumJobs(), getNumProcesses());
+  return std::max(1u, heavyweight_hardware_concurrency() / Summarizing);
+}
+
+static SummaryCache &getSummaryCache() {
+  static SummaryCache Cache(SummaryCacheDir, getFunctionThreads());
+  return Cache;
+}
+
+// Summary of the original of a module read from a mirror, stored with
+// its copy since stripping changes instruction counts and hashes.
+static Optional<ModuleSummary> getMirroredSummary(ModuleRef M) {
+  auto Path = M.getMirrorSummaryPath();
+  if (Path.empty())
+    return None;
+  auto MB = MemoryBuffer::getFile(Path, /* FileSize */ -1,
+                                  /* RequiresNullTerminator */ false);
+  if (!MB)
+    return None;
+  return ModuleSummary::deserialize((*MB)->getBuffer());
+}
+
+Expected<ModuleSummary> allvm_analysis::getModuleSummary(ModuleRef M) {
+  if (auto S = getMirroredSummary(M))
+    return std::move(*S);
+  // Never from the mirror's copy, see above.
+  if (SummaryCacheDir.empty())
+    return computeModuleSummary(M.getFilename(), getFunctionThreads());
+  return getSummaryCache().get(M.getFilename());
+}
+
+Expected<ModuleSummary>
+allvm_analysis::getModuleSummary(ModuleRef M, MemoryBufferRef Contents) {
+  // Contents are of the mirror's copy, if any.
+  if (!M.getMirrorSummaryPath().empty())
+    return getModuleSummary(M);
+  if (SummaryCacheDir.empty())
+    return computeModuleSummary(Contents, getFunctionThreads());
+  return getSummaryCache().get(Contents);
+}
@@ -0,0 +1,47 @@
+#ifndef ALLPLAY_ABCDBLOADER_H
+#define ALLPLAY_ABCDBLOADER_H
+
+#include "allvm-analysis/ABCDB.h"
+#include "allvm-analysis/AllexeMembers.h"
+#include "allvm-analysis/ModuleSummary.h"
+#include "allvm-analysis/SymbolIndex.h"
+
+#include <allvm/ResourcePaths.h>
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include <memory>
+
+namespace allvm_analysis {
+
+// Build ABCDB for the given directory, scanning for allexes
+// (or for bitcode files if UseBCScanner is set).
+// If a catalog was requested using -abcdb-catalog, it is used instead of
+// scanning when it matches, and is (re)written after scanning otherwise.
+// With -incremental, the catalog is instead refreshed by rescanning
+// only files that changed since it was written.
+// With -mirror, modules are read from the given mirror where possible.
+llvm::Expected<std::unique_ptr<ABCDB>>
+loadABCDB(llvm::StringRef InputDirectory, allvm::ResourcePaths &RP,
+          bool UseBCScanner = false);
+
+// Get symbol index for DB. If a catalog is used, the index is kept next
+// to it (<catalog>.symbols) and only modules it doesn't know are indexed,
+// otherwise it is built from scratch.
+llvm::Expected<std::unique_ptr<SymbolIndex>> loadSymbolIndex(const ABCDB &DB);
+
+// Cache of inflated allexe members given with -allexe-cache, if any.
+AllexeMemberCache *getAllexeMemberCache();
+
+// Get summary of module, using the cache given with -summary-cache if any.
+// Modules read from a mirror have the summary of their original.
+// Safe to call from multiple threads.
+llvm::Expected<ModuleSummary> getModuleSummary(ModuleRef M);
+// Same, given the contents of M.getBitcodePath() already read.
+llvm::Expected<ModuleSummary> getModuleSummary(ModuleRef M,
+                                               llvm::MemoryBufferRef Contents);
+
+} // end namespace allvm_analysis
+
+#endif // ALLPLAY_ABCDBLOADER_H
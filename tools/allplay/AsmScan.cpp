@@ -1,7 +1,7 @@
+#include "ABCDBLoader.h"
+#include "ModuleAnalysis.h"
 #include "subcommand-registry.h"
 
-#include "boost_progress.h"
-
 // Preserve insert order
 #define CPPTOML_USE_MAP
 #include "cpptoml.h"
@@ -9,14 +9,13 @@
 #include "allvm-analysis/ABCDB.h"
 
 #include <llvm/ADT/DenseSet.h>
-#include <llvm/IR/CallSite.h>
-#include <llvm/IR/InlineAsm.h>
-#include <llvm/IRReader/IRReader.h>
 #include <llvm/Support/Errc.h>
 #include <llvm/Support/Format.h>
-#include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/raw_ostream.h>
 
+#include <algorithm>
+#include <iterator>
+
 using namespace allvm_analysis;
 using namespace allvm;
 using namespace llvm;
@@ -33,65 +32,9 @@ cl::opt<bool> UseBCScanner("bc-scanner", cl::Optional, cl::init(false),
                            cl::desc("Use BC scanner instead of allexe scanner"),
                            cl::sub(AsmScan));
 
-Error asmScan(ABCDB &DB) {
-
-  errs() << "Starting Asm Scan...\n";
-
-  // TODO: Would it be useful to store asm strings for aggregate analysis?
-  // TODO: Count occurrences of inline asm?
-  DenseSet<decltype(ModuleInfo::ModuleCRC)> ModulesWithModuleAsm;
-  DenseSet<decltype(ModuleInfo::ModuleCRC)> ModulesWithInlineAsm;
-
-  auto root = cpptoml::make_table();
-
-  boost::progress_display mod_progress(DB.getMods().size(), llvm::errs());
-  for (auto MI : DB.getMods()) {
-    SMDiagnostic SM;
-    LLVMContext C;
-    auto M = llvm::parseIRFile(MI.Filename, SM, C);
-    if (!M)
-      return make_error<StringError>(
-          "Unable to open module file " + MI.Filename, errc::invalid_argument);
-
-    if (auto Err = M->materializeAll())
-      return Err;
-
-    auto &Asm = M->getModuleInlineAsm();
-    auto mod_table = cpptoml::make_table();
-    if (!Asm.empty()) {
-      mod_table->insert("module-level", Asm);
-      ModulesWithModuleAsm.insert(MI.ModuleCRC);
-    }
-
-    auto inline_table = cpptoml::make_table();
-    for (auto &F : *M) {
-      auto inst_array = cpptoml::make_array();
-      for (auto &B : F) {
-        for (auto &I : B) {
-          CallSite CS(&I);
-          if (!CS)
-            continue;
-
-          if (auto *IA = dyn_cast<InlineAsm>(CS.getCalledValue())) {
-            // Found inline asm!
-            inst_array->push_back(IA->getAsmString() + " ---- " +
-                                  IA->getConstraintString());
-
-            ModulesWithInlineAsm.insert(MI.ModuleCRC);
-          }
-        }
-      }
-      if (inst_array->begin() != inst_array->end())
-        inline_table->insert(F.getName(), inst_array);
-    }
-    if (!inline_table->empty())
-      mod_table->insert("inline", inline_table);
-    if (!mod_table->empty()) {
-      root->insert(MI.Filename, mod_table);
-    }
-    ++mod_progress;
-  }
-
+Error reportAsm(ABCDB &DB, const DenseSet<ModuleID> &ModulesWithModuleAsm,
+                const DenseSet<ModuleID> &ModulesWithInlineAsm,
+                const std::shared_ptr<cpptoml::table> &root) {
   errs() << "Asm scan complete: \n";
   std::stringstream ss;
   ss << *root;
@@ -101,24 +44,27 @@ Error asmScan(ABCDB &DB) {
   errs() << "\n-------------------\n";
   errs() << "Allexes containing some form of asm:\n";
   errs() << "(ModuleLevelAsm?,InlineAsm?,AllexePath)\n";
-  size_t ModAllexes = 0;
-  size_t InlineAllexes = 0;
-  for (auto &A : DB.getAllexes()) {
-
-    auto hasModuleInSet = [](auto &Allexe, auto &Set) {
-      return std::any_of(Allexe.Modules.begin(), Allexe.Modules.end(),
-                         [&Set](auto &M) { return Set.count(M.ModuleCRC); });
-    };
-
-    bool modAsm = hasModuleInSet(A, ModulesWithModuleAsm);
-    bool inlineAsm = hasModuleInSet(A, ModulesWithInlineAsm);
-
-    if (modAsm)
-      ++ModAllexes;
-    if (inlineAsm)
-      ++InlineAllexes;
-    if (modAsm || inlineAsm)
-      errs() << modAsm << "," << inlineAsm << "," << A.Filename << "\n";
+  auto allexesContaining = [&DB](auto &Set) {
+    std::vector<ModuleID> IDs(Set.begin(), Set.end());
+    return DB.getAllexesContainingAny(IDs);
+  };
+  auto ModAsmAllexes = allexesContaining(ModulesWithModuleAsm);
+  auto InlineAsmAllexes = allexesContaining(ModulesWithInlineAsm);
+  size_t ModAllexes = ModAsmAllexes.size();
+  size_t InlineAllexes = InlineAsmAllexes.size();
+
+  // Both are sorted, walk them together to print in allexe order.
+  std::vector<AllexeID> AnyAsmAllexes;
+  std::set_union(ModAsmAllexes.begin(), ModAsmAllexes.end(),
+                 InlineAsmAllexes.begin(), InlineAsmAllexes.end(),
+                 std::back_inserter(AnyAsmAllexes));
+  for (auto ID : AnyAsmAllexes) {
+    bool modAsm = std::binary_search(ModAsmAllexes.begin(),
+                                     ModAsmAllexes.end(), ID);
+    bool inlineAsm = std::binary_search(InlineAsmAllexes.begin(),
+                                        InlineAsmAllexes.end(), ID);
+    errs() << modAsm << "," << inlineAsm << ","
+           << DB.getAllexe(ID).getFilename() << "\n";
   }
 
   // little helper
@@ -144,11 +90,61 @@ Error asmScan(ABCDB &DB) {
   return Error::success();
 }
 
+class AsmScanAnalysis : public ModuleAnalysis {
+  // TODO: Would it be useful to store asm strings for aggregate analysis?
+  // TODO: Count occurrences of inline asm?
+  DenseSet<ModuleID> ModulesWithModuleAsm;
+  DenseSet<ModuleID> ModulesWithInlineAsm;
+
+  std::shared_ptr<cpptoml::table> root = cpptoml::make_table();
+
+public:
+  Error begin(ABCDB &) override {
+    errs() << "Starting Asm Scan...\n";
+    return Error::success();
+  }
+
+  Error addModule(ModuleRef MI, const ModuleSummary &S) override {
+    auto Filename = MI.getFilename();
+    auto &Asm = S.ModuleAsm;
+    auto mod_table = cpptoml::make_table();
+    if (!Asm.empty()) {
+      mod_table->insert("module-level", Asm);
+      ModulesWithModuleAsm.insert(MI.getID());
+    }
+
+    auto inline_table = cpptoml::make_table();
+    for (auto &F : S.Functions) {
+      if (F.InlineAsm.empty())
+        continue;
+      // Found inline asm!
+      auto inst_array = cpptoml::make_array();
+      for (auto &IA : F.InlineAsm)
+        inst_array->push_back(IA);
+      inline_table->insert(F.Name, inst_array);
+      ModulesWithInlineAsm.insert(MI.getID());
+    }
+    if (!inline_table->empty())
+      mod_table->insert("inline", inline_table);
+    if (!mod_table->empty()) {
+      root->insert(Filename, mod_table);
+    }
+    return Error::success();
+  }
+
+  Error finish(ABCDB &DB) override {
+    return reportAsm(DB, ModulesWithModuleAsm, ModulesWithInlineAsm, root);
+  }
+};
+
+AnalysisRegistration Registered("asmscan", [](StringRef) {
+  return llvm::make_unique<AsmScanAnalysis>();
+});
+
 CommandRegistration Unused(&AsmScan, [](ResourcePaths &RP) -> Error {
   errs() << "Scanning " << InputDirectory << "...\n";
 
-  auto ExpDB = UseBCScanner ? ABCDB::loadFromBitcodeIn(InputDirectory, RP)
-                            : ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP, UseBCScanner);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
@@ -156,7 +152,8 @@ CommandRegistration Unused(&AsmScan, [](ResourcePaths &RP) -> Error {
   errs() << "Done! Allexes found: " << DB->allexe_size() << "\n";
   errs() << "Done! Modules found: " << DB->getMods().size() << "\n";
 
-  return asmScan(*DB);
+  AsmScanAnalysis A;
+  return runModuleAnalyses(*DB, {&A}, errs());
 });
 
 } // end anonymous namespace
@@ -1,3 +1,5 @@
+#include "ABCDBLoader.h"
+#include "ModuleMapReduce.h"
 #include "subcommand-registry.h"
 
 #include "allvm-analysis/ABCDB.h"
@@ -37,15 +39,17 @@ Error saveCombinedModule(ABCDB &DB, StringRef Filename) {
   BitcodeWriter Writer(Buffer);
 
   // Binary cat, like llvm-cat does (optionally)
-  for (auto MI : DB.getMods()) {
-    auto MB = errorOrToExpected(MemoryBuffer::getFile(MI.Filename));
+  std::vector<ModuleRef> Mods(DB.getMods().begin(), DB.getMods().end());
+  ModulePrefetcher Prefetch(Mods);
+  for (auto MI : Mods) {
+    auto MB = Prefetch.take(MI);
     if (!MB)
       return MB.takeError();
-    auto Mods = getBitcodeModuleList(**MB);
-    if (!Mods)
-      return Mods.takeError();
+    auto BitcodeMods = getBitcodeModuleList(**MB);
+    if (!BitcodeMods)
+      return BitcodeMods.takeError();
 
-    for (auto &BitcodeMod : *Mods)
+    for (auto &BitcodeMod : *BitcodeMods)
       Buffer.insert(Buffer.end(), BitcodeMod.getBuffer().begin(),
                     BitcodeMod.getBuffer().end());
   }
@@ -65,8 +69,7 @@ Error saveCombinedModule(ABCDB &DB, StringRef Filename) {
 CommandRegistration Unused(&Combine, [](ResourcePaths &RP) -> Error {
   errs() << "Scanning " << InputDirectory << "...\n";
 
-  auto ExpDB = UseBCScanner ? ABCDB::loadFromBitcodeIn(InputDirectory, RP)
-                            : ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP, UseBCScanner);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
@@ -1,3 +1,4 @@
+#include "ABCDBLoader.h"
 #include "subcommand-registry.h"
 
 #include "allvm-analysis/ABCDB.h"
@@ -50,11 +51,12 @@ Error cypher(ABCDB &DB, StringRef Prefix, StringRef OutputFilename) {
 
   // Create module nodes
   size_t idx = 0;
-  for (auto &M : DB.getMods()) {
+  for (auto M : DB.getMods()) {
+    auto Filename = M.getFilename();
     OS << "CREATE (:Module {";
-    OS << "Name:\"" << basename(M.Filename) << "\", ";
-    OS << "Path:\"" << removePrefix(M.Filename) << "\", ";
-    OS << "CRC:" << M.ModuleCRC;
+    OS << "Name:\"" << basename(Filename) << "\", ";
+    OS << "Path:\"" << removePrefix(Filename) << "\", ";
+    OS << "CRC:" << M.getCRC();
     OS << "})\n";
     if (++idx == 500) {
       idx = 0;
@@ -68,10 +70,11 @@ Error cypher(ABCDB &DB, StringRef Prefix, StringRef OutputFilename) {
   OS << "CALL db.awaitIndex(\":Module(CRC)\");\n";
 
   // allexe nodes
-  for (auto &A : DB.getAllexes()) {
+  for (auto A : DB.getAllexes()) {
+    auto Filename = A.getFilename();
     OS << "CREATE (:Allexe {";
-    OS << "Name:\"" << basename(A.Filename) << "\", ";
-    OS << "Path:\"" << removePrefix(A.Filename) << "\"";
+    OS << "Name:\"" << basename(Filename) << "\", ";
+    OS << "Path:\"" << removePrefix(Filename) << "\"";
     OS << "})\n";
   }
 
@@ -79,11 +82,12 @@ Error cypher(ABCDB &DB, StringRef Prefix, StringRef OutputFilename) {
 
   // emit allexe -> module relationships
   idx = 0;
-  for (auto &A : DB.getAllexes()) {
-    OS << "MATCH (a:Allexe {Path:\"" << removePrefix(A.Filename) << "\"})\n";
+  for (auto A : DB.getAllexes()) {
+    OS << "MATCH (a:Allexe {Path:\"" << removePrefix(A.getFilename())
+       << "\"})\n";
     size_t i = 0;
-    for (auto &M : A.Modules) {
-      OS << "\tMATCH (m" << idx << ":Module {CRC:" << M.ModuleCRC << "})\n";
+    for (auto M : A.modules()) {
+      OS << "\tMATCH (m" << idx << ":Module {CRC:" << M.getCRC() << "})\n";
       OS << "\tCREATE UNIQUE (a)-[:CONTAINS {index:" << i++ << "}]->(m" << idx
          << ")\n";
       ++idx;
@@ -99,7 +103,7 @@ Error cypher(ABCDB &DB, StringRef Prefix, StringRef OutputFilename) {
 CommandRegistration Unused(&Cypher, [](ResourcePaths &RP) -> Error {
   errs() << "Scanning " << InputDirectory << "...\n";
 
-  auto ExpDB = ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
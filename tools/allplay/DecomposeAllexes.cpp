@@ -1,5 +1,10 @@
 #include "Decompose.h"
 
+#include "ABCDBLoader.h"
+#include "MemoryScheduler.h"
+#include "ModuleMapReduce.h"
+#include "ThreadSupport.h"
+#include "WorkerProcesses.h"
 #include "boost_progress.h"
 #include "subcommand-registry.h"
 
@@ -20,14 +25,13 @@
 #include <llvm/Support/Error.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/SourceMgr.h>
-#include <llvm/Support/ThreadPool.h>
 #include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/Utils/SplitModule.h>
 
 #include <algorithm>
 #include <mutex>
-#include <pthread.h>
+#include <numeric>
 #include <vector>
 
 using namespace allvm_analysis;
@@ -42,9 +46,6 @@ cl::SubCommand
 cl::opt<std::string> InputDirectory(cl::Positional, cl::Required,
                                     cl::desc("<input directory to scan>"),
                                     cl::sub(DecomposeAllexes));
-cl::opt<unsigned> Threads("j", cl::Optional, cl::init(0),
-                          cl::desc("Number of threads, 0 to auto-detect"),
-                          cl::sub(DecomposeAllexes));
 cl::opt<bool> ExtractModulesFromAllexes("extract-from-allexes", cl::Optional,
                                         cl::init(false),
                                         cl::sub(DecomposeAllexes));
@@ -52,84 +53,137 @@ cl::opt<bool> StripSourceInfo(
     "strip-source-info", cl::Optional, cl::init(false),
     cl::desc("Remove information identifying module/allvm/disk origin"),
     cl::sub(DecomposeAllexes));
+cl::opt<unsigned>
+    MemBudgetMB("mem-budget", cl::Optional, cl::init(0),
+                cl::desc("Memory (in MB) decomposing may use at once, 0 for "
+                         "3/4 of physical memory"),
+                cl::sub(DecomposeAllexes));
 
 std::mutex ProgressMtx;
 
+// Peak memory of decomposing a module, per byte of its bitcode: the IR is
+// several times the size of the bitcode, and split modules are built from
+// it while it's alive.
+const uint64_t MemPerBitcodeByte = 20;
+// Allexes are compressed, and bitcode compresses about 3x.
+const uint64_t MemPerAllexeByte = 3 * MemPerBitcodeByte;
+
+uint64_t estimateMemory(StringRef Filename, uint64_t PerByte) {
+  uint64_t Size;
+  if (sys::fs::file_size(Filename, Size))
+    return 0;
+  return Size * PerByte;
+}
+
+struct DecomposeTask {
+  std::string Filename;
+  std::string OutTar;
+  uint64_t Memory;
+};
+
+Error decompose(const DecomposeTask &T, ResourcePaths &RP) {
+  if (!ExtractModulesFromAllexes)
+    return decompose_into_tar(T.Filename, T.OutTar, false, StripSourceInfo);
+
+  auto A = Allexe::openForReading(T.Filename, RP);
+  if (!A)
+    return A.takeError();
+  auto Members = AllexeMembers::open(**A, T.Filename, getAllexeMemberCache());
+  if (!Members)
+    return Members.takeError();
+  auto Bitcode = (*Members)->getBitcode(0);
+  if (!Bitcode)
+    return Bitcode.takeError();
+  LLVMContext C;
+  auto M = parseBitcodeFile(*Bitcode, C);
+  if (!M)
+    return M.takeError();
+  return decompose_into_tar(std::move(*M), T.OutTar, false, StripSourceInfo);
+}
+
 Error decomposeAllexes(ABCDB &DB, ResourcePaths &RP) {
   StringRef OutBase = "bits";
-  unsigned NThreads = Threads;
-  if (NThreads == 0)
-    NThreads = llvm::heavyweight_hardware_concurrency();
+  unsigned NThreads = getNumJobs();
+
+  if (auto EC = sys::fs::create_directories(OutBase))
+    return errorCodeToError(EC);
+
+  std::vector<DecomposeTask> Tasks;
+  auto addTask = [&](std::string Filename, uint64_t PerByte) {
+    std::string tarf = (OutBase + "/" + utostr(Tasks.size()) + ".tar").str();
+    auto Memory = estimateMemory(Filename, PerByte);
+    Tasks.push_back({std::move(Filename), std::move(tarf), Memory});
+  };
+  if (!ExtractModulesFromAllexes)
+    for (auto MI : DB.getMods())
+      addTask(MI.getFilename(), MemPerBitcodeByte);
+  else
+    for (auto AI : DB.getAllexes())
+      addTask(AI.getFilename(), MemPerAllexeByte);
+
+  boost::progress_display progress(Tasks.size());
+
+  uint64_t Budget = getMemoryBudget(MemBudgetMB);
+
+  if (unsigned NProcs = getNumProcesses()) {
+    errs() << "Decomposing " << Tasks.size() << " modules,";
+    errs() << " using " << NProcs << " processes";
+    errs() << " and up to " << (Budget >> 20) << "MB...\n";
+
+    // Largest first, as MemoryScheduler does; workers are only handed
+    // what fits in the budget next to what the others are working on.
+    std::vector<size_t> Order(Tasks.size());
+    std::iota(Order.begin(), Order.end(), size_t{0});
+    std::stable_sort(Order.begin(), Order.end(), [&](size_t A, size_t B) {
+      return Tasks[A].Memory > Tasks[B].Memory;
+    });
+
+    auto run = [&](size_t I) -> Expected<std::string> {
+      if (auto Err = decompose(Tasks[Order[I]], RP))
+        return std::move(Err);
+      return std::string();
+    };
+    auto done = [&](size_t, StringRef) {
+      ++progress;
+      return Error::success();
+    };
+    auto skip = [&](size_t I, StringRef Why) {
+      errs() << "Warning, " << Why << " decomposing '"
+             << Tasks[Order[I]].Filename << "', attempting to skip.\n";
+      ++progress;
+      return Error::success();
+    };
+    auto cost = [&](size_t I) { return Tasks[Order[I]].Memory; };
+    return forkMapReduce(Tasks.size(), run, done, skip, cost, Budget);
+  }
 
   // exit on error instead of propagating errors
   // out of the thread pool safely
   allvm::ExitOnError ExitOnErr("allplay decompose-allexes: ");
 
-  // Bump default pthread stack size, musl has conservative default
-  // that apparently LLVM isn't happy with when we're splitting things.
-  ::pthread_attr_t attr;
-  if (::pthread_getattr_default_np(&attr) != 0) {
-    ExitOnErr(make_error<StringError>("Error configuring threads",
-                                      errc::invalid_argument));
-  }
-  if (::pthread_attr_setstacksize(&attr, 8192 * 1024) != 0) {
-    ExitOnErr(make_error<StringError>("Error configuring threads",
-                                      errc::invalid_argument));
-  }
-  if (::pthread_setattr_default_np(&attr) != 0) {
-    ExitOnErr(make_error<StringError>("Error configuring threads",
-                                      errc::invalid_argument));
-  }
+  ExitOnErr(setDefaultThreadStackSize());
 
-  if (auto EC = sys::fs::create_directories(OutBase))
-    return errorCodeToError(EC);
+  MemoryScheduler Sched(NThreads, Budget);
 
-  ThreadPool TP(NThreads);
-
-  errs() << "Decomposing " << DB.getMods().size() << " modules,";
-  errs() << " using " << NThreads << " threads...\n";
-
-  boost::progress_display progress(DB.getMods().size());
-
-  size_t I = 0;
-  if (!ExtractModulesFromAllexes) {
-    for (auto &MI : DB.getMods()) {
-      std::string tarf = (OutBase + "/" + utostr(I++) + ".tar").str();
-      TP.async(
-          [&](auto Filename, auto OutTar) {
-            ExitOnErr(
-                decompose_into_tar(Filename, OutTar, false, StripSourceInfo));
-            std::lock_guard<std::mutex> Lock(ProgressMtx);
-            ++progress;
-          },
-          MI.Filename, tarf);
-    }
-  } else {
-    for (auto &AI : DB.getAllexes()) {
-      std::string tarf = (OutBase + "/" + utostr(I++) + ".tar").str();
-      TP.async(
-          [&](auto Filename, auto OutTar) {
-            auto A = ExitOnErr(Allexe::openForReading(Filename, RP));
-            LLVMContext C;
-            auto M = ExitOnErr(A->getModule(0, C));
-            ExitOnErr(M->materializeAll());
-            ExitOnErr(decompose_into_tar(std::move(M), OutTar, false,
-                                         StripSourceInfo));
-            std::lock_guard<std::mutex> Lock(ProgressMtx);
-            ++progress;
-          },
-          AI.Filename, tarf);
-    }
-  }
+  errs() << "Decomposing " << Tasks.size() << " modules,";
+  errs() << " using " << NThreads << " threads";
+  errs() << " and up to " << (Budget >> 20) << "MB...\n";
+
+  for (auto &T : Tasks)
+    Sched.add(T.Memory, [&] {
+      ExitOnErr(decompose(T, RP));
+      std::lock_guard<std::mutex> Lock(ProgressMtx);
+      ++progress;
+    });
 
-  TP.wait();
+  Sched.run();
 
   return Error::success();
 }
 
 CommandRegistration Unused(&DecomposeAllexes, [](ResourcePaths &RP) -> Error {
   errs() << "Loading allexe's from " << InputDirectory << "...\n";
-  auto ExpDB = ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
@@ -1,3 +1,5 @@
+#include "ABCDBLoader.h"
+#include "ModuleMapReduce.h"
 #include "subcommand-registry.h"
 
 // Preserve insert order
@@ -5,14 +7,14 @@
 #include "cpptoml.h"
 
 #include "allvm-analysis/ABCDB.h"
+#include "allvm-analysis/SymbolIndex.h"
 
 #include <llvm/ADT/DenseMap.h>
-#include <llvm/ADT/DenseSet.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/IR/CallSite.h>
-#include <llvm/IRReader/IRReader.h>
+#include <llvm/IR/LLVMContext.h>
 #include <llvm/Support/Errc.h>
 #include <llvm/Support/Format.h>
-#include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/raw_ostream.h>
 
 #include <range/v3/all.hpp>
@@ -34,6 +36,14 @@ cl::opt<std::string> FuncName(cl::Positional, cl::Required,
                               cl::desc("<name of function>"),
                               cl::sub(FindDirectUses));
 
+// Direct uses of the function in a module, as strings.
+struct DirectUses {
+  bool Found = false;
+  // Calls, grouped by containing function
+  std::vector<std::pair<std::string, std::vector<std::string>>> Calls;
+  std::vector<std::string> NonInstructionUses;
+};
+
 std::string toStr(const llvm::Value *V) {
   std::string S;
   raw_string_ostream OS(S);
@@ -41,78 +51,93 @@ std::string toStr(const llvm::Value *V) {
   return S;
 }
 
-using CRC_t = decltype(ModuleInfo::ModuleCRC);
-
-Error findUses(ABCDB &DB, llvm::StringRef Symbol) {
+Error findUses(ABCDB &DB, const SymbolIndex &Index, llvm::StringRef Symbol) {
 
   errs() << "Finding uses of '" << Symbol << "' in ABCDB...\n";
 
   errs() << "Err, looking for users of function with that name\n";
 
-  DenseSet<CRC_t> ModulesWithReference;
-  DenseMap<CRC_t, StringRef> ModNameMap;
+  std::vector<ModuleID> ModulesWithReference;
 
-  auto root = cpptoml::make_table();
-  for (auto &MI : DB.getMods()) {
-    SMDiagnostic SM;
+  // Only modules referring to the symbol need to be loaded.
+  std::vector<ModuleRef> Candidates;
+  for (auto &E : Index.lookup(Symbol))
+    if (E.Flags & SymbolIndex::Function)
+      Candidates.push_back(DB.getModule(E.Module));
+
+  auto findInModule = [&](ModuleRef,
+                          MemoryBufferRef Contents) -> Expected<DirectUses> {
+    // Calls are printed, so not in a reused context (see ContextPool.h),
+    // where their types could be renamed depending on what else the
+    // thread loaded before.
     LLVMContext C;
-    auto M = llvm::parseIRFile(MI.Filename, SM, C);
+    auto M = loadModule(Contents, C);
     if (!M)
-      return make_error<StringError>(
-          "Unable to open module file " + MI.Filename, errc::invalid_argument);
-
-    if (auto Err = M->materializeAll())
-      return Err;
-
-    ModNameMap[MI.ModuleCRC] = MI.Filename;
-
-    if (auto *F = M->getFunction(Symbol)) {
-      assert(F->isDeclaration());
-      assert(F->hasNUsesOrMore(1));
-
-      assert(!F->hasAddressTaken());
-
-      auto call_table = cpptoml::make_table();
-      for (auto U : F->users()) {
-        auto *I = dyn_cast<Instruction>(U);
-        if (!I) {
-          errs() << "\tNon-Instruction use found! Use: " << *U << "\n";
-        } else {
-          CallSite CS(I);
-          assert(CS && "Non-callsite instruction?");
-
-          auto *ContainingF = I->getFunction();
-          auto CFName = ContainingF->getName();
-          if (!call_table->contains(CFName))
-            call_table->insert(CFName, cpptoml::make_array());
-          call_table->get_array(CFName)->push_back(toStr(I));
-        }
+      return M.takeError();
+
+    DirectUses Uses;
+    auto *F = (*M)->getFunction(Symbol);
+    if (!F)
+      return std::move(Uses);
+    assert(F->isDeclaration());
+    assert(F->hasNUsesOrMore(1));
+
+    assert(!F->hasAddressTaken());
+
+    Uses.Found = true;
+    StringMap<size_t> CallerIdx;
+    for (auto U : F->users()) {
+      auto *I = dyn_cast<Instruction>(U);
+      if (!I) {
+        Uses.NonInstructionUses.push_back(toStr(U));
+      } else {
+        CallSite CS(I);
+        assert(CS && "Non-callsite instruction?");
+
+        auto CFName = I->getFunction()->getName();
+        auto Ins = CallerIdx.insert({CFName, Uses.Calls.size()});
+        if (Ins.second)
+          Uses.Calls.push_back({CFName.str(), {}});
+        Uses.Calls[Ins.first->second].second.push_back(toStr(I));
       }
+    }
+    return std::move(Uses);
+  };
 
-      ModulesWithReference.insert(MI.ModuleCRC);
-      root->insert(MI.Filename, call_table);
+  auto root = cpptoml::make_table();
+  auto addUses = [&](ModuleRef MI, DirectUses &&Uses) -> Error {
+    if (!Uses.Found)
+      return Error::success();
+
+    for (auto &U : Uses.NonInstructionUses)
+      errs() << "\tNon-Instruction use found! Use: " << U << "\n";
+
+    auto call_table = cpptoml::make_table();
+    for (auto &Caller : Uses.Calls) {
+      auto calls = cpptoml::make_array();
+      for (auto &Call : Caller.second)
+        calls->push_back(Call);
+      call_table->insert(Caller.first, calls);
     }
-  }
 
-  DenseMap<decltype(ModuleInfo::ModuleCRC), uint64_t> ModuleUseMap;
+    ModulesWithReference.push_back(MI.getID());
+    root->insert(MI.getFilename(), call_table);
+    return Error::success();
+  };
+  if (auto Err = mapReduceModuleContents(Candidates, findInModule, addUses))
+    return Err;
+
+  DenseMap<ModuleID, uint64_t> ModuleUseMap;
+  for (auto ID : ModulesWithReference)
+    if (auto N = DB.getModule(ID).getNumAllexes())
+      ModuleUseMap[ID] = N;
 
   errs() << "\n-------------------\n";
   errs() << "Allexes containing matched module:\n";
-  size_t MatchingAllexes = 0;
-  for (auto &A : DB.getAllexes()) {
-    bool containsRef = false;
-    for (auto &M : A.Modules) {
-      if (ModulesWithReference.count(M.ModuleCRC)) {
-        ModuleUseMap[M.ModuleCRC]++;
-        containsRef = true;
-      }
-    }
-
-    if (containsRef) {
-      ++MatchingAllexes;
-      errs() << A.Filename << "\n";
-    }
-  }
+  auto Matching = DB.getAllexesContainingAny(ModulesWithReference);
+  for (auto ID : Matching)
+    errs() << DB.getAllexe(ID).getFilename() << "\n";
+  size_t MatchingAllexes = Matching.size();
 
   // Print modules and dlopen uses...
   errs() << "\n-------------------\n";
@@ -125,11 +150,11 @@ Error findUses(ABCDB &DB, llvm::StringRef Symbol) {
   errs() << "\n-------------------\n";
   errs() << "Modules w/uses, sorted by # containing allexes:\n";
   auto keys_sorted = ModuleUseMap | ranges::to_vector |
-                     ranges::action::sort(std::greater<CRC_t>(),
+                     ranges::action::sort(std::greater<uint64_t>(),
                                           [](auto &KV) { return KV.second; });
 
   for (auto &KV : keys_sorted) {
-    auto ModName = ModNameMap[KV.first];
+    auto ModName = DB.getModule(KV.first).getFilename();
     errs() << KV.second << " " << ModName << "\n";
   }
 
@@ -155,13 +180,17 @@ Error findUses(ABCDB &DB, llvm::StringRef Symbol) {
 
 CommandRegistration Unused(&FindDirectUses, [](ResourcePaths &RP) -> Error {
   errs() << "Loading allexe's from " << InputDirectory << "...\n";
-  auto ExpDB = ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
   errs() << "Done! Allexes found: " << DB->allexe_size() << "\n";
 
-  return findUses(*DB, FuncName);
+  auto ExpIndex = loadSymbolIndex(*DB);
+  if (!ExpIndex)
+    return ExpIndex.takeError();
+
+  return findUses(*DB, **ExpIndex, FuncName);
 });
 
 } // end anonymous namespace
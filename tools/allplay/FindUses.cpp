@@ -1,12 +1,11 @@
+#include "ABCDBLoader.h"
 #include "subcommand-registry.h"
 
 #include "allvm-analysis/ABCDB.h"
+#include "allvm-analysis/SymbolIndex.h"
 
-#include <llvm/ADT/DenseSet.h>
-#include <llvm/IRReader/IRReader.h>
 #include <llvm/Support/Errc.h>
 #include <llvm/Support/Format.h>
-#include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/raw_ostream.h>
 
 using namespace allvm_analysis;
@@ -24,49 +23,31 @@ cl::opt<std::string> FuncName(cl::Positional, cl::Required,
                               cl::desc("<name of function>"),
                               cl::sub(FindUses));
 
-Error findUses(ABCDB &DB, llvm::StringRef Symbol) {
+Error findUses(ABCDB &DB, const SymbolIndex &Index, llvm::StringRef Symbol) {
 
   errs() << "Finding uses of '" << Symbol << "' in ABCDB...\n";
 
   errs() << "Err, looking for users of function with that name\n";
 
-  DenseSet<decltype(ModuleInfo::ModuleCRC)> ModulesWithReference;
+  std::vector<ModuleID> ModulesWithReference;
 
-  for (auto MI : DB.getMods()) {
-    SMDiagnostic SM;
-    LLVMContext C;
-    auto M = llvm::parseIRFile(MI.Filename, SM, C);
-    if (!M)
-      return make_error<StringError>(
-          "Unable to open module file " + MI.Filename, errc::invalid_argument);
+  for (auto &E : Index.lookup(Symbol)) {
+    if (!(E.Flags & SymbolIndex::Function))
+      continue;
+    assert(!(E.Flags & SymbolIndex::Defined));
+    assert(E.NumUses >= 1);
 
-    if (auto Err = M->materializeAll())
-      return Err;
+    errs() << DB.getModule(E.Module).getFilename() << "\n";
 
-    if (auto *F = M->getFunction(Symbol)) {
-      assert(F->isDeclaration());
-      assert(F->hasNUsesOrMore(1));
-
-      errs() << MI.Filename << "\n";
-
-      ModulesWithReference.insert(MI.ModuleCRC);
-    }
+    ModulesWithReference.push_back(E.Module);
   }
 
   errs() << "\n-------------------\n";
   errs() << "Allexes containing matched module:\n";
-  size_t MatchingAllexes = 0;
-  for (auto &A : DB.getAllexes()) {
-    auto containsRef = std::any_of(
-        A.Modules.begin(), A.Modules.end(), [&ModulesWithReference](auto &M) {
-          return ModulesWithReference.count(M.ModuleCRC);
-        });
-
-    if (containsRef) {
-      ++MatchingAllexes;
-      errs() << A.Filename << "\n";
-    }
-  }
+  auto Matching = DB.getAllexesContainingAny(ModulesWithReference);
+  for (auto ID : Matching)
+    errs() << DB.getAllexe(ID).getFilename() << "\n";
+  size_t MatchingAllexes = Matching.size();
 
   // little helper
   auto printPercent = [](auto A, auto B) {
@@ -89,13 +70,17 @@ Error findUses(ABCDB &DB, llvm::StringRef Symbol) {
 
 CommandRegistration Unused(&FindUses, [](ResourcePaths &RP) -> Error {
   errs() << "Loading allexe's from " << InputDirectory << "...\n";
-  auto ExpDB = ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
   errs() << "Done! Allexes found: " << DB->allexe_size() << "\n";
 
-  return findUses(*DB, FuncName);
+  auto ExpIndex = loadSymbolIndex(*DB);
+  if (!ExpIndex)
+    return ExpIndex.takeError();
+
+  return findUses(*DB, **ExpIndex, FuncName);
 });
 
 } // end anonymous namespace
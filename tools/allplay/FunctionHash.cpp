@@ -1,31 +1,35 @@
+#include "ABCDBLoader.h"
+#include "ModuleAnalysis.h"
+#include "ModuleMapReduce.h"
 #include "subcommand-registry.h"
 
 #include "StringGraph.h"
-#include "boost_progress.h"
 
 #include "allvm-analysis/ABCDB.h"
+#include "allvm-analysis/ContentHash.h"
 #include "allvm-analysis/ModuleFlags.h"
 
+#include <llvm/ADT/ArrayRef.h>
 #include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
 #include <llvm/Bitcode/BitcodeWriter.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
-#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/Allocator.h>
 #include <llvm/Support/Errc.h>
 #include <llvm/Support/FileSystem.h>
 #include <llvm/Support/Format.h>
 #include <llvm/Support/FormatVariadic.h>
-#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/ThreadPool.h>
 #include <llvm/Support/ToolOutputFile.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/Utils/FunctionComparator.h>
 
-#include <range/v3/all.hpp>
-
 #include <algorithm>
-#include <functional>
+#include <atomic>
 #include <numeric>
+#include <tuple>
 
 using namespace allvm_analysis;
 using namespace allvm;
@@ -41,23 +45,25 @@ cl::SubCommand FunctionHashes("functionhashes",
 cl::opt<std::string> InputDirectory(cl::Positional, cl::Required,
                                     cl::desc("<input directory to scan>"),
                                     cl::sub(FunctionHashes));
+// Options below are also accepted by 'allplay run'.
 cl::opt<std::string>
     WriteGraph("write-graph", cl::Optional,
                cl::desc("name of file to write graph, does nothing if empty"),
-               cl::init(""), cl::sub(FunctionHashes));
+               cl::init(""), cl::sub(FunctionHashes),
+               cl::sub(getRunSubCommand()));
 cl::opt<bool>
     PrintFunctions("print-functions", cl::Optional, cl::init(false),
                    cl::desc("Print functions grouped by hash (default=false)"),
-                   cl::sub(FunctionHashes));
+                   cl::sub(FunctionHashes), cl::sub(getRunSubCommand()));
 
 cl::opt<unsigned> GraphThreshold(
     "graph-threshold", cl::Optional, cl::init(2000),
     cl::desc("Threshold for including in graph, by insts-per-fn"),
-    cl::sub(FunctionHashes));
+    cl::sub(FunctionHashes), cl::sub(getRunSubCommand()));
 cl::opt<unsigned>
     MinFontSize("min-font-size", cl::Optional, cl::init(12),
                 cl::desc("Minimum (starting) font size for nodes"),
-                cl::sub(FunctionHashes));
+                cl::sub(FunctionHashes), cl::sub(getRunSubCommand()));
 cl::opt<GraphKind> EmitGraphKind(
     "graph-kind", cl::desc("Choose graph kind"), cl::init(GraphKind::HashGraph),
     cl::values(
@@ -67,95 +73,297 @@ cl::opt<GraphKind> EmitGraphKind(
                    "hashgraph but merge nodes with same neighbors"),
         clEnumValN(GraphKind::Pairwise, "pairwise",
                    "no hash nodes, edges are number of shared instructions")),
-    cl::sub(FunctionHashes));
+    cl::sub(FunctionHashes), cl::sub(getRunSubCommand()));
 cl::opt<SizeKind> Sizing(
     "sizing", cl::desc("Choose node sizing kind"),
     cl::init(SizeKind::LogSquared),
     cl::values(clEnumValN(SizeKind::Linear, "linear", "N"),
                clEnumValN(SizeKind::LogSquared, "log-squared", "(2*log(N))^2"),
                clEnumValN(SizeKind::LogLog, "log-log", "log(log(N))")),
-    cl::sub(FunctionHashes));
+    cl::sub(FunctionHashes), cl::sub(getRunSubCommand()));
 cl::opt<bool> ShowUnshared(
     "show-unshared", cl::Optional, cl::init(false),
     cl::desc(
         "Show hashnodes only used in single Source (hashgraph-merged only)"),
-    cl::sub(FunctionHashes));
+    cl::sub(FunctionHashes), cl::sub(getRunSubCommand()));
+
+cl::opt<unsigned> PairwiseMaxModules(
+    "pairwise-max-modules", cl::Optional, cl::init(0),
+    cl::desc("Skip hashes found in more modules than this, for pairwise "
+             "graphs (0 for no limit)"),
+    cl::sub(FunctionHashes), cl::sub(getRunSubCommand()));
+cl::opt<unsigned> PairwiseMinInsts(
+    "pairwise-min-insts", cl::Optional, cl::init(0),
+    cl::desc("Skip hashes with fewer insts-per-fn than this, for pairwise "
+             "graphs"),
+    cl::sub(FunctionHashes), cl::sub(getRunSubCommand()));
 
 cl::opt<std::string> WriteCSV("write-csv", cl::Optional, cl::init(""),
-                              cl::sub(FunctionHashes));
+                              cl::sub(FunctionHashes),
+                              cl::sub(getRunSubCommand()));
 cl::opt<bool> UseBCScanner("bc-scanner", cl::Optional, cl::init(false),
                            cl::desc("Use BC scanner instead of allexe scanner"),
                            cl::sub(FunctionHashes));
 
 using FunctionHash = FunctionComparator::FunctionHash;
 
+// Function names, each stored once.
+class NamePool {
+public:
+  using NameID = uint32_t;
+
+  NameID add(StringRef Name) {
+    auto R = Map.insert({Name, static_cast<NameID>(Names.size())});
+    if (R.second)
+      Names.push_back(R.first->getKey());
+    return R.first->second;
+  }
+  StringRef get(NameID ID) const { return Names[ID]; }
+
+private:
+  // Keys are stable, allocated in slabs rather than one by one.
+  StringMap<NameID, BumpPtrAllocator> Map;
+  std::vector<StringRef> Names;
+};
+
+// There are tens of millions of these, so they are kept small (24 bytes)
+// and refer to strings instead of holding them.
 struct FuncDesc {
-  const ModuleInfo *Mod;
-  std::string FuncName;
-  size_t Insts;
-  std::string Source;
+  ModuleID Mod;
+  NamePool::NameID Name;
+  uint64_t Insts;
   FunctionHash H;
 };
 
-template <typename T> auto countInsts(const T *V) {
-  return std::accumulate(
-      V->begin(), V->end(), size_t{0},
-      [](auto N, auto &child) { return N + countInsts(&child); });
-}
-template <> auto countInsts(const BasicBlock *B) { return B->size(); }
-// auto countInsts(const FuncDesc &FD) { return FD.Insts; }
+// What FuncDesc's refer to.
+struct FuncStrings {
+  NamePool Names;
+  // Module file names, by module ID
+  std::vector<std::string> Sources;
+  // Module IDs ordered by file name, and each module's position in that
+  // order, for ordering modules the same as by their file names.
+  std::vector<ModuleID> ModsBySource;
+  std::vector<uint32_t> SourceOrder;
+
+  StringRef getName(const FuncDesc &F) const { return Names.get(F.Name); }
+  StringRef getSource(ModuleID Mod) const { return Sources[Mod]; }
+  StringRef getSourceAt(uint32_t Order) const {
+    return Sources[ModsBySource[Order]];
+  }
 
-// Meant for containers, so named differently.
-template <typename T> auto countAllInsts(const T &Vs) {
-  return std::accumulate(Vs.begin(), Vs.end(), size_t{0},
-                         [](auto N, auto &V) { return N + countInsts(V); });
-}
+  void sortSources() {
+    ModsBySource.resize(Sources.size());
+    std::iota(ModsBySource.begin(), ModsBySource.end(), ModuleID{0});
+    std::sort(ModsBySource.begin(), ModsBySource.end(),
+              [&](ModuleID A, ModuleID B) { return Sources[A] < Sources[B]; });
+    SourceOrder.resize(Sources.size());
+    for (uint32_t I = 0, E = ModsBySource.size(); I != E; ++I)
+      SourceOrder[ModsBySource[I]] = I;
+  }
+};
+
+// Functions with the same hash, Functions[Begin, End) once grouped.
+struct HashGroup {
+  FunctionHash H;
+  uint32_t Begin, End;
+  uint64_t Insts;
+  uint32_t NumModules;
 
-auto instCount = [](auto Fns) {
-  return ranges::accumulate(Fns | ranges::view::transform(&FuncDesc::Insts),
-                            size_t{0});
+  uint32_t size() const { return End - Begin; }
+  uint64_t instsPerFunction() const { return Insts / size(); }
 };
 
-auto group_ptr_by_hash() {
-  return ranges::view::group_by([](auto *A, auto *B) { return A->H == B->H; });
-}
+// Functions are first partitioned by the top bits of their hash, in
+// parallel and keeping their order, so partitions are in hash order and
+// can each be sorted and grouped on their own.
+const unsigned PartitionBits = 8;
+const size_t NumPartitions = size_t{1} << PartitionBits;
 
-auto group_by_hash() {
-  return ranges::view::group_by([](auto &A, auto &B) { return A.H == B.H; });
+size_t getPartition(FunctionHash H) {
+  return H >> (sizeof(FunctionHash) * 8 - PartitionBits);
 }
 
-auto group_by_module() {
-  return ranges::view::group_by(
-      [](auto &A, auto &B) { return A.Source == B.Source; });
-}
+// Sort Functions by hash (then module, otherwise keeping their order)
+// and return the groups of them with the same hash, in hash order.
+std::vector<HashGroup> groupByHash(std::vector<FuncDesc> &Functions) {
+  unsigned Threads = getNumJobs();
+  ThreadPool TP(Threads);
+
+  // Count each chunk's functions in each partition, in parallel.
+  size_t ChunkSize = (Functions.size() + Threads - 1) / Threads;
+  size_t NumChunks = ChunkSize ? (Functions.size() + ChunkSize - 1) / ChunkSize
+                               : 0;
+  auto getChunk = [&](size_t C) {
+    return ArrayRef<FuncDesc>(Functions)
+        .slice(C * ChunkSize,
+               std::min(ChunkSize, Functions.size() - C * ChunkSize));
+  };
+  std::vector<std::vector<size_t>> Offsets(
+      NumChunks, std::vector<size_t>(NumPartitions));
+  for (size_t C = 0; C != NumChunks; ++C)
+    TP.async([&, C]() {
+      for (auto &F : getChunk(C))
+        ++Offsets[C][getPartition(F.H)];
+    });
+  TP.wait();
+
+  // Where each chunk's functions in each partition go.
+  std::vector<size_t> PartitionStart(NumPartitions + 1);
+  size_t Next = 0;
+  for (size_t P = 0; P != NumPartitions; ++P) {
+    PartitionStart[P] = Next;
+    for (size_t C = 0; C != NumChunks; ++C) {
+      auto Count = Offsets[C][P];
+      Offsets[C][P] = Next;
+      Next += Count;
+    }
+  }
+  PartitionStart[NumPartitions] = Next;
+
+  std::vector<FuncDesc> Partitioned(Functions.size());
+  for (size_t C = 0; C != NumChunks; ++C)
+    TP.async([&, C]() {
+      auto &Offset = Offsets[C];
+      for (auto &F : getChunk(C))
+        Partitioned[Offset[getPartition(F.H)]++] = F;
+    });
+  TP.wait();
+  Functions = std::move(Partitioned);
+
+  // Sort and group each partition.
+  std::vector<std::vector<HashGroup>> PartitionGroups(NumPartitions);
+  for (size_t P = 0; P != NumPartitions; ++P)
+    TP.async([&, P]() {
+      auto Begin = Functions.begin() + PartitionStart[P];
+      auto End = Functions.begin() + PartitionStart[P + 1];
+      std::stable_sort(Begin, End, [](const FuncDesc &A, const FuncDesc &B) {
+        return std::tie(A.H, A.Mod) < std::tie(B.H, B.Mod);
+      });
+
+      auto &Groups = PartitionGroups[P];
+      for (auto I = Begin; I != End; ++I) {
+        if (I == Begin || I->H != std::prev(I)->H) {
+          uint32_t Index = I - Functions.begin();
+          Groups.push_back(HashGroup{I->H, Index, Index, 0, 0});
+        } else if (I->Mod == std::prev(I)->Mod) {
+          ++Groups.back().End;
+          Groups.back().Insts += I->Insts;
+          continue;
+        }
+        ++Groups.back().End;
+        Groups.back().Insts += I->Insts;
+        ++Groups.back().NumModules;
+      }
+    });
+  TP.wait();
 
-auto group_by_second() {
-  return ranges::view::group_by(
-      [](auto &A, auto &B) { return A.second == B.second; });
+  std::vector<HashGroup> Groups;
+  for (auto &PG : PartitionGroups)
+    Groups.insert(Groups.end(), PG.begin(), PG.end());
+  return Groups;
 }
 
-auto to_ptr() {
-  return ranges::view::transform([](auto &F) { return &F; });
-}
+// Instructions shared by modules A < B (by position in file name order).
+struct ModulePair {
+  uint32_t A, B;
+  uint64_t Insts;
+};
 
-auto filter_small_ranges(ssize_t n) {
-  return ranges::view::remove_if(
-      [=](auto A) { return ranges::distance(A) <= n; });
-}
+// For each pair of modules, the sum over the given groups of the number
+// of functions in one times the number in the other times insts-per-fn.
+// That is the product of the module x hash matrix of function counts,
+// weighted by instructions, with its transpose. It is computed a row
+// (module) at a time, in parallel, visiting only the non-zero entries.
+// Returns pairs with any sharing, ordered by A then B.
+std::vector<ModulePair>
+computePairwiseSharing(ArrayRef<FuncDesc> Functions,
+                       ArrayRef<const HashGroup *> Groups,
+                       const FuncStrings &Strings) {
+  struct Entry {
+    uint32_t Index; // Module position for columns, group for rows
+    uint32_t Count;
+  };
+
+  // Columns: the modules of each group, with their number of functions.
+  // Members are sorted by module ID, so each module is one run of them.
+  std::vector<size_t> ColumnStart{0};
+  std::vector<Entry> Columns;
+  std::vector<size_t> RowSize(Strings.Sources.size());
+  for (auto *G : Groups) {
+    auto Fns = Functions.slice(G->Begin, G->size());
+    auto Begin = Columns.size();
+    for (size_t I = 0, E = Fns.size(); I != E; ++I) {
+      if (I != 0 && Fns[I].Mod == Fns[I - 1].Mod) {
+        ++Columns.back().Count;
+        continue;
+      }
+      auto Pos = Strings.SourceOrder[Fns[I].Mod];
+      Columns.push_back({Pos, 1});
+      ++RowSize[Pos];
+    }
+    std::sort(Columns.begin() + Begin, Columns.end(),
+              [](const Entry &X, const Entry &Y) { return X.Index < Y.Index; });
+    ColumnStart.push_back(Columns.size());
+  }
 
-auto filter_by_inst_count(ssize_t n) {
-  return ranges::view::remove_if([=](auto A) {
-    return (ssize_t(instCount(A)) / ranges::distance(A)) < n;
-  });
-}
+  // Rows: the groups of each module.
+  std::vector<size_t> RowStart(RowSize.size() + 1);
+  for (size_t R = 0, E = RowSize.size(); R != E; ++R)
+    RowStart[R + 1] = RowStart[R] + RowSize[R];
+  std::vector<Entry> Rows(Columns.size());
+  {
+    auto Next = RowStart;
+    for (uint32_t G = 0, E = Groups.size(); G != E; ++G)
+      for (size_t I = ColumnStart[G]; I != ColumnStart[G + 1]; ++I)
+        Rows[Next[Columns[I].Index]++] = {G, Columns[I].Count};
+  }
 
-auto sort_by_range_size() {
-  return ranges::action::sort(std::greater<ssize_t>(),
-                              [](auto &A) { return ranges::distance(A); });
-}
+  std::vector<std::vector<ModulePair>> RowPairs(RowSize.size());
+  std::atomic<size_t> NextRow{0};
+  auto computeRows = [&]() {
+    // Sharing with each module (dense), and which are non-zero.
+    std::vector<uint64_t> Acc(RowSize.size());
+    std::vector<uint32_t> Touched;
+    for (size_t A; (A = NextRow++) < RowSize.size();) {
+      for (size_t I = RowStart[A]; I != RowStart[A + 1]; ++I) {
+        auto G = Rows[I].Index;
+        uint64_t Weight = Rows[I].Count * Groups[G]->instsPerFunction();
+        if (!Weight)
+          continue;
+        auto Begin = Columns.begin() + ColumnStart[G];
+        auto End = Columns.begin() + ColumnStart[G + 1];
+        // Only modules after this one
+        auto It = std::upper_bound(
+            Begin, End, A,
+            [](size_t Pos, const Entry &X) { return Pos < X.Index; });
+        for (; It != End; ++It) {
+          if (!Acc[It->Index])
+            Touched.push_back(It->Index);
+          Acc[It->Index] += Weight * It->Count;
+        }
+      }
+
+      std::sort(Touched.begin(), Touched.end());
+      auto &Pairs = RowPairs[A];
+      for (auto B : Touched) {
+        Pairs.push_back({static_cast<uint32_t>(A), B, Acc[B]});
+        Acc[B] = 0;
+      }
+      Touched.clear();
+    }
+  };
+  {
+    unsigned Threads = getNumJobs();
+    ThreadPool TP(Threads);
+    for (unsigned T = 0; T != Threads; ++T)
+      TP.async(computeRows);
+    TP.wait();
+  }
 
-auto to_vec_sort_uniq() {
-  return ranges::to_vector | ranges::action::sort | ranges::action::unique;
+  std::vector<ModulePair> Pairs;
+  for (auto &RP : RowPairs)
+    Pairs.insert(Pairs.end(), RP.begin(), RP.end());
+  return Pairs;
 }
 
 auto size_addend(size_t count) {
@@ -176,69 +384,37 @@ auto compute_size(size_t count) {
   return Twine(MinFontSize + size_addend(count)).str();
 }
 
-Error functionHash(ABCDB &DB) {
-
-  errs() << "Materializing and computing function hashes...\n";
-  size_t totalInsts = 0;
-  std::vector<FuncDesc> Functions;
-
-  boost::progress_display progress(DB.getMods().size());
-  for (auto &MI : DB.getMods()) {
-    SMDiagnostic SM;
-    LLVMContext C;
-    auto M = llvm::parseIRFile(MI.Filename, SM, C);
-    if (!M)
-      return make_error<StringError>(
-          "Unable to open module file " + MI.Filename, errc::invalid_argument);
-    if (auto Err = M->materializeAll())
-      return Err;
-    for (auto &F : *M) {
-      if (F.isDeclaration())
-        continue;
-      auto H = FunctionComparator::functionHash(F);
-
-      // errs() << "Hash for '" << F.getName() << "': " << H << "\n";
-      Functions.push_back(
-          FuncDesc{&MI, F.getName(), countInsts(&F), MI.Filename, H});
-    }
-
-    totalInsts += countInsts(M.get());
-    ++progress;
-  }
-
+Error reportFunctionHashes(std::vector<FuncDesc> &Functions,
+                           const FuncStrings &Strings, size_t totalInsts) {
   errs() << "Hashes computed, grouping...\n";
 
-  // Sort by hash
-  Functions |= ranges::action::sort(std::less<FunctionHash>{}, &FuncDesc::H);
+  auto Groups = groupByHash(Functions);
+  auto members = [&](const HashGroup &G) {
+    return ArrayRef<FuncDesc>(Functions).slice(G.Begin, G.size());
+  };
 
   if (PrintFunctions) {
-    auto Groups =
-        Functions
-        // Indirection so copies are cheaper (only useful because we concretize
-        // to vector for sorting)
-        | to_ptr()
-        // Group by hash
-        | group_ptr_by_hash()
-        // Remove singleton groups
-        | filter_small_ranges(1)
-        // Sort by group size, largest first.
-        | ranges::to_vector | sort_by_range_size();
+    // Groups of more than one function, largest first.
+    std::vector<const HashGroup *> Shared;
+    for (auto &G : Groups)
+      if (G.size() > 1)
+        Shared.push_back(&G);
+    std::stable_sort(Shared.begin(), Shared.end(),
+                     [](const HashGroup *A, const HashGroup *B) {
+                       return A->size() > B->size();
+                     });
 
     size_t redundantInstsMaybe = 0;
-    RANGES_FOR(auto G, Groups) {
+    for (auto *G : Shared) {
       errs() << "-----------\n";
-      auto numFns = ranges::distance(G);
-      errs() << "Function Group, count: " << numFns << "\n";
-
-      auto numInsts = instCount(G);
-      errs() << "Insts: " << numInsts << "\n";
-      assert(numFns > 0);
-      errs() << "InstsPerFn: " << numInsts / size_t(numFns) << "\n";
-      auto numInstsSkipFirst = instCount(G | ranges::view::tail);
-      redundantInstsMaybe += numInstsSkipFirst;
-      RANGES_FOR(auto F, G) {
-        errs() << F->Source << ": " << F->FuncName << "\n";
-      }
+      errs() << "Function Group, count: " << G->size() << "\n";
+      errs() << "Insts: " << G->Insts << "\n";
+      errs() << "InstsPerFn: " << G->instsPerFunction() << "\n";
+      // All but the first
+      redundantInstsMaybe += G->Insts - members(*G).front().Insts;
+      for (auto &F : members(*G))
+        errs() << Strings.getSource(F.Mod) << ": " << Strings.getName(F)
+               << "\n";
     }
 
     errs() << "Total instructions in filtered DB: " << totalInsts << "\n";
@@ -255,170 +431,146 @@ Error functionHash(ABCDB &DB) {
     StringGraph Graph;
 
     auto getModLabel = [](StringRef S) { return S.rsplit('/').second; };
-    switch (EmitGraphKind) {
-    case GraphKind::HashGraph: {
-      auto SharedFunctions = Functions | group_by_hash() |
-                             filter_small_ranges(1) |
-                             filter_by_inst_count(GraphThreshold) |
-                             ranges::view::join | ranges::to_vector;
-
-      auto ModHashPairs =
-          SharedFunctions | ranges::view::transform([](const auto &FD) {
-            return std::pair<StringRef, FunctionHash>{FD.Source, FD.H};
-          }) |
-          to_vec_sort_uniq();
-
-      auto ModGroups =
-          SharedFunctions | ranges::to_vector |
-          ranges::action::sort(std::less<StringRef>(), &FuncDesc::Source);
-      auto HashGroups =
-          SharedFunctions | ranges::to_vector |
-          ranges::action::sort(std::less<FunctionHash>(), &FuncDesc::H);
-
-      RANGES_FOR(auto M, ModGroups | group_by_module()) {
-        auto Count = static_cast<size_t>(ranges::distance(M));
-        auto Source = M.begin()->Source;
+    // Vertex for each module with a non-zero size, in file name order.
+    auto addModuleVertices = [&](ArrayRef<uint64_t> SizeByMod) {
+      for (auto Mod : Strings.ModsBySource) {
+        if (!SizeByMod[Mod])
+          continue;
+        auto Source = Strings.getSource(Mod);
         Graph.addVertex(Source,
                         {{"label", getModLabel(Source)},
                          {"style", "filled"},
-                         {"fontsize", compute_size(Count)},
+                         {"fontsize", compute_size(SizeByMod[Mod])},
                          {"fillcolor", "cyan"}});
       }
+    };
+
+    // Groups of more than one function, with enough insts-per-fn.
+    std::vector<const HashGroup *> SharedGroups;
+    for (auto &G : Groups)
+      if (G.size() > 1 && G.instsPerFunction() >= GraphThreshold)
+        SharedGroups.push_back(&G);
+
+    switch (EmitGraphKind) {
+    case GraphKind::HashGraph: {
+      std::vector<uint64_t> ModFunctions(Strings.Sources.size());
+      // (module, by position in file name order), hash
+      std::vector<std::pair<uint32_t, FunctionHash>> ModHashPairs;
+      for (auto *G : SharedGroups) {
+        auto Fns = members(*G);
+        for (size_t I = 0, E = Fns.size(); I != E; ++I) {
+          ++ModFunctions[Fns[I].Mod];
+          if (I == 0 || Fns[I].Mod != Fns[I - 1].Mod)
+            ModHashPairs.push_back({Strings.SourceOrder[Fns[I].Mod], G->H});
+        }
+      }
+      std::sort(ModHashPairs.begin(), ModHashPairs.end());
+
+      addModuleVertices(ModFunctions);
 
-      RANGES_FOR(auto H, HashGroups | group_by_hash()) {
-        auto Count = static_cast<size_t>(ranges::distance(H));
-        auto CountStr = Twine(Count).str();
-        auto HStr = Twine(H.begin()->H).str();
+      for (auto *G : SharedGroups) {
+        auto CountStr = Twine(G->size()).str();
+        auto HStr = Twine(G->H).str();
         Graph.addVertex(HStr,
                         {{"label", CountStr},
-                         {"fontsize", compute_size(Count)},
+                         {"fontsize", compute_size(G->size())},
                          {"shape", "circle"}});
       }
 
-      RANGES_FOR(auto &MH, ModHashPairs) {
-        Graph.addEdge(MH.first, Twine(MH.second).str());
-      }
+      for (auto &MH : ModHashPairs)
+        Graph.addEdge(Strings.getSourceAt(MH.first), Twine(MH.second).str());
       break;
     }
     case GraphKind::HashGraphMerged: {
-      auto SharedFunctions = Functions | group_by_hash() |
-                             filter_small_ranges(1) |
-                             filter_by_inst_count(GraphThreshold) |
-                             ranges::view::join | ranges::to_vector;
-
-      auto Groups =
-          SharedFunctions | group_by_hash() |
-          ranges::view::transform([](const auto HG) {
-            // {hash, insts}, sources
-            auto Info = std::make_pair(
-                HG.begin()->H,
-                instCount(HG) / static_cast<size_t>(ranges::distance(HG)));
-            auto Sources = HG | ranges::view::transform(
-                                    [](const auto &FD) { return FD.Source; }) |
-                           to_vec_sort_uniq();
-            return std::make_pair(Info, Sources);
-          }) |
-          ranges::to_vector;
-
-      if (!ShowUnshared)
-        Groups |= ranges::action::remove_if(
-            [](const auto &A) { return A.second.size() <= 1; });
-
-      auto ModGroups =
-          SharedFunctions | ranges::to_vector |
-          ranges::action::sort(std::less<StringRef>(), &FuncDesc::Source);
-      RANGES_FOR(auto M, ModGroups | group_by_module()) {
-        auto Insts = instCount(M);
-        auto Source = M.begin()->Source;
-        Graph.addVertex(Source,
-                        {{"label", getModLabel(Source)},
-                         {"style", "filled"},
-                         {"fontsize", compute_size(Insts)},
-                         {"fillcolor", "cyan"}});
+      // Hashes with the same neighbors: modules, by position in file name
+      // order, sorted.
+      struct NeighborSet {
+        std::vector<uint32_t> Sources;
+        uint64_t Insts;
+        size_t Hashes;
+      };
+      std::vector<NeighborSet> Sets;
+      // Indices of Sets, by signature (hash) of their sources
+      DenseMap<std::pair<uint64_t, uint64_t>, SmallVector<uint32_t, 1>>
+          BySignature;
+
+      std::vector<uint64_t> ModInsts(Strings.Sources.size());
+      std::vector<uint32_t> Sources;
+      for (auto *G : SharedGroups) {
+        Sources.clear();
+        auto Fns = members(*G);
+        for (size_t I = 0, E = Fns.size(); I != E; ++I) {
+          ModInsts[Fns[I].Mod] += Fns[I].Insts;
+          if (I == 0 || Fns[I].Mod != Fns[I - 1].Mod)
+            Sources.push_back(Strings.SourceOrder[Fns[I].Mod]);
+        }
+        if (!ShowUnshared && Sources.size() <= 1)
+          continue;
+        std::sort(Sources.begin(), Sources.end());
+
+        auto Sig = hashContent(
+            StringRef(reinterpret_cast<const char *>(Sources.data()),
+                      Sources.size() * sizeof(uint32_t)));
+        auto &Candidates = BySignature[{Sig.Low, Sig.High}];
+        auto It = std::find_if(
+            Candidates.begin(), Candidates.end(),
+            [&](uint32_t Set) { return Sets[Set].Sources == Sources; });
+        if (It == Candidates.end()) {
+          It = Candidates.insert(It, Sets.size());
+          Sets.push_back({Sources, 0, 0});
+        }
+        Sets[*It].Insts += G->instsPerFunction();
+        ++Sets[*It].Hashes;
       }
 
-      auto NGroups =
-          Groups | ranges::to_vector |
-          ranges::action::sort(std::less<std::vector<std::string>>(),
-                               &decltype(Groups)::value_type::second);
-
-      size_t MergedIdx = 0;
-      RANGES_FOR(auto A, NGroups | group_by_second()) {
-        // Vertex for each group of hashes that have the same neighbors
+      addModuleVertices(ModInsts);
 
-        auto Insts = ranges::accumulate(
-            A | ranges::view::keys | ranges::view::values, size_t{0});
-        auto Count = static_cast<size_t>(ranges::distance(A));
-        std::string NodeID = formatv("Merged{0}", MergedIdx++);
-        std::string VtxL = formatv("{0} Insts\\n{1} Hashes", Insts, Count);
+      // Vertex for each group of hashes that have the same neighbors,
+      // in order of their first hash.
+      for (size_t MergedIdx = 0, E = Sets.size(); MergedIdx != E;
+           ++MergedIdx) {
+        auto &Set = Sets[MergedIdx];
+        std::string NodeID = formatv("Merged{0}", MergedIdx);
+        std::string VtxL =
+            formatv("{0} Insts\\n{1} Hashes", Set.Insts, Set.Hashes);
         Graph.addVertex(NodeID,
                         {{"label", VtxL},
-                         {"fontsize", compute_size(Insts)},
+                         {"fontsize", compute_size(Set.Insts)},
                          {"shape", "record"}});
 
-        auto &Sources = A.begin()->second;
-        for (auto S : Sources) {
-          Graph.addEdge(S, NodeID);
-        }
+        for (auto S : Set.Sources)
+          Graph.addEdge(Strings.getSourceAt(S), NodeID);
       }
       break;
     }
     case GraphKind::Pairwise: {
-      // MergeHashes
-
-      // (basically for mod in DB.getMods()...)
-      RANGES_FOR(auto M, Functions | group_by_module()) {
-        auto Source = M.begin()->Source;
-
-        // Total insts
-        auto Insts = instCount(M);
-
-        Graph.addVertex(Source,
-                        {{"label", getModLabel(Source)},
-                         {"style", "filled"},
-                         {"fontsize", compute_size(Insts)},
-                         {"fillcolor", "cyan"}});
-      }
-
-      StringMap<size_t> SharingMap;
-
-      auto DELIM = "!|!";
-      RANGES_FOR(auto H, Functions | group_by_hash()) {
-        auto I = H.begin();
-        auto E = H.end();
-        for (; I != E; ++I) {
-          for (auto J = std::next(I); J != E; ++J) {
-            auto S1 = I->Source;
-            auto S2 = J->Source;
-
-            // Skip self-sharing?
-            if (S1 == S2)
-              continue;
-
-            // XXX :(
-            if (S1 > S2)
-              std::swap(S1, S2);
-            auto Key = S1 + DELIM + S2;
-
-            assert(I->Insts == J->Insts);
-            SharingMap[Key] += I->Insts;
-          }
+      std::vector<uint64_t> ModInsts(Strings.Sources.size());
+      for (auto &F : Functions)
+        ModInsts[F.Mod] += F.Insts;
+      addModuleVertices(ModInsts);
+
+      // Hashes in more than one module, less any the options skip.
+      std::vector<const HashGroup *> PairGroups;
+      size_t Skipped = 0;
+      for (auto &G : Groups) {
+        if (G.NumModules <= 1)
+          continue;
+        if ((PairwiseMaxModules && G.NumModules > PairwiseMaxModules) ||
+            G.instsPerFunction() < PairwiseMinInsts) {
+          ++Skipped;
+          continue;
         }
+        PairGroups.push_back(&G);
       }
+      if (Skipped)
+        errs() << "Skipped " << Skipped << " of "
+               << Skipped + PairGroups.size() << " shared hashes\n";
 
-      for (auto &KV : SharingMap) {
-        auto Key = KV.getKey();
-        auto Value = KV.getValue();
-
-        assert(StringRef(Key).contains(DELIM));
-
-        auto P = StringRef(Key).split(DELIM);
-        auto S1 = P.first, S2 = P.second;
-        assert(!S1.empty() && !S2.empty());
-
-        auto Sharing = Twine(Value).str();
+      for (auto &P : computePairwiseSharing(Functions, PairGroups, Strings)) {
+        auto Sharing = Twine(P.Insts).str();
         Graph.addEdge(
-            S1, S2, {{"weight", Sharing}, {"label", Sharing}, {"dir", "none"}});
+            Strings.getSourceAt(P.A), Strings.getSourceAt(P.B),
+            {{"weight", Sharing}, {"label", Sharing}, {"dir", "none"}});
       }
       break;
     }
@@ -437,8 +589,9 @@ Error functionHash(ABCDB &DB) {
     auto &OS = CSVFile.os();
 
     OS << "Source,FuncName,Insts,Hash\n";
-    RANGES_FOR(const auto &Row, Functions) {
-      OS << Row.Source << "," << Row.FuncName << "," << Row.Insts << ","
+    for (const auto &Row : Functions) {
+      OS << Strings.getSource(Row.Mod) << "," << Strings.getName(Row) << ","
+         << Row.Insts << ","
          << "H" << Row.H << "\n";
     }
 
@@ -449,11 +602,47 @@ Error functionHash(ABCDB &DB) {
   return Error::success();
 }
 
+class FunctionHashAnalysis : public ModuleAnalysis {
+  size_t totalInsts = 0;
+  std::vector<FuncDesc> Functions;
+  FuncStrings Strings;
+
+public:
+  Error begin(ABCDB &DB) override {
+    errs() << "Materializing and computing function hashes...\n";
+    Strings.Sources.resize(DB.getNumModules());
+    return Error::success();
+  }
+
+  Error addModule(ModuleRef MI, const ModuleSummary &S) override {
+    Strings.Sources[MI.getID()] = MI.getFilename();
+    for (auto &F : S.Functions) {
+      if (F.IsDeclaration)
+        continue;
+
+      // errs() << "Hash for '" << F.Name << "': " << F.Hash << "\n";
+      Functions.push_back(
+          FuncDesc{MI.getID(), Strings.Names.add(F.Name), F.Insts, F.Hash});
+    }
+
+    totalInsts += S.Insts;
+    return Error::success();
+  }
+
+  Error finish(ABCDB &) override {
+    Strings.sortSources();
+    return reportFunctionHashes(Functions, Strings, totalInsts);
+  }
+};
+
+AnalysisRegistration Registered("functionhashes", [](StringRef) {
+  return llvm::make_unique<FunctionHashAnalysis>();
+});
+
 CommandRegistration Unused(&FunctionHashes, [](ResourcePaths &RP) -> Error {
   errs() << "Scanning " << InputDirectory << "...\n";
 
-  auto ExpDB = UseBCScanner ? ABCDB::loadFromBitcodeIn(InputDirectory, RP)
-                            : ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP, UseBCScanner);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
@@ -461,7 +650,8 @@ CommandRegistration Unused(&FunctionHashes, [](ResourcePaths &RP) -> Error {
   errs() << "Done! Allexes found: " << DB->allexe_size() << "\n";
   errs() << "Done! Modules found: " << DB->getMods().size() << "\n";
 
-  return functionHash(*DB);
+  FunctionHashAnalysis A;
+  return runModuleAnalyses(*DB, {&A}, outs());
 });
 
 } // end anonymous namespace
@@ -8,6 +8,7 @@
 //
 //===----------------------------------------------------------------------===//
 
+#include "ABCDBLoader.h"
 #include "subcommand-registry.h"
 
 #include "StringGraph.h"
@@ -58,16 +59,17 @@ Error graph(ABCDB &DB, StringRef Prefix, StringRef GraphFilename) {
     S = removePrefix(S);
     G.addVertexWithLabel(S, getLabel(S));
   };
-  for (const auto &A : DB.getAllexes())
-    addVertex(A.Filename);
+  for (auto A : DB.getAllexes())
+    addVertex(A.getFilename());
 
-  for (const auto &M : DB.getMods())
-    addVertex(M.Filename);
+  for (auto M : DB.getMods())
+    addVertex(M.getFilename());
 
   errs() << "Adding edges...\n";
-  for (const auto &A : DB.getAllexes()) {
-    for (const auto &M : A.Modules) {
-      G.addEdge(removePrefix(A.Filename), removePrefix(M.Filename));
+  for (auto A : DB.getAllexes()) {
+    auto AllexeName = A.getFilename();
+    for (auto M : A.modules()) {
+      G.addEdge(removePrefix(AllexeName), removePrefix(M.getFilename()));
     }
   }
 
@@ -76,7 +78,7 @@ Error graph(ABCDB &DB, StringRef Prefix, StringRef GraphFilename) {
 
 CommandRegistration Unused(&Graph, [](ResourcePaths &RP) -> Error {
   errs() << "Loading allexe's from " << InputDirectory << "...\n";
-  auto ExpDB = ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
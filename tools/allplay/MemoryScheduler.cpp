@@ -0,0 +1,63 @@
+#include "MemoryScheduler.h"
+
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace allvm_analysis;
+
+uint64_t allvm_analysis::getMemoryBudget(unsigned MB) {
+  if (MB != 0)
+    return uint64_t(MB) << 20;
+  long Pages = ::sysconf(_SC_PHYS_PAGES);
+  long PageSize = ::sysconf(_SC_PAGESIZE);
+  if (Pages <= 0 || PageSize <= 0)
+    return UINT64_MAX;
+  return uint64_t(Pages) * uint64_t(PageSize) / 4 * 3;
+}
+
+void MemoryScheduler::add(uint64_t Cost, std::function<void()> Task) {
+  Tasks.emplace(Cost, std::move(Task));
+}
+
+void MemoryScheduler::worker() {
+  std::unique_lock<std::mutex> Lock(Mtx);
+  while (true) {
+    // Largest task that fits, or the largest if nothing is running.
+    auto Next = Tasks.end();
+    CV.wait(Lock, [&] {
+      if (Tasks.empty())
+        return true;
+      Next = Running ? Tasks.lower_bound(Budget - InUse) : Tasks.begin();
+      return Next != Tasks.end();
+    });
+    if (Tasks.empty())
+      break;
+
+    uint64_t Cost = std::min(Next->first, Budget - InUse);
+    auto Task = std::move(Next->second);
+    Tasks.erase(Next);
+    InUse += Cost;
+    ++Running;
+
+    Lock.unlock();
+    Task();
+    Lock.lock();
+
+    InUse -= Cost;
+    --Running;
+    CV.notify_all();
+  }
+  // Let the others see there's nothing left.
+  CV.notify_all();
+}
+
+void MemoryScheduler::run() {
+  std::vector<std::thread> Workers;
+  for (unsigned i = 1; i < Threads; ++i)
+    Workers.emplace_back([this] { worker(); });
+  worker();
+  for (auto &T : Workers)
+    T.join();
+}
@@ -0,0 +1,50 @@
+#ifndef ALLPLAY_MEMORYSCHEDULER_H
+#define ALLPLAY_MEMORYSCHEDULER_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace allvm_analysis {
+
+// Memory to allow tasks to use together, in bytes: the given number of
+// MB, or three quarters of physical memory if 0.
+uint64_t getMemoryBudget(unsigned MB);
+
+// Runs tasks on a number of threads such that the sum of the estimated
+// peak memory of those running stays within a budget.
+//
+// Tasks are started largest first (LPT order), so the long ones don't
+// end up trailing at the end of the run; whenever the largest waiting
+// task doesn't fit, smaller ones that do fit fill the rest of the budget.
+// A task estimated over the whole budget is run once nothing else is.
+class MemoryScheduler {
+public:
+  MemoryScheduler(unsigned Threads, uint64_t Budget)
+      : Threads(Threads), Budget(Budget) {}
+
+  void add(uint64_t Cost, std::function<void()> Task);
+
+  // Run all tasks added, returning once they are done.
+  void run();
+
+private:
+  void worker();
+
+  unsigned Threads;
+  uint64_t Budget;
+
+  std::mutex Mtx;
+  std::condition_variable CV;
+  // Waiting tasks, largest cost first
+  std::multimap<uint64_t, std::function<void()>, std::greater<uint64_t>>
+      Tasks;
+  uint64_t InUse = 0;
+  unsigned Running = 0;
+};
+
+} // end namespace allvm_analysis
+
+#endif // ALLPLAY_MEMORYSCHEDULER_H
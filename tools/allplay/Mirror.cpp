@@ -0,0 +1,128 @@
+#include "ABCDBLoader.h"
+#include "ModuleMapReduce.h"
+#include "boost_progress.h"
+#include "subcommand-registry.h"
+
+#include "allvm-analysis/ABCDB.h"
+#include "allvm-analysis/AtomicFile.h"
+#include "allvm-analysis/ContentHash.h"
+#include "allvm-analysis/Mirror.h"
+#include "allvm-analysis/ModuleSummary.h"
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace allvm_analysis;
+using namespace allvm;
+using namespace llvm;
+
+namespace {
+
+cl::SubCommand Mirror("mirror",
+                      "Write copies of modules without debug info, and "
+                      "their summaries, for analyses to read instead "
+                      "(see -mirror)");
+cl::opt<std::string> InputDirectory(cl::Positional, cl::Required,
+                                    cl::desc("<input directory to scan>"),
+                                    cl::sub(Mirror));
+cl::opt<std::string> MirrorDirectory(cl::Positional, cl::Required,
+                                     cl::desc("<mirror directory>"),
+                                     cl::sub(Mirror));
+cl::opt<bool> UseBCScanner("bc-scanner", cl::Optional, cl::init(false),
+                           cl::desc("Use BC scanner instead of allexe scanner"),
+                           cl::sub(Mirror));
+
+struct MirroredModule {
+  ModuleKey Key;
+  uint64_t Original;
+  uint64_t Stripped;
+};
+
+Error mirror(ABCDB &DB, StringRef Dir) {
+  if (auto EC = sys::fs::create_directories(Dir))
+    return make_error<StringError>("Unable to create mirror " + Dir, EC);
+  auto Index = readMirrorIndex(Dir);
+  if (!Index)
+    return Index.takeError();
+
+  // Modules are named by full key, those already there are the same.
+  // Those that can't be there yet are hashed as they are read.
+  hashMirrorCandidates(DB, *Index);
+  std::vector<ModuleRef> ToMirror;
+  for (auto M : DB.getMods()) {
+    auto Key = M.getFullKey();
+    if (Key.Hash.isZero() || !Index->count(getMirrorFileName(Key)))
+      ToMirror.push_back(M);
+  }
+  errs() << "Mirroring " << ToMirror.size() << " of " << DB.getNumModules()
+         << " modules into '" << Dir << "'...\n";
+
+  boost::progress_display progress(ToMirror.size(), errs());
+  uint64_t Original = 0, Stripped = 0;
+
+  auto strip = [&](ModuleRef M,
+                   MemoryBufferRef Contents) -> Expected<MirroredModule> {
+    auto Key = M.getFullKey();
+    if (Key.Hash.isZero())
+      Key.Hash = hashContent(Contents.getBuffer());
+
+    // A context of its own: one reused across modules (see ContextPool.h)
+    // would rename struct types clashing with those of earlier modules.
+    LLVMContext C;
+    auto Mod = loadModule(Contents, C);
+    if (!Mod)
+      return Mod.takeError();
+
+    // Summaries are of the original, whatever stripping drops.
+    auto Summary = ModuleSummary::compute(**Mod).serialize();
+    SmallString<128> SummaryPath(Dir);
+    sys::path::append(SummaryPath, getMirrorSummaryFileName(Key));
+    if (auto Err = writeFileAtomically(SummaryPath, Summary))
+      return std::move(Err);
+
+    stripForMirror(**Mod);
+    SmallString<128> Path(Dir);
+    sys::path::append(Path, getMirrorFileName(Key));
+    SmallVector<char, 0> Bitcode;
+    raw_svector_ostream OS(Bitcode);
+    WriteBitcodeToFile(Mod->get(), OS);
+    if (auto Err = writeFileAtomically(Path, OS.str()))
+      return std::move(Err);
+    return MirroredModule{Key, Contents.getBufferSize(), Bitcode.size()};
+  };
+  auto add = [&](ModuleRef M, MirroredModule &&Mirrored) -> Error {
+    (*Index)[getMirrorFileName(Mirrored.Key)] = M.getFilename();
+    Original += Mirrored.Original;
+    Stripped += Mirrored.Stripped;
+    ++progress;
+    return Error::success();
+  };
+  Error Err = mapReduceModuleContents(ToMirror, strip, add);
+
+  // Keep what was written even if stopping early.
+  if (auto IndexErr = writeMirrorIndex(Dir, *Index))
+    return joinErrors(std::move(Err), std::move(IndexErr));
+  if (Err)
+    return Err;
+
+  errs() << "Mirrored " << (Original >> 20) << "MB of bitcode as "
+         << (Stripped >> 20) << "MB\n";
+  return Error::success();
+}
+
+CommandRegistration Unused(&Mirror, [](ResourcePaths &RP) -> Error {
+  errs() << "Loading allexe's from " << InputDirectory << "...\n";
+  auto ExpDB = loadABCDB(InputDirectory, RP, UseBCScanner);
+  if (!ExpDB)
+    return ExpDB.takeError();
+  auto &DB = *ExpDB;
+  errs() << "Done! Allexes found: " << DB->allexe_size() << "\n";
+
+  return mirror(*DB, MirrorDirectory);
+});
+
+} // end anonymous namespace
@@ -0,0 +1,100 @@
+#include "ModuleAnalysis.h"
+
+#include "ABCDBLoader.h"
+#include "ModuleMapReduce.h"
+#include "WorkerProcesses.h"
+#include "boost_progress.h"
+
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/ManagedStatic.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+ManagedStatic<StringMap<AnalysisFactoryT>> Analyses;
+
+} // end anonymous namespace
+
+AnalysisRegistration::AnalysisRegistration(StringRef Name,
+                                           AnalysisFactoryT Create) {
+  assert(Analyses->count(Name) == 0 && "Analysis registered twice");
+  (*Analyses)[Name] = std::move(Create);
+}
+
+std::vector<std::string> allvm_analysis::getRegisteredAnalyses() {
+  std::vector<std::string> Names;
+  for (auto &KV : *Analyses)
+    Names.push_back(KV.getKey().str());
+  std::sort(Names.begin(), Names.end());
+  return Names;
+}
+
+Expected<std::unique_ptr<ModuleAnalysis>>
+allvm_analysis::createAnalysis(StringRef Name, StringRef InputDirectory) {
+  auto It = Analyses->find(Name);
+  if (It == Analyses->end())
+    return make_error<StringError>("Unknown analysis '" + Name + "'",
+                                   errc::invalid_argument);
+  return It->second(InputDirectory);
+}
+
+Error allvm_analysis::runModuleAnalyses(ABCDB &DB,
+                                        ArrayRef<ModuleAnalysis *> Selected,
+                                        raw_ostream &ProgressOS) {
+  for (auto *A : Selected)
+    if (auto Err = A->begin(DB))
+      return Err;
+
+  boost::progress_display progress(DB.getMods().size(), ProgressOS);
+  auto addModule = [&](ModuleRef MI, ModuleSummary &&S) -> Error {
+    for (auto *A : Selected)
+      if (auto Err = A->addModule(MI, S))
+        return Err;
+    ++progress;
+    return Error::success();
+  };
+  Error Err = Error::success();
+  if (getNumProcesses()) {
+    // Summaries are computed by worker processes and sent back serialized.
+    std::vector<ModuleRef> Mods(DB.getMods().begin(), DB.getMods().end());
+    auto summarize = [&](size_t I) -> Expected<std::string> {
+      auto S = getModuleSummary(Mods[I]);
+      if (!S)
+        return S.takeError();
+      return S->serialize();
+    };
+    auto add = [&](size_t I, StringRef Data) -> Error {
+      auto S = ModuleSummary::deserialize(Data);
+      if (!S)
+        return make_error<StringError>("Bad summary from worker for " +
+                                           Mods[I].getFilename(),
+                                       errc::invalid_argument);
+      return addModule(Mods[I], std::move(*S));
+    };
+    auto skip = [&](size_t I, StringRef Why) -> Error {
+      errs() << "Warning, " << Why << " on module '" << Mods[I].getFilename()
+             << "', attempting to skip.\n";
+      ++progress;
+      return Error::success();
+    };
+    Err = forkMapReduce(Mods.size(), summarize, add, skip);
+  } else {
+    auto summarize = [](ModuleRef M, MemoryBufferRef Contents) {
+      return getModuleSummary(M, Contents);
+    };
+    Err = mapReduceModuleContents(DB.getMods(), summarize, addModule);
+  }
+  if (Err)
+    return Err;
+
+  for (auto *A : Selected)
+    if (auto Err = A->finish(DB))
+      return Err;
+  return Error::success();
+}
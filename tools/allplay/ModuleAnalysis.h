@@ -0,0 +1,61 @@
+#ifndef ALLPLAY_MODULEANALYSIS_H
+#define ALLPLAY_MODULEANALYSIS_H
+
+#include "allvm-analysis/ABCDB.h"
+#include "allvm-analysis/ModuleSummary.h"
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Error.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace allvm_analysis {
+
+// Analysis computed from the summaries of all modules in an ABCDB.
+// Subcommands doing their work this way can also be run together
+// using 'allplay run', which computes each summary only once.
+class ModuleAnalysis {
+public:
+  virtual ~ModuleAnalysis() = default;
+
+  // Called once before any modules.
+  virtual llvm::Error begin(ABCDB &) { return llvm::Error::success(); }
+  // Called for each module, in DB order.
+  virtual llvm::Error addModule(ModuleRef M, const ModuleSummary &S) = 0;
+  // Called once after all modules, to report results.
+  virtual llvm::Error finish(ABCDB &DB) = 0;
+};
+
+// Creates the analysis, given the directory the DB was loaded from.
+using AnalysisFactoryT =
+    std::function<std::unique_ptr<ModuleAnalysis>(llvm::StringRef)>;
+
+// Global initializer registering an analysis for use with 'allplay run'.
+struct AnalysisRegistration {
+  AnalysisRegistration(llvm::StringRef Name, AnalysisFactoryT Create);
+};
+
+// Names of registered analyses, sorted.
+std::vector<std::string> getRegisteredAnalyses();
+
+// Create the analysis registered with the given name.
+llvm::Expected<std::unique_ptr<ModuleAnalysis>>
+createAnalysis(llvm::StringRef Name, llvm::StringRef InputDirectory);
+
+// Run the given analyses over all modules in DB, in parallel (see -j),
+// showing progress on the given stream.
+llvm::Error runModuleAnalyses(ABCDB &DB,
+                              llvm::ArrayRef<ModuleAnalysis *> Selected,
+                              llvm::raw_ostream &ProgressOS);
+
+// The 'run' subcommand, for analyses' options to also be given to it.
+llvm::cl::SubCommand &getRunSubCommand();
+
+} // end namespace allvm_analysis
+
+#endif // ALLPLAY_MODULEANALYSIS_H
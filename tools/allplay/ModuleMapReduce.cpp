@@ -0,0 +1,162 @@
+#include "ModuleMapReduce.h"
+
+#include "allvm-analysis/BatchReader.h"
+
+#include <llvm/IRReader/IRReader.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/SourceMgr.h>
+#include <llvm/Support/Threading.h>
+
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+cl::opt<unsigned> Jobs("j", cl::Optional, cl::init(0),
+                       cl::desc("Number of threads, 0 to auto-detect"),
+                       cl::sub(*cl::AllSubCommands));
+cl::opt<unsigned> PrefetchMB(
+    "prefetch-mb", cl::Optional, cl::init(256),
+    cl::desc("Read module files up to this many MB ahead of parsing"),
+    cl::sub(*cl::AllSubCommands));
+
+cl::opt<bool>
+    UseIOUring("io-uring", cl::Optional, cl::init(true),
+               cl::desc("Read module files using io_uring when available"),
+               cl::sub(*cl::AllSubCommands));
+
+// Files read together; the next batch is hinted to the kernel meanwhile.
+const size_t ReadBatchSize = 32;
+
+void hintWillNeed(StringRef Filename) {
+  int FD = ::open(Filename.str().c_str(), O_RDONLY | O_CLOEXEC);
+  if (FD < 0)
+    return;
+  ::posix_fadvise(FD, 0, 0, POSIX_FADV_WILLNEED);
+  ::close(FD);
+}
+
+} // end anonymous namespace
+
+unsigned allvm_analysis::getNumJobs() {
+  if (Jobs == 0)
+    return heavyweight_hardware_concurrency();
+  return Jobs;
+}
+
+Expected<std::unique_ptr<Module>> allvm_analysis::loadModule(ModuleRef M,
+                                                             LLVMContext &C) {
+  auto Filename = M.getBitcodePath();
+  auto MB = MemoryBuffer::getFile(Filename);
+  if (!MB)
+    return make_error<StringError>("Unable to open module file " + Filename,
+                                   MB.getError());
+  return loadModule((*MB)->getMemBufferRef(), C);
+}
+
+Expected<std::unique_ptr<Module>>
+allvm_analysis::loadModule(MemoryBufferRef Contents, LLVMContext &C) {
+  SMDiagnostic SM;
+  auto Mod = llvm::parseIR(Contents, SM, C);
+  if (!Mod)
+    return make_error<StringError>("Unable to open module file " +
+                                       Contents.getBufferIdentifier(),
+                                   errc::invalid_argument);
+  if (auto Err = Mod->materializeAll())
+    return std::move(Err);
+  return std::move(Mod);
+}
+
+ModulePrefetcher::ModulePrefetcher(std::vector<ModuleRef> Mods)
+    : Mods(std::move(Mods)) {
+  for (size_t I = 0, E = this->Mods.size(); I != E; ++I)
+    Index[this->Mods[I].getID()] = I;
+  Buffers.resize(this->Mods.size());
+  Errors.resize(this->Mods.size());
+  Reader = std::thread([this] { read(); });
+}
+
+ModulePrefetcher::~ModulePrefetcher() {
+  {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    Stop = true;
+  }
+  CV.notify_all();
+  Reader.join();
+}
+
+void ModulePrefetcher::read() {
+  size_t Budget = size_t(PrefetchMB) << 20;
+  for (size_t I = 0, E = Mods.size(); I != E;) {
+    {
+      std::unique_lock<std::mutex> Lock(Mtx);
+      CV.wait(Lock, [&] {
+        return Stop || Waiting || Pending == 0 || PendingBytes < Budget;
+      });
+      if (Stop)
+        return;
+    }
+
+    size_t End = std::min(E, I + ReadBatchSize);
+    for (size_t J = End; J < std::min(E, End + ReadBatchSize); ++J)
+      hintWillNeed(Mods[J].getBitcodePath());
+
+    // Read into memory now, rather than mapped and read (on first access)
+    // by whoever parses it.
+    std::vector<std::string> Paths;
+    for (size_t J = I; J != End; ++J)
+      Paths.push_back(Mods[J].getBitcodePath());
+    auto Contents = readFiles(Paths, UseIOUring);
+
+    {
+      std::lock_guard<std::mutex> Lock(Mtx);
+      for (size_t J = I; J != End; ++J) {
+        auto &C = Contents[J - I];
+        if (C.Buffer)
+          PendingBytes += C.Buffer->getBufferSize();
+        Buffers[J] = std::move(C.Buffer);
+        Errors[J] = C.EC;
+      }
+      Pending += End - I;
+      NumRead = End;
+    }
+    CV.notify_all();
+    I = End;
+  }
+}
+
+Expected<std::unique_ptr<MemoryBuffer>> ModulePrefetcher::take(ModuleRef M) {
+  auto It = Index.find(M.getID());
+  assert(It != Index.end() && "Module not being prefetched");
+  auto I = It->second;
+
+  std::unique_lock<std::mutex> Lock(Mtx);
+  if (NumRead <= I) {
+    // Reader may be waiting for earlier modules to be taken,
+    // which they may never be if stopping on error.
+    ++Waiting;
+    CV.notify_all();
+    CV.wait(Lock, [&] { return NumRead > I; });
+    --Waiting;
+  }
+  auto MB = std::move(Buffers[I]);
+  auto EC = Errors[I];
+  if (MB)
+    PendingBytes -= MB->getBufferSize();
+  --Pending;
+  Lock.unlock();
+  CV.notify_all();
+
+  if (!MB)
+    return make_error<StringError>("Unable to open module file " +
+                                       M.getBitcodePath(),
+                                   EC);
+  return std::move(MB);
+}
@@ -0,0 +1,180 @@
+#ifndef ALLPLAY_MODULEMAPREDUCE_H
+#define ALLPLAY_MODULEMAPREDUCE_H
+
+#include "ThreadSupport.h"
+
+#include "allvm-analysis/ABCDB.h"
+
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/ThreadPool.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace allvm_analysis {
+
+// Number of threads to use for per-module work, as requested with -j
+// (all cores if not given).
+unsigned getNumJobs();
+
+// Parse and materialize the module's bitcode in the given context.
+llvm::Expected<std::unique_ptr<llvm::Module>> loadModule(ModuleRef M,
+                                                         llvm::LLVMContext &C);
+// Same, for module contents already read.
+llvm::Expected<std::unique_ptr<llvm::Module>>
+loadModule(llvm::MemoryBufferRef Contents, llvm::LLVMContext &C);
+
+// Reads the files of the given modules, in order, on a thread of its own,
+// staying at most -prefetch-mb ahead of what has been taken.
+// Files are read in batches (see readFiles), and the upcoming batch is
+// hinted to the kernel so it can start reading it.
+// This keeps the disk busy while modules already read are being parsed,
+// which matters for cold caches on slow (spinning or network) storage.
+class ModulePrefetcher {
+public:
+  explicit ModulePrefetcher(std::vector<ModuleRef> Mods);
+  ~ModulePrefetcher();
+
+  // Contents of the given module file, waiting for it to be read.
+  // Each module can only be taken once.
+  llvm::Expected<std::unique_ptr<llvm::MemoryBuffer>> take(ModuleRef M);
+
+private:
+  void read();
+
+  std::vector<ModuleRef> Mods;
+  llvm::DenseMap<ModuleID, size_t> Index;
+
+  std::mutex Mtx;
+  std::condition_variable CV;
+  std::vector<std::unique_ptr<llvm::MemoryBuffer>> Buffers;
+  std::vector<std::error_code> Errors;
+  size_t NumRead = 0;
+  // Read but not yet taken
+  size_t Pending = 0, PendingBytes = 0;
+  // Number of take()s waiting for their module to be read
+  size_t Waiting = 0;
+  bool Stop = false;
+
+  std::thread Reader;
+};
+
+namespace detail {
+template <typename T> struct ExpectedValue;
+template <typename T> struct ExpectedValue<llvm::Expected<T>> {
+  using type = T;
+};
+} // end namespace detail
+
+// Run Map on each of Mods using getNumJobs() threads, and hand each result
+// to Reduce on the calling thread, in order of Mods. Output built by Reduce
+// is then the same regardless of the number of threads.
+//
+//   Map:    llvm::Expected<R>(ModuleRef), called concurrently.
+//           Anything needing IR should load the module into
+//           getThreadContext() (or a context of its own, if printing
+//           or writing IR), and return plain data (no references
+//           into it) after destroying the module.
+//   Reduce: llvm::Error(ModuleRef, R &&)
+//
+// Only a few results are computed ahead of the one being reduced, so
+// they don't pile up. Stops at the first error, which is returned.
+template <typename RangeT, typename MapT, typename ReduceT>
+llvm::Error mapReduceModules(const RangeT &Mods, MapT Map, ReduceT Reduce) {
+  using ResultT = typename detail::ExpectedValue<decltype(
+      Map(std::declval<ModuleRef>()))>::type;
+
+  std::vector<ModuleRef> Items(Mods.begin(), Mods.end());
+  unsigned Jobs = getNumJobs();
+  if (Jobs != 1)
+    if (auto Err = setDefaultThreadStackSize())
+      return Err;
+
+  std::mutex Mtx;
+  std::condition_variable CV;
+  std::vector<std::unique_ptr<llvm::Expected<ResultT>>> Slots(Items.size());
+  bool Stop = false;
+
+  llvm::ThreadPool TP(Jobs);
+  size_t Window = 4 * size_t(Jobs), Next = 0;
+  auto enqueue = [&](size_t Done) {
+    for (; Next < Items.size() && Next < Done + Window; ++Next) {
+      auto I = Next;
+      TP.async([&, I]() {
+        {
+          std::lock_guard<std::mutex> Lock(Mtx);
+          if (Stop)
+            return;
+        }
+        auto R = llvm::make_unique<llvm::Expected<ResultT>>(Map(Items[I]));
+        {
+          std::lock_guard<std::mutex> Lock(Mtx);
+          Slots[I] = std::move(R);
+        }
+        CV.notify_all();
+      });
+    }
+  };
+
+  auto run = [&]() -> llvm::Error {
+    for (size_t I = 0, E = Items.size(); I != E; ++I) {
+      enqueue(I);
+      std::unique_ptr<llvm::Expected<ResultT>> R;
+      {
+        std::unique_lock<std::mutex> Lock(Mtx);
+        CV.wait(Lock, [&] { return Slots[I] != nullptr; });
+        R = std::move(Slots[I]);
+      }
+      if (!*R)
+        return R->takeError();
+      if (auto Err = Reduce(Items[I], std::move(**R)))
+        return Err;
+    }
+    return llvm::Error::success();
+  };
+  llvm::Error Err = run();
+
+  // On error, let running tasks finish and drop what they computed.
+  {
+    std::lock_guard<std::mutex> Lock(Mtx);
+    Stop = true;
+  }
+  TP.wait();
+  for (auto &R : Slots)
+    if (R && !*R)
+      llvm::consumeError(R->takeError());
+
+  return Err;
+}
+
+// Like mapReduceModules, but module files are read ahead by a
+// ModulePrefetcher, and Map is given their contents:
+//
+//   Map:    llvm::Expected<R>(ModuleRef, llvm::MemoryBufferRef)
+template <typename RangeT, typename MapT, typename ReduceT>
+llvm::Error mapReduceModuleContents(const RangeT &Mods, MapT Map,
+                                    ReduceT Reduce) {
+  using MapResultT = decltype(
+      Map(std::declval<ModuleRef>(), std::declval<llvm::MemoryBufferRef>()));
+
+  std::vector<ModuleRef> Items(Mods.begin(), Mods.end());
+  ModulePrefetcher Prefetch(Items);
+  auto MapContents = [&](ModuleRef M) -> MapResultT {
+    auto Contents = Prefetch.take(M);
+    if (!Contents)
+      return Contents.takeError();
+    return Map(M, (*Contents)->getMemBufferRef());
+  };
+  return mapReduceModules(Items, MapContents, Reduce);
+}
+
+} // end namespace allvm_analysis
+
+#endif // ALLPLAY_MODULEMAPREDUCE_H
@@ -1,19 +1,16 @@
+#include "ABCDBLoader.h"
+#include "ModuleAnalysis.h"
 #include "subcommand-registry.h"
 
-#include "boost_progress.h"
-
 #include "allvm-analysis/ABCDB.h"
 #include "allvm-analysis/ModuleFlags.h"
 
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
-#include <llvm/IRReader/IRReader.h>
 #include <llvm/Support/Errc.h>
 #include <llvm/Support/FileSystem.h>
-#include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/ToolOutputFile.h>
-#include <llvm/Transforms/Utils/FunctionComparator.h>
 
 #include <algorithm>
 #include <functional>
@@ -29,40 +26,34 @@ cl::SubCommand NeoCSV("neocsv", "Create CSV files for importing into neo4j");
 cl::opt<std::string> InputDirectory(cl::Positional, cl::Required,
                                     cl::desc("<input directory to scan>"),
                                     cl::sub(NeoCSV));
+// Options below are also accepted by 'allplay run'.
 cl::opt<std::string> ModOut("modules", cl::init("modules.csv"),
                             cl::desc("name of file to write module node data"),
-                            cl::sub(NeoCSV));
+                            cl::sub(NeoCSV), cl::sub(getRunSubCommand()));
 cl::opt<std::string>
     AllOut("allexes", cl::init("allexes.csv"),
            cl::desc("name of file to write allexe module node data"),
-           cl::sub(NeoCSV));
+           cl::sub(NeoCSV), cl::sub(getRunSubCommand()));
 cl::opt<std::string>
     FuncOut("funcs", cl::init("funcs.csv"),
             cl::desc("name of file to write function node data"),
-            cl::sub(NeoCSV));
+            cl::sub(NeoCSV), cl::sub(getRunSubCommand()));
 cl::opt<std::string>
     ModGlobalsOut("modglobals", cl::init("modglobals.csv"),
                   cl::desc("name of file to write contains function rel data"),
-                  cl::sub(NeoCSV));
+                  cl::sub(NeoCSV), cl::sub(getRunSubCommand()));
 cl::opt<std::string>
     ContainsOut("contains", cl::init("contains.csv"),
                 cl::desc("name of file to write contains mod rel data"),
-                cl::sub(NeoCSV));
+                cl::sub(NeoCSV), cl::sub(getRunSubCommand()));
 cl::opt<std::string>
     AliasOut("aliases", cl::init("aliases.csv"),
              cl::desc("name of file to write aliases node data"),
-             cl::sub(NeoCSV));
+             cl::sub(NeoCSV), cl::sub(getRunSubCommand()));
 cl::opt<std::string>
     GlobalOut("globals", cl::init("globals.csv"),
               cl::desc("name of file to write globals node data"),
-              cl::sub(NeoCSV));
-
-template <typename T> auto countInsts(const T *V) {
-  return std::accumulate(
-      V->begin(), V->end(), size_t{0},
-      [](auto N, auto &child) { return N + countInsts(&child); });
-}
-template <> auto countInsts(const BasicBlock *B) { return B->size(); }
+              cl::sub(NeoCSV), cl::sub(getRunSubCommand()));
 
 Expected<std::unique_ptr<tool_output_file>> openFile(StringRef Filename) {
   std::error_code EC;
@@ -82,28 +73,15 @@ std::unique_ptr<tool_output_file> openFile(StringRef Filename, Error &E) {
   return std::move(*F);
 }
 
-Error neo(ABCDB &DB, StringRef Prefix) {
-  Error E = Error::success();
-  auto ModOutFile = openFile(ModOut, E);
-  auto FuncOutFile = openFile(FuncOut, E);
-  auto AllOutFile = openFile(AllOut, E);
-  auto ContainsOutFile = openFile(ContainsOut, E);
-  auto GlobalOutFile = openFile(GlobalOut, E);
-  auto ModGlobalsOutFile = openFile(ModGlobalsOut, E);
-  auto AliasOutFile = openFile(AliasOut, E);
-  if (E)
-    return E;
-
-  auto &ModS = ModOutFile->os();
-  auto &FuncS = FuncOutFile->os();
-  auto &AllS = AllOutFile->os();
-  auto &ContainS = ContainsOutFile->os();
-  auto &GlobalS = GlobalOutFile->os();
-  auto &ModGlobalS = ModGlobalsOutFile->os();
-  auto &AliasS = AliasOutFile->os();
+class NeoAnalysis : public ModuleAnalysis {
+  std::string Prefix;
+
+  std::unique_ptr<tool_output_file> ModOutFile, FuncOutFile, AllOutFile,
+      ContainsOutFile, GlobalOutFile, ModGlobalsOutFile, AliasOutFile;
+  size_t GlobalID = 0;
 
   // TODO: canonicalize all paths into nix store
-  auto removePrefix = [Prefix](StringRef S) {
+  StringRef removePrefix(StringRef S) const {
     if (S.startswith(Prefix))
       S = S.drop_front(Prefix.size());
     StringRef NixStorePrefix = "/nix/store/";
@@ -112,129 +90,150 @@ Error neo(ABCDB &DB, StringRef Prefix) {
     if (S.startswith("/"))
       S = S.drop_front(1);
     return S;
-  };
+  }
 
-  auto basename = [](StringRef S) { return S.rsplit('/').second; };
+  static StringRef basename(StringRef S) { return S.rsplit('/').second; }
+
+public:
+  explicit NeoAnalysis(StringRef Prefix) : Prefix(Prefix) {}
+
+  Error begin(ABCDB &) override {
+    Error E = Error::success();
+    ModOutFile = openFile(ModOut, E);
+    FuncOutFile = openFile(FuncOut, E);
+    AllOutFile = openFile(AllOut, E);
+    ContainsOutFile = openFile(ContainsOut, E);
+    GlobalOutFile = openFile(GlobalOut, E);
+    ModGlobalsOutFile = openFile(ModGlobalsOut, E);
+    AliasOutFile = openFile(AliasOut, E);
+    if (E)
+      return E;
+
+    // Create module nodes
+    ModOutFile->os() << "CRC:ID(Module),Name,Path\n";
+    FuncOutFile->os() << ":ID(Global),Name,Insts:int,Hash:long,:LABEL\n";
+    GlobalOutFile->os() << ":ID(Global),Name,:LABEL\n"; // XXX: Add more info
+    AliasOutFile->os() << ":ID(Global),Name,Aliasee\n"; // XXX: Add info
+    ModGlobalsOutFile->os() << ":START_ID(Module),:END_ID(Global),:TYPE\n";
+    return Error::success();
+  }
 
-  boost::progress_display mod_progress(DB.getMods().size());
+  Error addModule(ModuleRef MI, const ModuleSummary &S) override {
+    auto &ModS = ModOutFile->os();
+    auto &FuncS = FuncOutFile->os();
+    auto &GlobalS = GlobalOutFile->os();
+    auto &ModGlobalS = ModGlobalsOutFile->os();
+    auto &AliasS = AliasOutFile->os();
 
-  // Create module nodes
-  ModS << "CRC:ID(Module),Name,Path\n";
-  FuncS << ":ID(Global),Name,Insts:int,Hash:long,:LABEL\n";
-  GlobalS << ":ID(Global),Name,:LABEL\n"; // XXX: Add more info
-  AliasS << ":ID(Global),Name,Aliasee\n"; // XXX: Add info
-  ModGlobalS << ":START_ID(Module),:END_ID(Global),:TYPE\n";
-  size_t GlobalID = 0;
-  for (auto &MI : DB.getMods()) {
-    ModS << MI.ModuleCRC << "," << basename(MI.Filename) << ","
-         << removePrefix(MI.Filename) << "\n";
-
-    SMDiagnostic SM;
-    LLVMContext C;
-    auto M = llvm::parseIRFile(MI.Filename, SM, C);
-    if (!M)
-      return make_error<StringError>(
-          "Unable to open module file " + MI.Filename, errc::invalid_argument);
-    if (auto Err = M->materializeAll())
-      return Err;
-
-    for (auto &F : *M) {
-      FuncS << GlobalID << "," << F.getName() << ",";
-      if (F.isDeclaration()) {
+    auto Filename = MI.getFilename();
+    ModS << MI.getCRC() << "," << basename(Filename) << ","
+         << removePrefix(Filename) << "\n";
+
+    for (auto &F : S.Functions) {
+      FuncS << GlobalID << "," << F.Name << ",";
+      if (F.IsDeclaration) {
         FuncS << "0,0,Declaration\n";
       } else {
-        auto H = FunctionComparator::functionHash(F);
-        FuncS << countInsts(&F) << "," << H << ",Definition\n";
+        FuncS << F.Insts << "," << F.Hash << ",Definition\n";
       }
 
       // Edge property redundant with node label, but oh well
-      auto ModFuncRel = F.isDeclaration() ? "DECLARES" : "DEFINES";
-      ModGlobalS << MI.ModuleCRC << "," << GlobalID << "," << ModFuncRel
+      auto ModFuncRel = F.IsDeclaration ? "DECLARES" : "DEFINES";
+      ModGlobalS << MI.getCRC() << "," << GlobalID << "," << ModFuncRel
                  << "\n";
 
       ++GlobalID;
     }
 
-    for (auto &G : M->globals()) {
-      auto ModRel = G.isDeclaration() ? "DECLARES" : "DEFINES";
-      auto Label = G.isDeclaration() ? "Declaration" : "Definition";
-      GlobalS << GlobalID << "," << G.getName() << "," << Label << "\n";
-      ModGlobalS << MI.ModuleCRC << "," << GlobalID << "," << ModRel << "\n";
+    for (auto &G : S.Globals) {
+      auto ModRel = G.IsDeclaration ? "DECLARES" : "DEFINES";
+      auto Label = G.IsDeclaration ? "Declaration" : "Definition";
+      GlobalS << GlobalID << "," << G.Name << "," << Label << "\n";
+      ModGlobalS << MI.getCRC() << "," << GlobalID << "," << ModRel << "\n";
 
       ++GlobalID;
     };
 
-    for (auto &A : M->aliases()) {
-      AliasS << GlobalID << "," << A.getName() << ","
-             << A.getAliasee()->getName() << "\n";
+    for (auto &A : S.Aliases) {
+      AliasS << GlobalID << "," << A.Name << "," << A.Aliasee << "\n";
 
-      ModGlobalS << MI.ModuleCRC << "," << GlobalID << ","
+      ModGlobalS << MI.getCRC() << "," << GlobalID << ","
                  << "DEFINES\n";
 
       ++GlobalID;
     }
 
-    ++mod_progress;
+    return Error::success();
   }
 
-  // allexe nodes
-  AllS << "ID:ID(Allexe),Name,Path\n";
-  for (size_t idx = 0; idx < DB.allexe_size(); ++idx) {
-    auto &A = DB.getAllexes()[idx];
-    AllS << idx << "," << basename(A.Filename) << ","
-         << removePrefix(A.Filename) << "\n";
-  }
+  Error finish(ABCDB &DB) override {
+    auto &AllS = AllOutFile->os();
+    auto &ContainS = ContainsOutFile->os();
+
+    // allexe nodes
+    AllS << "ID:ID(Allexe),Name,Path\n";
+    for (size_t idx = 0; idx < DB.allexe_size(); ++idx) {
+      auto Filename = DB.getAllexe(idx).getFilename();
+      AllS << idx << "," << basename(Filename) << ","
+           << removePrefix(Filename) << "\n";
+    }
 
-  // emit allexe -> module relationships
-  ContainS << ":START_ID(Allexe),Index,:END_ID(Module)\n";
-  for (size_t idx = 0; idx < DB.allexe_size(); ++idx) {
-    auto &A = DB.getAllexes()[idx];
-    for (size_t i = 0; i < A.Modules.size(); ++i) {
-      auto &M = A.Modules[i];
-      ContainS << idx << "," << i << "," << M.ModuleCRC << "\n";
+    // emit allexe -> module relationships
+    ContainS << ":START_ID(Allexe),Index,:END_ID(Module)\n";
+    for (size_t idx = 0; idx < DB.allexe_size(); ++idx) {
+      auto Mods = DB.getAllexe(idx).modules();
+      for (size_t i = 0; i < Mods.size(); ++i) {
+        auto M = Mods[i];
+        ContainS << idx << "," << i << "," << M.getCRC() << "\n";
+      }
     }
+
+    ModOutFile->keep();
+    ModGlobalsOutFile->keep();
+    AliasOutFile->keep();
+    FuncOutFile->keep();
+    GlobalOutFile->keep();
+    AllOutFile->keep();
+    ContainsOutFile->keep();
+
+    errs() << "Import using 'neo4j-admin' command, something like:\n";
+    errs() << "\n";
+
+    errs() << "sudo NEO4J_CONF=/var/lib/neo4j/conf \\\n";
+    errs() << "neo4j-admin import\\\n";
+    errs() << "\t--mode=csv \\\n";
+    errs() << "\t--id-type=INTEGER \\\n";
+    errs() << "\t--nodes:Module=" << ModOut << " \\\n";
+    errs() << "\t--nodes:Function=" << FuncOut << " \\\n";
+    errs() << "\t--nodes:Global=" << GlobalOut << " \\\n";
+    errs() << "\t--nodes:Alias=" << AliasOut << " \\\n";
+    errs() << "\t--nodes:Allexe=" << AllOut << " \\\n";
+    errs() << "\t--relationships:CONTAINS=" << ContainsOut << " \\\n";
+    errs() << "\t--relationships=" << ModGlobalsOut << " \n";
+
+    errs() << "\n";
+    errs() << "Be sure to stop the database and remove it beforehand...\n";
+
+    return Error::success();
   }
+};
 
-  ModOutFile->keep();
-  ModGlobalsOutFile->keep();
-  AliasOutFile->keep();
-  FuncOutFile->keep();
-  GlobalOutFile->keep();
-  AllOutFile->keep();
-  ContainsOutFile->keep();
-
-  errs() << "Import using 'neo4j-admin' command, something like:\n";
-  errs() << "\n";
-
-  errs() << "sudo NEO4J_CONF=/var/lib/neo4j/conf \\\n";
-  errs() << "neo4j-admin import\\\n";
-  errs() << "\t--mode=csv \\\n";
-  errs() << "\t--id-type=INTEGER \\\n";
-  errs() << "\t--nodes:Module=" << ModOut << " \\\n";
-  errs() << "\t--nodes:Function=" << FuncOut << " \\\n";
-  errs() << "\t--nodes:Global=" << GlobalOut << " \\\n";
-  errs() << "\t--nodes:Alias=" << AliasOut << " \\\n";
-  errs() << "\t--nodes:Allexe=" << AllOut << " \\\n";
-  errs() << "\t--relationships:CONTAINS=" << ContainsOut << " \\\n";
-  errs() << "\t--relationships=" << ModGlobalsOut << " \n";
-
-  errs() << "\n";
-  errs() << "Be sure to stop the database and remove it beforehand...\n";
-
-  return Error::success();
-}
+AnalysisRegistration Registered("neocsv", [](StringRef InputDirectory) {
+  return llvm::make_unique<NeoAnalysis>(InputDirectory);
+});
 
 CommandRegistration Unused(&NeoCSV, [](ResourcePaths &RP) -> Error {
   errs() << "Scanning " << InputDirectory << "...\n";
 
-  auto ExpDB = ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
 
   errs() << "Done! Allexes found: " << DB->allexe_size() << "\n";
 
-  return neo(*DB, InputDirectory);
+  NeoAnalysis A(InputDirectory);
+  return runModuleAnalyses(*DB, {&A}, outs());
 });
 
 } // end anonymous namespace
@@ -1,3 +1,5 @@
+#include "ABCDBLoader.h"
+#include "ModuleMapReduce.h"
 #include "subcommand-registry.h"
 
 #include "boost_progress.h"
@@ -8,12 +10,9 @@
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/Module.h>
-#include <llvm/IRReader/IRReader.h>
 #include <llvm/Support/Errc.h>
 #include <llvm/Support/FileSystem.h>
-#include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/ToolOutputFile.h>
-#include <llvm/Transforms/Utils/FunctionComparator.h>
 
 #include <algorithm>
 #include <functional>
@@ -51,13 +50,6 @@ cl::opt<std::string>
               cl::desc("name of file to write globals node data"),
               cl::sub(NeoCSVDecomp));
 
-template <typename T> auto countInsts(const T *V) {
-  return std::accumulate(
-      V->begin(), V->end(), size_t{0},
-      [](auto N, auto &child) { return N + countInsts(&child); });
-}
-template <> auto countInsts(const BasicBlock *B) { return B->size(); }
-
 Expected<std::unique_ptr<tool_output_file>> openFile(StringRef Filename) {
   std::error_code EC;
   auto F = llvm::make_unique<tool_output_file>(Filename, EC,
@@ -116,52 +108,42 @@ Error neo(ABCDB &DB, StringRef Prefix) {
   ModGlobalS << ":START_ID(Module),:END_ID(Global),:TYPE\n";
   size_t GlobalID = 0;
   size_t ModIDCounter = 0;
-  for (auto &MI : DB.getMods()) {
+  auto writeModule = [&](ModuleRef MI, ModuleSummary &&S) -> Error {
 
     auto ModID = ModIDCounter++;
-
-    SMDiagnostic SM;
-    LLVMContext C;
-    auto M = llvm::parseIRFile(MI.Filename, SM, C);
-    if (!M)
-      return make_error<StringError>(
-          "Unable to open module file " + MI.Filename, errc::invalid_argument);
-    if (auto Err = M->materializeAll())
-      return Err;
+    auto Filename = MI.getFilename();
 
     std::string Name =
-        (basename(getWLLVMSource(M.get())) + "-" + basename(MI.Filename)).str();
-    ModS << ModID << "," << Name << "," << removePrefix(MI.Filename) << ","
-         << removePrefix(getWLLVMSource(M.get())) << "\n";
+        (basename(S.WLLVMSource) + "-" + basename(Filename)).str();
+    ModS << ModID << "," << Name << "," << removePrefix(Filename) << ","
+         << removePrefix(S.WLLVMSource) << "\n";
 
-    for (auto &F : *M) {
-      FuncS << GlobalID << "," << F.getName() << ",";
-      if (F.isDeclaration()) {
+    for (auto &F : S.Functions) {
+      FuncS << GlobalID << "," << F.Name << ",";
+      if (F.IsDeclaration) {
         FuncS << "0,0,Declaration\n";
       } else {
-        auto H = FunctionComparator::functionHash(F);
-        FuncS << countInsts(&F) << "," << H << ",Definition\n";
+        FuncS << F.Insts << "," << F.Hash << ",Definition\n";
       }
 
       // Edge property redundant with node label, but oh well
-      auto ModFuncRel = F.isDeclaration() ? "DECLARES" : "DEFINES";
+      auto ModFuncRel = F.IsDeclaration ? "DECLARES" : "DEFINES";
       ModGlobalS << ModID << "," << GlobalID << "," << ModFuncRel << "\n";
 
       ++GlobalID;
     }
 
-    for (auto &G : M->globals()) {
-      auto ModRel = G.isDeclaration() ? "DECLARES" : "DEFINES";
-      auto Label = G.isDeclaration() ? "Declaration" : "Definition";
-      GlobalS << GlobalID << "," << G.getName() << "," << Label << "\n";
+    for (auto &G : S.Globals) {
+      auto ModRel = G.IsDeclaration ? "DECLARES" : "DEFINES";
+      auto Label = G.IsDeclaration ? "Declaration" : "Definition";
+      GlobalS << GlobalID << "," << G.Name << "," << Label << "\n";
       ModGlobalS << ModID << "," << GlobalID << "," << ModRel << "\n";
 
       ++GlobalID;
     };
 
-    for (auto &A : M->aliases()) {
-      AliasS << GlobalID << "," << A.getName() << ","
-             << A.getAliasee()->getName() << "\n";
+    for (auto &A : S.Aliases) {
+      AliasS << GlobalID << "," << A.Name << "," << A.Aliasee << "\n";
 
       ModGlobalS << ModID << "," << GlobalID << ","
                  << "DEFINES\n";
@@ -170,7 +152,13 @@ Error neo(ABCDB &DB, StringRef Prefix) {
     }
 
     ++mod_progress;
-  }
+    return Error::success();
+  };
+  auto summarize = [](ModuleRef M, MemoryBufferRef Contents) {
+    return getModuleSummary(M, Contents);
+  };
+  if (auto Err = mapReduceModuleContents(DB.getMods(), summarize, writeModule))
+    return Err;
 
   ModOutFile->keep();
   ModGlobalsOutFile->keep();
@@ -200,7 +188,7 @@ Error neo(ABCDB &DB, StringRef Prefix) {
 CommandRegistration Unused(&NeoCSVDecomp, [](ResourcePaths &RP) -> Error {
   errs() << "Scanning " << InputDirectory << "...\n";
 
-  auto ExpDB = ABCDB::loadFromBitcodeIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP, /* UseBCScanner */ true);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
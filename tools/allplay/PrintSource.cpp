@@ -1,11 +1,14 @@
 #include "subcommand-registry.h"
 
 #include "allvm-analysis/ModuleFlags.h"
+#include "allvm-analysis/ModuleFlagsReader.h"
 
+#include <llvm/Bitcode/BitcodeReader.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IRReader/IRReader.h>
 #include <llvm/Support/Errc.h>
 #include <llvm/Support/Error.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/raw_ostream.h>
 
@@ -25,22 +28,51 @@ cl::opt<bool> OnlyPrintSource("only-print-source", cl::Optional,
                               cl::init(false),
                               cl::desc("Only print the source (nothing else)"),
                               cl::sub(PrintSource));
+cl::opt<bool> Materialize(
+    "materialize", cl::Optional, cl::init(false), cl::Hidden,
+    cl::desc("Always load the module instead of reading the bitstream"),
+    cl::sub(PrintSource));
 
-CommandRegistration
-Unused(&PrintSource, [](ResourcePaths &RP LLVM_ATTRIBUTE_UNUSED) -> Error {
-  if (!OnlyPrintSource)
-    errs() << "Loading file '" << InputFilename << "'...\n";
+Expected<std::string> getSourceFromModule(MemoryBufferRef Buf) {
   LLVMContext C;
   SMDiagnostic Diag;
-  auto M = parseIRFile(InputFilename, Diag, C);
+  auto M = parseIR(Buf, Diag, C);
   if (!M)
     return make_error<StringError>("Unable to open IR file " + InputFilename,
                                    errc::invalid_argument);
 
   if (auto Err = M->materializeMetadata())
-    return Err;
+    return std::move(Err);
+
+  return getWLLVMSource(M.get());
+}
+
+Expected<std::string> getSource(MemoryBufferRef Buf) {
+  auto *Start = reinterpret_cast<const unsigned char *>(Buf.getBufferStart());
+  auto *End = Start + Buf.getBufferSize();
+  // Textual IR, or asked not to use the bitstream reader
+  if (Materialize || !isBitcode(Start, End))
+    return getSourceFromModule(Buf);
+
+  auto WSrc = readWLLVMSource(Buf);
+  if (!WSrc)
+    return WSrc.takeError();
+  return *WSrc;
+}
+
+CommandRegistration
+Unused(&PrintSource, [](ResourcePaths &RP LLVM_ATTRIBUTE_UNUSED) -> Error {
+  if (!OnlyPrintSource)
+    errs() << "Loading file '" << InputFilename << "'...\n";
+  auto Buf = MemoryBuffer::getFileOrSTDIN(InputFilename);
+  if (!Buf)
+    return make_error<StringError>("Unable to open IR file " + InputFilename,
+                                   Buf.getError());
 
-  auto WSrc = getWLLVMSource(M.get());
+  auto MaybeWSrc = getSource((*Buf)->getMemBufferRef());
+  if (!MaybeWSrc)
+    return MaybeWSrc.takeError();
+  auto &WSrc = *MaybeWSrc;
   if (WSrc.empty()) {
     return make_error<StringError>(
         "Module did not contain WLLVM Source module flag, or invalid",
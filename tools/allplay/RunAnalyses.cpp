@@ -0,0 +1,70 @@
+#include "ABCDBLoader.h"
+#include "ModuleAnalysis.h"
+#include "subcommand-registry.h"
+
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace allvm_analysis;
+using namespace allvm;
+using namespace llvm;
+
+cl::SubCommand &allvm_analysis::getRunSubCommand() {
+  static cl::SubCommand Run(
+      "run", "Run several analyses, loading and summarizing modules once");
+  return Run;
+}
+
+namespace {
+
+cl::opt<std::string> InputDirectory(cl::Positional, cl::Required,
+                                    cl::desc("<input directory to scan>"),
+                                    cl::sub(getRunSubCommand()));
+cl::list<std::string>
+    AnalysisNames("analyses", cl::CommaSeparated, cl::OneOrMore,
+                  cl::desc("Analyses to run, for example "
+                           "'functionhashes,neocsv,asmscan'"),
+                  cl::sub(getRunSubCommand()));
+cl::opt<bool> UseBCScanner("bc-scanner", cl::Optional, cl::init(false),
+                           cl::desc("Use BC scanner instead of allexe scanner"),
+                           cl::sub(getRunSubCommand()));
+
+CommandRegistration Unused(&getRunSubCommand(), [](ResourcePaths &RP) -> Error {
+  std::vector<std::unique_ptr<ModuleAnalysis>> Analyses;
+  StringSet<> Seen;
+  for (auto &Name : AnalysisNames) {
+    // Each would write the same output files.
+    if (!Seen.insert(Name).second)
+      return make_error<StringError>("Analysis '" + Name +
+                                         "' given more than once",
+                                     errc::invalid_argument);
+    auto A = createAnalysis(Name, InputDirectory);
+    if (!A) {
+      errs() << "Available analyses:";
+      for (auto &N : getRegisteredAnalyses())
+        errs() << " " << N;
+      errs() << "\n";
+      return A.takeError();
+    }
+    Analyses.push_back(std::move(*A));
+  }
+
+  errs() << "Scanning " << InputDirectory << "...\n";
+
+  auto ExpDB = loadABCDB(InputDirectory, RP, UseBCScanner);
+  if (!ExpDB)
+    return ExpDB.takeError();
+  auto &DB = *ExpDB;
+
+  errs() << "Done! Allexes found: " << DB->allexe_size() << "\n";
+  errs() << "Done! Modules found: " << DB->getMods().size() << "\n";
+
+  std::vector<ModuleAnalysis *> Ptrs;
+  for (auto &A : Analyses)
+    Ptrs.push_back(A.get());
+  // Analyses' own subcommands differ on this, keep stdout for results.
+  return runModuleAnalyses(*DB, Ptrs, errs());
+});
+
+} // end anonymous namespace
@@ -1,3 +1,4 @@
+#include "ABCDBLoader.h"
 #include "subcommand-registry.h"
 
 // Preserve insert order
@@ -22,11 +23,11 @@ Error toml(ABCDB &DB) {
 
   auto root = cpptoml::make_table();
 
-  for (auto &A : DB.getAllexes()) {
+  for (auto A : DB.getAllexes()) {
     auto modules = cpptoml::make_array();
-    for (auto &M : A.Modules)
-      modules->push_back(M.Filename);
-    root->insert(A.Filename, modules);
+    for (auto M : A.modules())
+      modules->push_back(M.getFilename());
+    root->insert(A.getFilename(), modules);
   }
 
   std::stringstream ss;
@@ -39,7 +40,7 @@ Error toml(ABCDB &DB) {
 
 CommandRegistration Unused(&Toml, [](ResourcePaths &RP) -> Error {
   errs() << "Loading allexe's from " << InputDirectory << "...\n";
-  auto ExpDB = ABCDB::loadFromAllexesIn(InputDirectory, RP);
+  auto ExpDB = loadABCDB(InputDirectory, RP);
   if (!ExpDB)
     return ExpDB.takeError();
   auto &DB = *ExpDB;
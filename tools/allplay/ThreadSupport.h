@@ -0,0 +1,26 @@
+#ifndef ALLPLAY_THREADSUPPORT_H
+#define ALLPLAY_THREADSUPPORT_H
+
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/Error.h>
+
+#include <pthread.h>
+
+namespace allvm_analysis {
+
+// Bump default pthread stack size, musl has conservative default
+// that apparently LLVM isn't happy with when we're splitting things.
+// Must be called before creating threads that work on LLVM IR.
+inline llvm::Error setDefaultThreadStackSize(size_t Size = 8192 * 1024) {
+  ::pthread_attr_t attr;
+  if (::pthread_getattr_default_np(&attr) != 0 ||
+      ::pthread_attr_setstacksize(&attr, Size) != 0 ||
+      ::pthread_setattr_default_np(&attr) != 0)
+    return llvm::make_error<llvm::StringError>(
+        "Error configuring threads", llvm::errc::invalid_argument);
+  return llvm::Error::success();
+}
+
+} // end namespace allvm_analysis
+
+#endif // ALLPLAY_THREADSUPPORT_H
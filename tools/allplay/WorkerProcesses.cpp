@@ -0,0 +1,427 @@
+#include "WorkerProcesses.h"
+
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Errc.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace allvm_analysis;
+using namespace llvm;
+
+namespace {
+
+cl::opt<unsigned> Processes(
+    "processes", cl::Optional, cl::init(0),
+    cl::desc("Do per-module work in this many worker processes "
+             "instead of threads, 0 to use threads"),
+    cl::sub(*cl::AllSubCommands));
+cl::opt<unsigned>
+    RecycleAfter("recycle-after", cl::Optional, cl::init(1000),
+                 cl::desc("Replace worker processes after this many modules"),
+                 cl::sub(*cl::AllSubCommands));
+cl::opt<unsigned> WorkerRSSMB(
+    "worker-rss-mb", cl::Optional, cl::init(4096),
+    cl::desc("Replace worker processes using more than this many MB"),
+    cl::sub(*cl::AllSubCommands));
+
+// Protocol, in native byte order since both ends are the same program:
+//
+// Requests are a uint32_t count followed by that many uint32_t items;
+// a count of zero (or the pipe closing) asks the worker to exit.
+// For each item a worker replies with a header, {item (uint32_t),
+// size (uint32_t), failed (uint8_t)}, followed by size bytes of result,
+// or of error message if failed. A worker about to exit on its own
+// (to be replaced) replies with RetireItem after its last batch.
+const size_t HeaderSize = 4 + 4 + 1;
+const uint32_t RetireItem = UINT32_MAX;
+
+// Items sent to a worker at once.
+const uint32_t BatchSize = 8;
+
+bool writeAll(int FD, const void *Data, size_t Size) {
+  auto *P = static_cast<const char *>(Data);
+  while (Size) {
+    auto R = ::write(FD, P, Size);
+    if (R < 0 && errno == EINTR)
+      continue;
+    if (R <= 0)
+      return false;
+    P += R;
+    Size -= R;
+  }
+  return true;
+}
+
+bool readAll(int FD, void *Data, size_t Size) {
+  auto *P = static_cast<char *>(Data);
+  while (Size) {
+    auto R = ::read(FD, P, Size);
+    if (R < 0 && errno == EINTR)
+      continue;
+    if (R <= 0)
+      return false;
+    P += R;
+    Size -= R;
+  }
+  return true;
+}
+
+bool writeReply(int FD, uint32_t Item, bool Failed, StringRef Data) {
+  char Header[HeaderSize];
+  uint32_t Size = Data.size();
+  std::memcpy(Header, &Item, 4);
+  std::memcpy(Header + 4, &Size, 4);
+  Header[8] = Failed;
+  return writeAll(FD, Header, HeaderSize) &&
+         writeAll(FD, Data.data(), Data.size());
+}
+
+uint64_t residentBytes() {
+  long Pages = 0;
+  if (FILE *F = ::fopen("/proc/self/statm", "r")) {
+    if (::fscanf(F, "%*lu %ld", &Pages) != 1)
+      Pages = 0;
+    ::fclose(F);
+  }
+  return uint64_t(Pages) * uint64_t(::sysconf(_SC_PAGESIZE));
+}
+
+[[noreturn]] void workerMain(int ReqFD, int ResFD, const WorkerMapT &Map) {
+  size_t Done = 0;
+  std::vector<uint32_t> Items;
+  while (true) {
+    uint32_t Count;
+    if (!readAll(ReqFD, &Count, sizeof(Count)) || Count == 0)
+      break;
+    Items.resize(Count);
+    if (!readAll(ReqFD, Items.data(), Count * sizeof(uint32_t)))
+      break;
+
+    for (auto I : Items) {
+      auto R = Map(I);
+      bool Sent = R ? writeReply(ResFD, I, false, *R)
+                    : writeReply(ResFD, I, true, toString(R.takeError()));
+      if (!Sent)
+        ::_exit(1);
+    }
+
+    Done += Count;
+    if (Done >= RecycleAfter ||
+        residentBytes() > (uint64_t(WorkerRSSMB) << 20)) {
+      writeReply(ResFD, RetireItem, false, "");
+      break;
+    }
+  }
+  // Skip destructors and atexit handlers, which are the parent's to run
+  // (and would, for example, remove its unfinished output files).
+  ::_exit(0);
+}
+
+class WorkerPool {
+  struct Worker {
+    pid_t PID;
+    int ReqFD, ResFD;
+    // Items sent and not yet replied to, in order
+    std::deque<uint32_t> InFlight;
+    // Received but not yet parsed
+    std::string Buf;
+    bool Retiring = false;
+  };
+
+  struct Result {
+    enum { Done, Failed, Crashed } Kind;
+    std::string Data;
+  };
+
+  size_t N;
+  const WorkerMapT &Map;
+  const WorkerReduceT &Reduce;
+  const WorkerCrashT &Crash;
+  const WorkerCostT &Cost;
+  uint64_t Budget;
+  // Estimated memory of items handed out and not done yet
+  uint64_t InUse = 0;
+
+  std::vector<Worker> Workers;
+  // Items to send before Next, taken back from workers that died
+  std::deque<uint32_t> Requeued;
+  size_t Next = 0;
+  // Results not yet reduced, keyed by item
+  std::map<size_t, Result> Ready;
+  size_t NextReduce = 0;
+  // How far items are handed out ahead of the one to reduce next,
+  // so results don't pile up behind a slow one.
+  size_t Window;
+
+  std::vector<char> Chunk = std::vector<char>(1 << 16);
+
+  bool haveWork() const {
+    return !Requeued.empty() || Next < std::min(N, NextReduce + Window);
+  }
+
+  // Item to hand out next, if any.
+  bool peek(uint32_t &Item) const {
+    if (!Requeued.empty())
+      Item = Requeued.front();
+    else if (Next < std::min(N, NextReduce + Window))
+      Item = Next;
+    else
+      return false;
+    return true;
+  }
+
+  uint64_t costOf(uint32_t Item) const { return Cost ? Cost(Item) : 0; }
+  bool fits(uint64_t C) const {
+    return InUse == 0 || (InUse <= Budget && C <= Budget - InUse);
+  }
+
+  Error spawn() {
+    int Req[2], Res[2];
+    if (::pipe2(Req, O_CLOEXEC) != 0)
+      return errorCodeToError(std::error_code(errno, std::generic_category()));
+    if (::pipe2(Res, O_CLOEXEC) != 0) {
+      auto EC = std::error_code(errno, std::generic_category());
+      ::close(Req[0]);
+      ::close(Req[1]);
+      return errorCodeToError(EC);
+    }
+
+    // Anything buffered would be written by both processes.
+    outs().flush();
+    errs().flush();
+    ::fflush(nullptr);
+    pid_t PID = ::fork();
+    if (PID == 0) {
+      // Other workers' pipes must only be open in this process,
+      // otherwise their ends aren't seen when they die.
+      for (auto &W : Workers) {
+        ::close(W.ReqFD);
+        ::close(W.ResFD);
+      }
+      ::close(Req[1]);
+      ::close(Res[0]);
+      workerMain(Req[0], Res[1], Map);
+    }
+
+    auto EC = std::error_code(errno, std::generic_category());
+    ::close(Req[0]);
+    ::close(Res[1]);
+    if (PID < 0) {
+      ::close(Req[1]);
+      ::close(Res[0]);
+      return make_error<StringError>("Unable to start worker process", EC);
+    }
+    Workers.push_back({PID, Req[1], Res[0], {}, {}, false});
+    return Error::success();
+  }
+
+  void assign(Worker &W) {
+    if (W.Retiring || !W.InFlight.empty())
+      return;
+    std::vector<uint32_t> Request = {0};
+    uint64_t Share = Budget / Processes, RequestCost = 0;
+    uint32_t Item;
+    while (Request.size() <= BatchSize && peek(Item)) {
+      auto C = costOf(Item);
+      if (!fits(C) || (Request.size() > 1 && RequestCost + C > Share))
+        break;
+      if (!Requeued.empty())
+        Requeued.pop_front();
+      else
+        ++Next;
+      Request.push_back(Item);
+      RequestCost += C;
+      InUse += C;
+    }
+    if (Request.size() == 1)
+      return;
+    Request[0] = Request.size() - 1;
+
+    if (!writeAll(W.ReqFD, Request.data(), Request.size() * sizeof(uint32_t))) {
+      // Worker died while idle; its pipe closing will be seen shortly.
+      for (auto I = Request.begin() + 1; I != Request.end(); ++I)
+        InUse -= costOf(*I);
+      Requeued.insert(Requeued.begin(), Request.begin() + 1, Request.end());
+      W.Retiring = true;
+      return;
+    }
+    W.InFlight.insert(W.InFlight.end(), Request.begin() + 1, Request.end());
+  }
+
+  void parse(Worker &W) {
+    size_t Pos = 0;
+    while (W.Buf.size() - Pos >= HeaderSize) {
+      uint32_t Item, Size;
+      std::memcpy(&Item, &W.Buf[Pos], 4);
+      std::memcpy(&Size, &W.Buf[Pos + 4], 4);
+      bool Failed = W.Buf[Pos + 8];
+      if (W.Buf.size() - Pos - HeaderSize < Size)
+        break;
+
+      if (Item == RetireItem) {
+        W.Retiring = true;
+      } else {
+        assert(!W.InFlight.empty() && W.InFlight.front() == Item &&
+               "Worker replied out of order");
+        W.InFlight.pop_front();
+        InUse -= costOf(Item);
+        Ready[Item] = {Failed ? Result::Failed : Result::Done,
+                       W.Buf.substr(Pos + HeaderSize, Size)};
+      }
+      Pos += HeaderSize + Size;
+    }
+    W.Buf.erase(0, Pos);
+  }
+
+  // Worker's end of the pipe is closed, it's gone (or going).
+  void reap(size_t I) {
+    auto &W = Workers[I];
+    int Status = 0;
+    while (::waitpid(W.PID, &Status, 0) < 0 && errno == EINTR)
+      ;
+    ::close(W.ReqFD);
+    ::close(W.ResFD);
+
+    for (auto Item : W.InFlight)
+      InUse -= costOf(Item);
+    if (W.Retiring) {
+      // It may have been sent a batch before its retirement was seen.
+      Requeued.insert(Requeued.begin(), W.InFlight.begin(), W.InFlight.end());
+    } else if (!W.InFlight.empty()) {
+      std::string Why;
+      if (WIFSIGNALED(Status))
+        Why = "worker process killed by signal " +
+              std::string(::strsignal(WTERMSIG(Status)));
+      else
+        Why = "worker process exited with status " +
+              std::to_string(WEXITSTATUS(Status));
+      // Blame the item it was working on, and hand out the others again.
+      Ready[W.InFlight.front()] = {Result::Crashed, std::move(Why)};
+      W.InFlight.pop_front();
+      Requeued.insert(Requeued.begin(), W.InFlight.begin(), W.InFlight.end());
+    }
+    Workers.erase(Workers.begin() + I);
+  }
+
+  Error flush() {
+    for (auto It = Ready.find(NextReduce); It != Ready.end();
+         It = Ready.find(NextReduce)) {
+      auto R = std::move(It->second);
+      Ready.erase(It);
+      switch (R.Kind) {
+      case Result::Done:
+        if (auto Err = Reduce(NextReduce, R.Data))
+          return Err;
+        break;
+      case Result::Failed:
+        return make_error<StringError>(R.Data, errc::invalid_argument);
+      case Result::Crashed:
+        if (auto Err = Crash(NextReduce, R.Data))
+          return Err;
+        break;
+      }
+      ++NextReduce;
+    }
+    return Error::success();
+  }
+
+  Error loop() {
+    while (NextReduce < N) {
+      while (Workers.size() < Processes && haveWork())
+        if (auto Err = spawn())
+          return Err;
+      for (auto &W : Workers)
+        assign(W);
+      assert(!Workers.empty() && "Items left but no worker for them");
+
+      std::vector<pollfd> FDs;
+      for (auto &W : Workers)
+        FDs.push_back({W.ResFD, POLLIN, 0});
+      if (::poll(FDs.data(), FDs.size(), -1) < 0) {
+        if (errno == EINTR)
+          continue;
+        return errorCodeToError(
+            std::error_code(errno, std::generic_category()));
+      }
+
+      // Backwards, so reaped workers can be removed as we go.
+      for (size_t I = FDs.size(); I-- > 0;) {
+        if (!FDs[I].revents)
+          continue;
+        auto R = ::read(Workers[I].ResFD, Chunk.data(), Chunk.size());
+        if (R < 0 && errno == EINTR)
+          continue;
+        if (R <= 0) {
+          reap(I);
+          continue;
+        }
+        Workers[I].Buf.append(Chunk.data(), R);
+        parse(Workers[I]);
+      }
+
+      if (auto Err = flush())
+        return Err;
+    }
+    return Error::success();
+  }
+
+  // Stop all workers, killing them first if they may be busy.
+  void shutdown(bool Kill) {
+    for (auto &W : Workers) {
+      if (Kill)
+        ::kill(W.PID, SIGKILL);
+      // Idle workers exit when their request pipe is closed.
+      ::close(W.ReqFD);
+      ::close(W.ResFD);
+      while (::waitpid(W.PID, nullptr, 0) < 0 && errno == EINTR)
+        ;
+    }
+    Workers.clear();
+  }
+
+public:
+  WorkerPool(size_t N, const WorkerMapT &Map, const WorkerReduceT &Reduce,
+             const WorkerCrashT &Crash, const WorkerCostT &Cost,
+             uint64_t Budget)
+      : N(N), Map(Map), Reduce(Reduce), Crash(Crash), Cost(Cost),
+        Budget(Budget), Window(4 * size_t(Processes) * BatchSize) {}
+
+  Error run() {
+    // Writing to a worker that died must not kill us too.
+    struct sigaction Ignore, Old;
+    std::memset(&Ignore, 0, sizeof(Ignore));
+    Ignore.sa_handler = SIG_IGN;
+    ::sigaction(SIGPIPE, &Ignore, &Old);
+
+    Error Err = loop();
+    shutdown(bool(Err));
+
+    ::sigaction(SIGPIPE, &Old, nullptr);
+    return Err;
+  }
+};
+
+} // end anonymous namespace
+
+unsigned allvm_analysis::getNumProcesses() { return Processes; }
+
+Error allvm_analysis::forkMapReduce(size_t N, WorkerMapT Map,
+                                    WorkerReduceT Reduce, WorkerCrashT Crash,
+                                    WorkerCostT Cost, uint64_t Budget) {
+  assert(Processes && "Worker processes not requested");
+  assert(N < RetireItem && "Too many items");
+  return WorkerPool(N, Map, Reduce, Crash, Cost, Budget).run();
+}
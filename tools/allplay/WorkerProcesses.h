@@ -0,0 +1,53 @@
+#ifndef ALLPLAY_WORKERPROCESSES_H
+#define ALLPLAY_WORKERPROCESSES_H
+
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Error.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+
+namespace allvm_analysis {
+
+// Number of worker processes requested with -processes,
+// zero if work should be done by threads in this process instead.
+unsigned getNumProcesses();
+
+// Per-item work done in a forked worker process, returning its result
+// in serialized form.
+using WorkerMapT = std::function<llvm::Expected<std::string>(size_t)>;
+// Handling of an item's (serialized) result, in this process.
+using WorkerReduceT = std::function<llvm::Error(size_t, llvm::StringRef)>;
+// Called instead of WorkerReduceT for an item whose worker died
+// while working on it, with a description of what happened.
+using WorkerCrashT = std::function<llvm::Error(size_t, llvm::StringRef)>;
+// Estimated peak memory of working on an item, in bytes.
+using WorkerCostT = std::function<uint64_t(size_t)>;
+
+// Like mapReduceModules, but for items 0..N-1 and using getNumProcesses()
+// forked worker processes instead of threads.
+//
+// Workers are given items in batches and send back results over a pipe.
+// A worker is replaced by a fresh one after -recycle-after items, or once
+// its resident memory is over -worker-rss-mb, so memory lost to
+// fragmentation is given back. If a worker dies (on an assertion, say),
+// the item it was working on is handed to Crash and the rest of its batch
+// to other workers.
+//
+// If Cost is given, items are only handed out while the estimates of
+// all those handed out and not done yet fit in Budget (an item over the
+// whole budget is handed out once nothing else is), as MemoryScheduler
+// does for threads. Batches are then also kept within a worker's share
+// of the budget, so large items are sent one at a time.
+//
+// Reduce and Crash are called in order of items. Stops at the first error
+// returned by Map, Reduce or Crash, which is returned.
+// Nothing may be running on other threads when this is called.
+llvm::Error forkMapReduce(size_t N, WorkerMapT Map, WorkerReduceT Reduce,
+                          WorkerCrashT Crash, WorkerCostT Cost = nullptr,
+                          uint64_t Budget = UINT64_MAX);
+
+} // end namespace allvm_analysis
+
+#endif // ALLPLAY_WORKERPROCESSES_H